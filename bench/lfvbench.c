@@ -0,0 +1,397 @@
+/* lfvbench.c */
+/* Copyright notice is at the end of this file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lfvreader.h"
+
+#define DEFAULT_RUNS 5
+#define PLAIN_SIZE 8000000 /* Chars of generated vector-free code */
+#define NUM_NAME_LINES 100000 /* Lines of generated long Names */
+#define VECTOR_SIZE 1000000 /* Chars of generated code with vectors */
+
+typedef struct bench_input_s {
+	const char*	name;
+	char*		text; /* Allocated with malloc */
+	size_t		len;
+} bench_input;
+
+typedef struct text_buf_s {
+	char*	text;
+	size_t	len, size;
+} text_buf;
+
+/* Vector-free statements that cover most of the grammar */
+static const char* const plainStats[] = {
+	"nA = Normalized2(nA)",
+	"local t2 = {[\"k\"] = 1; [k + 1] = 2, x = nY, nW = nW, 3}",
+	"a = 1-1 b = 2--comment",
+	"local nC, nB = 1, 2, 3, 4, 5, 6",
+	"x = f\"str\" .. g[[long]] .. h{1,2} .. obj:m\"s\" .. obj:n{nQ}",
+	"nRot = nRot * 2 -- comment here",
+	"local f = function(nP) return nP end",
+	"function obj:Method(a) return self, not a, #a, a // 2, a ~= 1, a >= 0 end",
+	"if nA > 0 then nA = -nA elseif nA < -10 then nA = 0 else nA = nA + 0x1Fp2 end",
+	"for i = 1, #t do t[i] = t[i] * 0.5e-3 end",
+	"while nX < 10 do nX = nX + 1 end",
+	"repeat local nK = next(t, nK) until not nK",
+	"for k, nV in pairs(t) do s = s .. k .. '=' .. tostring(nV) .. \"\\n\" end",
+	"do local nTmp = a.b.c:d(e)(f)[g] end",
+	"--[==[ long comment\nspanning lines ]==]",
+};
+
+/* Statements whose vector Names get duplicated */
+static const char* const vectorStats[] = {
+	"local v3A = 1, 2, 3",
+	"local v3B = v3A * 2 + v3A",
+	"v2Pos = v2Pos + v2Vel * dt",
+	"local q4Rot = 0, 0, 0, 1",
+	"t = {v3Pos = v3A, v2Size = 4, 8}",
+	"Draw(v2Pos, v3A + v3B, q4Rot)",
+	"local nLen = math.sqrt(v3A.x * v3A.x + v3A.y * v3A.y + v3A.z * v3A.z)",
+	"if v3A.x > 0 then v3A = -v3A end",
+};
+
+static unsigned long randState = 1;
+
+static int				ReadOptions(int argc, char** argv, int* runsOut, int* firstFileOut);
+static unsigned long	Random(void);
+static void				Append(text_buf* bIO, const char* str);
+static void				GenPlain(bench_input* inOut);
+static void				GenNames(bench_input* inOut);
+static void				GenVectors(bench_input* inOut);
+static int				ReadInput(const char* path, bench_input* inOut);
+static double			ClockMS(void);
+static int				Run(const bench_input* in, int runs);
+
+/*--------------------------------------
+	ReadOptions
+--------------------------------------*/
+static int ReadOptions(int argc, char** argv, int* runs, int* firstFile)
+{
+	int i = 1;
+
+	if(i < argc && !strcmp(argv[i], "-h"))
+	{
+		printf(
+"%s [-h] [-n runs] [inputFile ...]\n"
+"\n"
+"Times forced, streamed expansion of each input, taking the best of runs (default %d).\n"
+"\n"
+"If no inputFile is given, generated inputs are used:\n"
+"  plain    %d chars of vector-free code\n"
+"  names    %d lines of long Names and numerals\n"
+"  vectors  %d chars of code with vector Names\n",
+		argv[0], DEFAULT_RUNS, PLAIN_SIZE, NUM_NAME_LINES, VECTOR_SIZE);
+
+		return 1;
+	}
+
+	if(i < argc && !strcmp(argv[i], "-n"))
+	{
+		if(i + 1 >= argc || (*runs = atoi(argv[i + 1])) < 1)
+		{
+			printf("Expected a positive number of runs after '-n'\n");
+			return 1;
+		}
+
+		i += 2;
+	}
+
+	*firstFile = i;
+	return 0;
+}
+
+/*--------------------------------------
+	Random
+
+Small LCG so the generated inputs are the same on every platform.
+--------------------------------------*/
+static unsigned long Random(void)
+{
+	randState = (randState * 1103515245ul + 12345ul) & 0x7FFFFFFFul;
+	return randState >> 8;
+}
+
+/*--------------------------------------
+	Append
+
+Exits if malloc fails.
+--------------------------------------*/
+static void Append(text_buf* b, const char* str)
+{
+	size_t len = strlen(str);
+
+	if(b->len + len + 1 > b->size)
+	{
+		char* text;
+		size_t size = b->size ? b->size : 4096;
+
+		while(b->len + len + 1 > size)
+			size *= 2;
+
+		if(!(text = realloc(b->text, size)))
+		{
+			printf("Failed to allocate input\n");
+			exit(1);
+		}
+
+		b->text = text;
+		b->size = size;
+	}
+
+	memcpy(b->text + b->len, str, len + 1);
+	b->len += len;
+}
+
+/*--------------------------------------
+	GenPlain
+--------------------------------------*/
+static void GenPlain(bench_input* in)
+{
+	text_buf b = {0, 0, 0};
+	size_t numStats = sizeof(plainStats) / sizeof(plainStats[0]);
+	Append(&b, "LFV_EXPAND_VECTORS()\n");
+
+	while(b.len < PLAIN_SIZE)
+	{
+		int i;
+		Append(&b, "function G()\n");
+
+		for(i = 0; i < 20; i++)
+		{
+			Append(&b, plainStats[Random() % numStats]);
+			Append(&b, "\n");
+		}
+
+		Append(&b, "end\n");
+	}
+
+	in->name = "plain";
+	in->text = b.text;
+	in->len = b.len;
+}
+
+/*--------------------------------------
+	GenNames
+--------------------------------------*/
+static void GenNames(bench_input* in)
+{
+	text_buf b = {0, 0, 0};
+	char line[256];
+	int i;
+	Append(&b, "LFV_EXPAND_VECTORS()\n");
+
+	for(i = 0; i < NUM_NAME_LINES; i++)
+	{
+		sprintf(line, "%*slocal some_really_long_generated_identifier_name_%d = "
+			"another_quite_long_identifier_value_%d + 123456789.123456789e10\n",
+			(int)(Random() % 48), "", i, i);
+
+		Append(&b, line);
+	}
+
+	in->name = "names";
+	in->text = b.text;
+	in->len = b.len;
+}
+
+/*--------------------------------------
+	GenVectors
+--------------------------------------*/
+static void GenVectors(bench_input* in)
+{
+	text_buf b = {0, 0, 0};
+	size_t numPlain = sizeof(plainStats) / sizeof(plainStats[0]);
+	size_t numVector = sizeof(vectorStats) / sizeof(vectorStats[0]);
+	Append(&b, "LFV_EXPAND_VECTORS()\n");
+
+	while(b.len < VECTOR_SIZE)
+	{
+		int i;
+		Append(&b, "function G(v2Vel, dt)\n");
+
+		for(i = 0; i < 20; i++)
+		{
+			Append(&b, i % 2 ? plainStats[Random() % numPlain] : vectorStats[Random() % numVector]);
+			Append(&b, "\n");
+		}
+
+		Append(&b, "end\n");
+	}
+
+	in->name = "vectors";
+	in->text = b.text;
+	in->len = b.len;
+}
+
+/*--------------------------------------
+	ReadInput
+--------------------------------------*/
+static int ReadInput(const char* path, bench_input* in)
+{
+	text_buf b = {0, 0, 0};
+	char piece[4096];
+	size_t numRead;
+	FILE* f = fopen(path, "rb");
+
+	if(!f)
+	{
+		printf("Failed to open '%s'\n", path);
+		return 0;
+	}
+
+	Append(&b, "");
+
+	while((numRead = fread(piece, 1, sizeof(piece) - 1, f)))
+	{
+		piece[numRead] = 0;
+
+		if(strlen(piece) != numRead)
+		{
+			printf("'%s' contains a null char\n", path);
+			fclose(f);
+			free(b.text);
+			return 0;
+		}
+
+		Append(&b, piece);
+	}
+
+	fclose(f);
+	in->name = path;
+	in->text = b.text;
+	in->len = b.len;
+	return 1;
+}
+
+/*--------------------------------------
+	ClockMS
+--------------------------------------*/
+static double ClockMS(void)
+{
+	return clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+/*--------------------------------------
+	Run
+
+Prints the best time of runs expansions of in. in is streamed through lfvReader the way the Lua
+loaders read it, which only uses functions every version of lfv has, so older builds can be timed
+too. Returns 0 on an expansion error.
+--------------------------------------*/
+static int Run(const bench_input* in, int runs)
+{
+	double best = 0.0;
+	size_t numOut = 0;
+	int i;
+
+	for(i = 0; i < runs; i++)
+	{
+		lfv_reader_state rs;
+		size_t size;
+		double start = ClockMS(), time;
+		numOut = 0;
+#if defined(LFV_SCAN_STATS)
+		lfvNumScanned = 0;
+#endif
+
+		if(lfvInitReaderState(in->text, 0, in->name, 1, 1, 0, 0, &rs) == LFV_OK)
+		{
+			while(lfvReader(&rs, &size) && size)
+				numOut += size;
+		}
+
+		if(rs.earliestError)
+		{
+			printf("%-10s expansion error (ln %u): %s\n", in->name, rs.errorLine,
+				rs.earliestError);
+
+			lfvTermReaderState(&rs, 1);
+			return 0;
+		}
+
+		lfvTermReaderState(&rs, 1);
+		time = ClockMS() - start;
+
+		if(!i || time < best)
+			best = time;
+	}
+
+	printf("%-10s %10lu chars in %10lu chars out %9.1f ms", in->name, (unsigned long)in->len,
+		(unsigned long)numOut, best);
+
+#if defined(LFV_SCAN_STATS)
+	printf(" %12llu chars scanned", lfvNumScanned);
+#endif
+
+	printf("\n");
+
+	return 1;
+}
+
+/*--------------------------------------
+	main
+--------------------------------------*/
+int main(int argc, char** argv)
+{
+	int runs = DEFAULT_RUNS, firstFile, ok = 1, i;
+
+	if(ReadOptions(argc, argv, &runs, &firstFile))
+		return 1;
+
+	printf("Best processor time of %d forced streamed expansions\n", runs);
+
+	if(firstFile == argc)
+	{
+		void (* const gens[])(bench_input*) = {GenPlain, GenNames, GenVectors};
+
+		for(i = 0; i < 3; i++)
+		{
+			bench_input in;
+			gens[i](&in);
+			ok &= Run(&in, runs);
+			free(in.text);
+		}
+	}
+	else
+	{
+		for(i = firstFile; i < argc; i++)
+		{
+			bench_input in;
+
+			if(!ReadInput(argv[i], &in))
+			{
+				ok = 0;
+				continue;
+			}
+
+			ok &= Run(&in, runs);
+			free(in.text);
+		}
+	}
+
+	return !ok;
+}
+
+/*
+Copyright (C) 2025 Martynas Ceicys
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
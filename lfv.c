@@ -5,9 +5,72 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if !defined(LFV_NO_SIMD)
+	#if defined(__AVX2__)
+		#include <immintrin.h>
+		#define LFV_SIMD_AVX2
+	#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#include <emmintrin.h>
+		#define LFV_SIMD_SSE2
+	#endif
+#endif
+
+#if defined(_MSC_VER) && (defined(LFV_SIMD_AVX2) || defined(LFV_SIMD_SSE2))
+	#include <intrin.h>
+#endif
+
+#if defined(LFV_USE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#define LFV_MMAP
+#endif
+
+#if !defined(LFV_NO_MONOTONIC) && (defined(__unix__) || defined(__APPLE__)) && \
+	defined(CLOCK_MONOTONIC)
+	#define LFV_MONOTONIC
+#endif
+
+#if !defined(LFV_NO_THREADS)
+	#if defined(_WIN32)
+		#define WIN32_LEAN_AND_MEAN
+		#define NOMINMAX
+		#include <windows.h>
+		#define LFV_WIN32_THREADS
+	#else
+		#include <pthread.h>
+		#define LFV_PTHREADS
+	#endif
+
+	#define LFV_THREADS
+#endif
+
+#include <fcntl.h>
+
+#if defined(_WIN32)
+	#include <io.h>
+	#include <process.h>
+	#include <sys/stat.h>
+	#define GET_PID() _getpid()
+	#define OPEN_NEW(path) _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, \
+		_S_IREAD | _S_IWRITE)
+	#define FDOPEN _fdopen
+	#define CLOSE_FD _close
+#else
+	#include <unistd.h>
+	#define GET_PID() getpid()
+	#define OPEN_NEW(path) open(path, O_WRONLY | O_CREAT | O_EXCL, 0666)
+	#define FDOPEN fdopen
+	#define CLOSE_FD close
+#endif
+
+#define TEMP_FILE_TRIES 100
 
 #include "lfv.h"
 #include "lfvreader.h"
@@ -17,17 +80,42 @@
 #define FALSE 0
 #define TRUE 1
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define SYNTAX_ERR(str) (SetReaderError(s, str, line, LFV_ERR_SYNTAX), EXPAND_ERR)
 #define RUNTIME_ERR(str) (SetReaderError(s, str, line, LFV_ERR_RUNTIME), EXPAND_ERR)
 #define IDENTIFIER_CHARS "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz"
 #define NUMERAL_CHARS    "0123456789ABCDEFPXabcdefpx+-."
 #define WHITESPACE_CHARS " \t\n\f\r"
-#define INIT_BUF_SIZE 256
+#define INIT_BUF_SIZE 256 /* Default read size */
+#define MIN_READ_SIZE 16 /* Smallest read size allowed by lfvContextSetOptions */
+#define PASS_BUF_SIZE 4096 /* Buffer size for streaming a file that isn't being expanded */
+#define MIN_MAP_SIZE 65536 /* Smaller files are cheaper to read with stdio than to map */
+#define LOG_FLUSH_SIZE 65536 /* Default bytes an lfv_log_buffer batches before writing */
+#define LOG_REC_SIZE 256 /* Initial size of a reader state's log record */
+#define DISK_READ_SIZE 16384 /* Chars hashed at a time by lfvHashFile */
+#define DISK_MAGIC "lfv cache " /* Start of a cache file, see DISK_HEADER_FORMAT */
+
+/* 128-bit hash of the source as 32 hex digits, then lengths of the source and text as 16 each. The
+text follows. */
+#define DISK_HEADER_FORMAT DISK_MAGIC "%016llx%016llx %016llx %016llx\n"
+#define DISK_HEADER_SIZE (sizeof(DISK_MAGIC) - 1 + 67)
+#define HASH_OFFSET_HI 0x6c62272e07bb0142ULL /* 128-bit FNV-1a */
+#define HASH_OFFSET_LO 0x62b821756295c58dULL
+#define HASH_PRIME_LOW_BITS 0x13b /* The prime is 2^88 + 0x13b */
+#define RATIO_MIN_INPUT 4096 /* Input chars maxOutputRatio allows output for at least */
 #define LOG_PREFIX "-- LFV: "
 #define STRINGIFY(x) STRINGIFY_(x)
 #define STRINGIFY_(x) #x
 #define BINARY_SIGNATURE "\x1bLua"
 
+/* Character classes, see charClasses */
+#define CC_IDENTIFIER	0x01 /* IDENTIFIER_CHARS */
+#define CC_DIGIT		0x02 /* 0-9 */
+#define CC_HEX			0x04 /* 0-9, A-F, a-f */
+#define CC_NUMERAL		0x08 /* NUMERAL_CHARS */
+#define CC_WHITESPACE	0x10 /* WHITESPACE_CHARS */
+#define CHAR_CLASS(c) (charClasses[(unsigned char)(c)])
+
 enum
 {
 	/* Expansion return values */
@@ -41,14 +129,295 @@ enum
 	EXPAND_INIT_FORCE
 };
 
+/* lfv_token kinds */
+enum
+{
+	LEX_NONE, /* Not lexed; lex is invalid */
+	LEX_NAME, /* Identifier chars not starting with a digit */
+	LEX_NUMERAL, /* Identifier chars starting with a digit */
+	LEX_OTHER /* No identifier chars */
+};
+
+/* lfv_token keywords */
+enum
+{
+	KW_NONE,
+	KW_AND, KW_BREAK, KW_DO, KW_ELSE, KW_ELSEIF, KW_END, KW_FALSE, KW_FOR, KW_FUNCTION, KW_GOTO,
+	KW_IF, KW_IN, KW_LOCAL, KW_NIL, KW_NOT, KW_OR, KW_REPEAT, KW_RETURN, KW_THEN, KW_TRUE,
+	KW_UNTIL, KW_WHILE
+};
+
 typedef struct delayed_duplication_s {
 	size_t expStart, marksStart;
 } delayed_duplication;
 
+/* Result of a Resume* function that pushed a frame; the frame below resumes when it returns */
+#define FRAME_PUSHED -1
+
+/* Result of CloseBlock when the block continues with another part, e.g. after 'elseif exp then' */
+#define BLOCK_REOPENED -2
+
+/* How an open_block ends */
+enum
+{
+	CLOSE_END, /* 'end' */
+	CLOSE_UNTIL, /* 'until' exp */
+	CLOSE_IF /* 'elseif' exp 'then' block, 'else' block or 'end' */
+};
+
+typedef struct lfv_open_block_s {
+	int			closer;
+	unsigned	line; /* Line of the stat, for errors */
+	const char*	blockMsg; /* Error if the block is bad */
+	const char*	closeMsg; /* Error if the block is not closed */
+} open_block;
+
+/* exp_frame kinds */
+enum
+{
+	FRAME_EXP,
+	FRAME_EXPLIST,
+	FRAME_ARGS,
+	FRAME_TABLE /* tableconstructor, its fieldlist and the current field */
+};
+
+/* exp_frame steps, the point the frame resumes at when the frame above returns */
+enum
+{
+	EXP_STEP_START = 0, EXP_STEP_TABLE, EXP_STEP_CALL, EXP_STEP_INDEX
+};
+
+enum
+{
+	EXPLIST_STEP_START = 0, EXPLIST_STEP_FIRST, EXPLIST_STEP_NEXT
+};
+
+enum
+{
+	ARGS_STEP_START = 0, ARGS_STEP_EXPLIST
+};
+
+enum
+{
+	TABLE_STEP_START = 0, TABLE_STEP_KEY, TABLE_STEP_KEY_VALUE, TABLE_STEP_EXP, TABLE_STEP_VALUE
+};
+
+typedef struct lfv_exp_frame_s {
+	int			kind, step;
+	unsigned	line;
+	size_t		start, saveNumMarks; /* tok and numMarks when pushed */
+
+	/* FRAME_EXP */
+	int			hang; /* Next token should be a ref or value (true on start and after operator) */
+	int			ref; /* Last token completed a potential object reference (callable/accessible) */
+	int			par; /* Parenthesis level, expression ends if below 0 */
+	int			delay; /* Leave vector Names marked and fill dd of the frame below */
+
+	/* FRAME_TABLE */
+	size_t		marksStart, prepComps, remExps, mergeableEnd; /* Left-hand vector prep */
+	unsigned	fieldLine;
+	size_t		fieldSaveNumMarks, markedVecComps, markedExps;
+	delayed_duplication dd; /* Filled by a delayed exp in the current field */
+} exp_frame;
+
+/* Buffers kept between reader states, see lfvInitContextReaderState */
+struct lfv_context_s {
+	lfv_alloc	alloc; /* Allocates the context and its buffers */
+	void*		allocUd;
+	int			busy; /* A reader state is using the buffers */
+	lfv_options	opts;
+	lfv_writer	logWrite; /* Log sink, see lfvContextSetLogSink */
+	void*		logUd;
+	char*		buf;
+	size_t		bufSize;
+	size_t*		marks;
+	size_t		numMarksAlloc;
+	exp_frame*	frames;
+	size_t		numFramesAlloc;
+	open_block*	blocks;
+	size_t		numBlocksAlloc;
+};
+
+/* Where a top-level stat ends, see lfvReexpandString */
+typedef struct lfv_stat_bound_s {
+	size_t		in, out; /* Char index in the chunk and in its expansion */
+	unsigned	line;
+} stat_bound;
+
+struct lfv_incremental_s {
+	int			valid; /* in, out and bounds are from a successful expansion */
+	int			force;
+	char*		in; /* Copy of the last chunk */
+	size_t		numIn, inAlloc;
+	char*		out; /* Null-terminated expansion of in */
+	size_t		numOut, outAlloc;
+	stat_bound*	bounds; /* Ends of in's top-level stats, ascending */
+	size_t		numBounds, boundsAlloc;
+	char*		mid; /* Expansion of the stats being expanded again */
+	size_t		numMid, midAlloc;
+	stat_bound*	midBounds;
+	size_t		numMidBounds, midBoundsAlloc;
+	lfv_context	ctx; /* Reader buffers for re-expansion */
+};
+
+/* Reader state at the start of an lfvReader call with fed input, restored if the fed chars run
+out before the call's stat is done */
+typedef struct lfv_feed_point_s {
+	size_t		in; /* Index in the fed chars of s->buf[s->tok] */
+	size_t		tok, numBuf, tokSize, beforeSkip;
+	unsigned	line, level;
+	lfv_token	lex;
+	size_t		numMarks, numFrames, numBlocks;
+	size_t		numRead, numInserted, numDups;
+	open_block	topBlock; /* CloseBlock may change the innermost block */
+	int			topResult;
+	const char*	earliestError;
+	unsigned	errorLine;
+	int			errorCode;
+} feed_point;
+
+struct lfv_feed_s {
+	lfv_reader_state rs;
+	lfv_alloc	alloc; /* Allocates the feed and in */
+	void*		allocUd;
+	lfv_writer	write;
+	void*		writeUd;
+	char*		in; /* Fed chars from the start of the stat being expanded */
+	size_t		numIn, inAlloc;
+	size_t		vecScan; /* Index in in before which FindVectorPrefix found no prefix */
+	int			finished; /* lfvFinish was called, no more chars are coming */
+	int			starved; /* The last lfvReader call ran out of fed chars */
+	feed_point	point;
+};
+
+/* See lfvNewLogBuffer. The thread swaps buf with out and writes out while buf takes more logs. */
+struct lfv_log_buffer_s {
+	FILE*		f;
+	char*		buf; /* Logs not yet taken by the thread */
+	size_t		numBuf, bufSize;
+	char*		out; /* Logs being written by the thread */
+	size_t		outSize;
+	size_t		flushSize;
+	unsigned long numFlushes; /* lfvFlushLogBuffer calls so far */
+	unsigned long numFlushed; /* numFlushes when the thread last finished writing */
+	int			stop; /* lfvFreeLogBuffer was called */
+#if defined(LFV_PTHREADS)
+	pthread_t	thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t wake, written;
+#elif defined(LFV_WIN32_THREADS)
+	HANDLE		thread;
+	CRITICAL_SECTION mutex;
+	CONDITION_VARIABLE wake, written;
+#endif
+};
+
+#if defined(LFV_PTHREADS)
+	#define LOCK_LOG(b) pthread_mutex_lock(&(b)->mutex)
+	#define UNLOCK_LOG(b) pthread_mutex_unlock(&(b)->mutex)
+	#define WAIT_LOG(b, cond) pthread_cond_wait(&(b)->cond, &(b)->mutex)
+	#define SIGNAL_LOG(b, cond) pthread_cond_broadcast(&(b)->cond)
+#elif defined(LFV_WIN32_THREADS)
+	#define LOCK_LOG(b) EnterCriticalSection(&(b)->mutex)
+	#define UNLOCK_LOG(b) LeaveCriticalSection(&(b)->mutex)
+	#define WAIT_LOG(b, cond) SleepConditionVariableCS(&(b)->cond, &(b)->mutex, INFINITE)
+	#define SIGNAL_LOG(b, cond) WakeAllConditionVariable(&(b)->cond)
+#else
+	#define LOCK_LOG(b) ((void)0)
+	#define UNLOCK_LOG(b) ((void)0)
+#endif
+
+#define LOG_MAX_BATCHES 16 /* lfvLogBufferWrite waits for the thread past this many batches */
+
+/* Output of lfvExpandFileTo that's also written to the disk cache, see WriteTee */
+typedef struct lfv_disk_tee_s {
+	lfv_writer		write;
+	void*			ud;
+	lfv_disk_cache*	dc;
+} disk_tee;
+
+/* Directory set by lfvSetCacheDir, 0 if none */
+static char* cacheDir = 0;
+
+#if defined(LFV_PTHREADS)
+	static pthread_mutex_t cacheDirMutex = PTHREAD_MUTEX_INITIALIZER;
+	#define LOCK_CACHE_DIR() pthread_mutex_lock(&cacheDirMutex)
+	#define UNLOCK_CACHE_DIR() pthread_mutex_unlock(&cacheDirMutex)
+#elif defined(LFV_WIN32_THREADS)
+	static SRWLOCK cacheDirLock = SRWLOCK_INIT;
+	#define LOCK_CACHE_DIR() AcquireSRWLockExclusive(&cacheDirLock)
+	#define UNLOCK_CACHE_DIR() ReleaseSRWLockExclusive(&cacheDirLock)
+#else
+	#define LOCK_CACHE_DIR() ((void)0)
+	#define UNLOCK_CACHE_DIR() ((void)0)
+#endif
+
+/* Class bits of every byte value; bytes >= 0x80 belong to no class */
+#define CC_W CC_WHITESPACE
+#define CC_N CC_NUMERAL
+#define CC_D (CC_IDENTIFIER | CC_DIGIT | CC_HEX | CC_NUMERAL)
+#define CC_H (CC_IDENTIFIER | CC_HEX | CC_NUMERAL)
+#define CC_P (CC_IDENTIFIER | CC_NUMERAL)
+#define CC_I CC_IDENTIFIER
+
+static const unsigned char charClasses[256] = {
+	/* 0x00 */ 0,    0,    0,    0,    0,    0,    0,    0,    0,    CC_W, CC_W, 0,    CC_W, CC_W, 0,    0,
+	/* 0x10 */ 0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+	/* 0x20 */ CC_W, 0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    CC_N, 0,    CC_N, CC_N, 0,
+	/* 0x30 */ CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, CC_D, 0,    0,    0,    0,    0,    0,
+	/* 0x40 */ 0,    CC_H, CC_H, CC_H, CC_H, CC_H, CC_H, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,
+	/* 0x50 */ CC_P, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_P, CC_I, CC_I, 0,    0,    0,    0,    CC_I,
+	/* 0x60 */ 0,    CC_H, CC_H, CC_H, CC_H, CC_H, CC_H, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I,
+	/* 0x70 */ CC_P, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_I, CC_P, CC_I, CC_I, 0,    0,    0,    0,    0
+};
+
+#undef CC_W
+#undef CC_N
+#undef CC_D
+#undef CC_H
+#undef CC_P
+#undef CC_I
+
+static const char*	ExpandChunk(lfv_context* ctxIO, const char* chunk, size_t len,
+					const char* name, int forceExpand, const char* logPath, const char** errMsgOut,
+					unsigned* errLineOut);
+static int			ExpandTo(lfv_reader_state* sIO, int initErr, lfv_writer write, void* ud,
+					const char** errMsgOut, unsigned* errLineOut);
+static int			InitReaderState(lfv_context* ctxIO, const char* chunk, size_t chunkLen,
+					FILE* file, lfv_source read, void* readUd, lfv_feed* feedIO, const char* name,
+					int force, int stream, int skipBOMPound, const char* logPath,
+					lfv_reader_state* sOut);
+static int			WriteFed(lfv_feed* feedIO);
+static void			SaveFeedPoint(lfv_reader_state* sIO);
+static void			RestoreFeedPoint(lfv_reader_state* sIO);
+#if defined(LFV_THREADS)
+static void			RunLogBuffer(lfv_log_buffer* bIO);
+#endif
+#if defined(LFV_PTHREADS)
+static void*		LogBufferThread(void* bIO);
+#elif defined(LFV_WIN32_THREADS)
+static DWORD WINAPI	LogBufferThread(LPVOID bIO);
+#endif
+static int			HasCacheDir(void);
+static int			ReadDiskCache(lfv_disk_cache* dcIO);
+static int			WriteTee(const void* p, size_t size, void* ud);
+static void			HashBytes(const void* p, size_t len, lfv_file_hash* hashIO);
+static void*		DefaultAlloc(void* ud, void* ptr, size_t oldSize, size_t newSize);
+static void			FreeContextBuffers(lfv_context* ctxIO);
+static int			ExpandIncremental(lfv_incremental* incIO, const char* chunk, size_t len,
+					size_t from, size_t sufStart, const char** errMsgOut, unsigned* errLineOut);
+static size_t		CountBoundsUpTo(const stat_bound* bounds, size_t num, size_t in);
 static char*		ReaderNoSetJmp(void* dataIO, size_t* sizeOut);
 static void			SetReaderError(lfv_reader_state* sIO, const char* str, unsigned line, int code);
+static int			OpenLog(lfv_reader_state* sIO);
+static void			LogWrite(lfv_reader_state* sIO, const char* str, size_t len);
+static void			LogPrintf(lfv_reader_state* sIO, const char* format, ...);
+static void			CloseLog(lfv_reader_state* sIO);
 static int			ExpandBlock(lfv_reader_state* sIO);
 static int			ExpandStat(lfv_reader_state* sIO);
+static int			ExpandStatBlock(lfv_reader_state* sIO, unsigned line, int closer,
+					const char* blockMsg, const char* closeMsg);
+static int			CloseBlock(lfv_reader_state* sIO, open_block* bIO);
 static int			ExpandAttnamelist(lfv_reader_state* sIO);
 static int			ExpandAttname(lfv_reader_state* sIO);
 static int			ExpandAttrib(lfv_reader_state* sIO);
@@ -59,14 +428,15 @@ static int			ExpandNumeral(lfv_reader_state* sIO);
 static int			ExpandString(lfv_reader_state* sIO);
 static int			ExpandFuncname(lfv_reader_state* sIO);
 static int			ExpandExplist(lfv_reader_state* sIO);
-static int			ExpandExp(lfv_reader_state* sIO, delayed_duplication* ddOut);
-static int			ExpandArgs(lfv_reader_state* sIO);
+static int			ExpandExp(lfv_reader_state* sIO);
+static int			RunExpFrames(lfv_reader_state* sIO, size_t base);
+static int			ResumeExp(lfv_reader_state* sIO, int res);
+static int			StartArgs(lfv_reader_state* sIO);
+static int			ResumeExplist(lfv_reader_state* sIO, int res);
+static int			ResumeArgs(lfv_reader_state* sIO, int res);
 static int			ExpandFunctiondef(lfv_reader_state* sIO);
 static int			ExpandFuncbody(lfv_reader_state* sIO);
-static int			ExpandTableconstructor(lfv_reader_state* sIO);
-static int			ExpandFieldlist(lfv_reader_state* sIO);
-static int			ExpandField(lfv_reader_state* sIO, size_t* markedVecCompsOut,
-					size_t* markedExpsOut);
+static int			ResumeTable(lfv_reader_state* sIO, int res);
 static int			ExpandFieldsep(lfv_reader_state* sIO);
 static int			ExpandBinop(lfv_reader_state* sIO);
 static int			ExpandUnop(lfv_reader_state* sIO);
@@ -77,15 +447,23 @@ static int			MergeFields(lfv_reader_state* sIO, unsigned line, size_t marksStart
 static const char*	CheckMarkPrefix(const lfv_reader_state* s, size_t markIndex,
 					size_t* compsOut);
 static void			SkipBOMAndPound(lfv_reader_state* sIO);
-static size_t		WhitespaceSpan(const char* str, unsigned* lineIO);
+static size_t		WhitespaceSpan(const char* str, size_t len, unsigned* lineIO);
 static void			ConsumeToken(lfv_reader_state* sIO);
 static void			EraseToken(lfv_reader_state* sIO);
 static void			NextTokenNoSkip(lfv_reader_state* sIO, size_t* afterConsumeOut);
 static void			NextTokenSkipCom(lfv_reader_state* sIO);
 static size_t		ExtendToken(lfv_reader_state* sIO, const char* set);
 static size_t		ExtendCToken(lfv_reader_state* sIO, const char* cset);
+static size_t		ExtendTokenClass(lfv_reader_state* sIO, int cls);
+static void			SetLexedToken(lfv_reader_state* sIO);
+static int			KeywordID(const char* str, size_t len);
 static size_t		ExtendTokenSize(lfv_reader_state* sIO, size_t size);
+static size_t		SeekCSet(lfv_reader_state* sIO, size_t from, const char* cset);
+static int			FindVectorPrefix(lfv_reader_state* sIO);
+static void			MapFile(lfv_reader_state* sIO);
+static void			NextChunk(lfv_reader_state* sIO);
 static size_t		ReadMore(lfv_reader_state* sIO);
+static size_t		ReadMoreSize(lfv_reader_state* sIO, size_t size);
 static int			EqualToken(const lfv_reader_state* s, const char* cmp);
 static int			TokenStartsWith(const lfv_reader_state* s, const char* cmp);
 static int			StringStartsWith(const char* str, size_t len, const char* cmp);
@@ -97,16 +475,25 @@ static void			CopyShiftRight(lfv_reader_state* sIO, size_t start, size_t amount,
 static size_t		EOFCheckedFRead(void* dstBuf, size_t elementSize, size_t count,
 					FILE* stream);
 static const char*	StrChrNull(const char* str, int ch);
-static size_t		CopyStringNoTerm(char* destIO, const char* str, size_t maxNum);
+static size_t		ClassSpan(const char* str, size_t len, int cls);
+static size_t		CSetSpan(const char* str, size_t len, const char* cset);
+static unsigned		CountNewlines(const char* str, size_t len);
+static size_t		VectorPrefixSpan(const char* str, size_t len);
+static size_t		CommonPrefix(const char* a, const char* b, size_t n);
+static size_t		CommonSuffix(const char* aEnd, const char* bEnd, size_t n);
 static size_t		CeilPow2(size_t n);
 static void			SetEmptyBufferSize(lfv_reader_state* sIO);
 static size_t		EnsureBufSize(lfv_reader_state* sIO, size_t n, int doMemJmp);
 static size_t		EnsureNumMarksAlloc(lfv_reader_state* sIO, size_t n, int doMemJmp);
-static void*		ReallocOrFree(void* mem, size_t newSize);
+static size_t		PushExpFrame(lfv_reader_state* sIO, int kind);
+static void*		ReallocOrFree(lfv_reader_state* s, void* mem, size_t oldSize, size_t newSize);
+static void*		ReserveArray(void* mem, size_t* allocIO, size_t n, size_t elementSize);
 static size_t		AddMark(lfv_reader_state* sIO, size_t c);
 static void			RemoveMarks(lfv_reader_state* sIO, size_t start, size_t num);
 static size_t		AddSizeT(lfv_reader_state* sIO, size_t a, size_t b);
 static size_t		MulSizeT(lfv_reader_state* sIO, size_t a, size_t b);
+static void			CheckLimits(lfv_reader_state* sIO);
+static double		ClockMS(void);
 static void			IncRecursionLevel(lfv_reader_state* sIO);
 static void			DecRecursionLevel(lfv_reader_state* sIO);
 static int			BinaryScript(const lfv_reader_state* s);
@@ -118,9 +505,11 @@ char* lfvExpandFile(const char* filePath, int forceExpand, const char* logPath,
 	const char** errMsg, unsigned* errLine)
 {
 	lfv_reader_state rs;
+	lfv_disk_cache dc;
 	FILE* f;
 	char* ret = 0;
 	size_t retSize = 0;
+	int useDisk;
 
 	if(errMsg) *errMsg = 0;
 	if(errLine) *errLine = 0;
@@ -136,6 +525,18 @@ char* lfvExpandFile(const char* filePath, int forceExpand, const char* logPath,
 		return 0;
 	}
 
+	useDisk = filePath && !logPath && lfvOpenDiskCache(f, forceExpand, &dc);
+
+	if(useDisk && dc.text)
+	{
+		/* Cached, hand over the text */
+		ret = dc.text;
+		dc.text = 0;
+		lfvCloseDiskCache(&dc, FALSE);
+		fclose(f);
+		return ret;
+	}
+
 	if(!lfvInitReaderState(0, f, filePath ? filePath : "stdin", forceExpand, FALSE, TRUE,
 	logPath, &rs))
 		ret = lfvReader(&rs, &retSize);
@@ -148,10 +549,21 @@ char* lfvExpandFile(const char* filePath, int forceExpand, const char* logPath,
 		if(errMsg) *errMsg = rs.earliestError;
 		if(errLine) *errLine = rs.errorLine;
 		lfvTermReaderState(&rs, TRUE);
+
+		if(useDisk)
+			lfvCloseDiskCache(&dc, FALSE);
+
 		return 0;
 	}
 
 	lfvTermReaderState(&rs, FALSE);
+
+	if(useDisk)
+	{
+		lfvWriteDiskCache(ret, retSize, &dc);
+		lfvCloseDiskCache(&dc, TRUE);
+	}
+
 	return ret;
 }
 
@@ -161,26 +573,17 @@ char* lfvExpandFile(const char* filePath, int forceExpand, const char* logPath,
 char* lfvExpandString(const char* chunk, int forceExpand, const char* logPath,
 	const char** errMsg, unsigned* errLine)
 {
-	lfv_reader_state rs;
-	char* ret = 0;
-	size_t retSize = 0;
-	
-	if(errMsg) *errMsg = 0;
-	if(errLine) *errLine = 0;
-
-	if(!lfvInitReaderState(chunk, 0, chunk, forceExpand, FALSE, FALSE, logPath, &rs))
-		ret = lfvReader(&rs, &retSize);
-	
-	if(rs.earliestError)
-	{
-		if(errMsg) *errMsg = rs.earliestError;
-		if(errLine) *errLine = rs.errorLine;
-		lfvTermReaderState(&rs, TRUE);
-		return 0;
-	}
+	return (char*)ExpandChunk(0, chunk, LFV_NULL_TERMINATED, chunk, forceExpand, logPath, errMsg,
+		errLine);
+}
 
-	lfvTermReaderState(&rs, FALSE);
-	return ret;
+/*--------------------------------------
+	lfvExpandStringN
+--------------------------------------*/
+char* lfvExpandStringN(const char* chunk, size_t len, int forceExpand, const char* logPath,
+	const char** errMsg, unsigned* errLine)
+{
+	return (char*)ExpandChunk(0, chunk, len, 0, forceExpand, logPath, errMsg, errLine);
 }
 
 /*--------------------------------------
@@ -193,205 +596,1812 @@ void lfvFreeBuffer(char* buf)
 }
 
 /*--------------------------------------
-	lfvReader
+	lfvExpandFileTo
+--------------------------------------*/
+int lfvExpandFileTo(const char* filePath, int forceExpand, const char* logPath, lfv_writer write,
+	void* ud, const char** errMsg, unsigned* errLine)
+{
+	lfv_reader_state rs;
+	lfv_disk_cache dc;
+	disk_tee tee;
+	FILE* f;
+	int ret, useDisk;
 
-Returns data->buf. *data must be a lfv_reader_state initialized with lfvInitReaderState. *size
-is set to the length of the returned buf that has been preprocessed and is ready to be sent to
-the Lua interpreter.
+	if(filePath)
+		f = fopen(filePath, "r");
+	else
+		f = stdin;
 
-If data->streamThruBuf is 1, keep calling until *size is 0.
+	if(!f)
+	{
+		if(errMsg) *errMsg = strerror(errno);
+		if(errLine) *errLine = 0;
+		return 0;
+	}
 
-If data->streamThruBuf is 0, call once to get the entire null-terminated result. *size does not
-include the null terminator.
+	useDisk = filePath && !logPath && lfvOpenDiskCache(f, forceExpand, &dc);
 
-On failed malloc, sets data's error info and does longjmp to data->memErrJmp.
+	if(useDisk && dc.text)
+	{
+		/* Cached, no reader needed */
+		if(errMsg) *errMsg = 0;
+		if(errLine) *errLine = 0;
+		ret = !dc.textLen || !write(dc.text, dc.textLen, ud);
+
+		if(!ret && errMsg)
+			*errMsg = "Failed to write output";
+	}
+	else
+	{
+		/* On a miss, the output is also written to the cache as it's streamed */
+		tee.write = write;
+		tee.ud = ud;
+		tee.dc = &dc;
+		ret = ExpandTo(&rs, lfvInitReaderState(0, f, filePath ? filePath : "stdin", forceExpand,
+			TRUE, TRUE, logPath, &rs), useDisk ? WriteTee : write, useDisk ? (void*)&tee : ud,
+			errMsg, errLine);
+	}
+
+	if(filePath)
+		fclose(f);
+
+	if(useDisk)
+		lfvCloseDiskCache(&dc, ret);
+
+	return ret;
+}
+
+/*--------------------------------------
+	lfvExpandStringTo
 --------------------------------------*/
-char* lfvReader(void* data, size_t* size)
+int lfvExpandStringTo(const char* chunk, int forceExpand, const char* logPath, lfv_writer write,
+	void* ud, const char** errMsg, unsigned* errLine)
 {
-	lfv_reader_state* s = (lfv_reader_state*)data;
+	lfv_reader_state rs;
 
-	if(!setjmp(s->memErrJmp))
-		return ReaderNoSetJmp(data, size);
+	return ExpandTo(&rs, lfvInitReaderState(chunk, 0, chunk, forceExpand, TRUE, FALSE, logPath,
+		&rs), write, ud, errMsg, errLine);
+}
 
-	/* After longjmp */
-	*size = 0;
-	return 0;
+/*--------------------------------------
+	lfvExpandStringNTo
+--------------------------------------*/
+int lfvExpandStringNTo(const char* chunk, size_t len, int forceExpand, const char* logPath,
+	lfv_writer write, void* ud, const char** errMsg, unsigned* errLine)
+{
+	lfv_reader_state rs;
+
+	return ExpandTo(&rs, lfvInitContextReaderState(0, chunk, len, 0, 0, forceExpand, TRUE, FALSE,
+		logPath, &rs), write, ud, errMsg, errLine);
 }
 
 /*--------------------------------------
-	lfvInitReaderState
+	lfvExpandSourceTo
+--------------------------------------*/
+int lfvExpandSourceTo(lfv_source read, void* readUd, const char* name, int forceExpand,
+	const char* logPath, lfv_writer write, void* ud, const char** errMsg, unsigned* errLine)
+{
+	lfv_reader_state rs;
 
-Returns LFV_OK (0) on success. Otherwise, sets error info in s and returns error code.
+	return ExpandTo(&rs, lfvInitSourceReaderState(0, read, readUd, name, forceExpand, TRUE, TRUE,
+		logPath, &rs), write, ud, errMsg, errLine);
+}
+
+/*--------------------------------------
+	lfvSetCacheDir
 --------------------------------------*/
-int lfvInitReaderState(const char* chunk, FILE* file, const char* name, int force, int stream,
-	int skipBOMPound, const char* logPath, lfv_reader_state* s)
+int lfvSetCacheDir(const char* dir)
 {
-	s->level = 0;
-	s->streamThruBuf = stream;
-	s->skipBOMAndPound = skipBOMPound;
-	s->chk = chunk;
-	s->f = file;
-	s->name = name;
-	s->buf = 0;
-	s->bufSize = 0;
-	s->numBuf = 0;
-	s->tok = 0;
-	s->tokSize = 0;
-	s->line = 1;
-	s->beforeSkip = 0;
-	s->marks = 0;
-	s->numMarks = 0;
-	s->numMarksAlloc = 0;
-	s->topResult = force ? EXPAND_INIT_FORCE : EXPAND_INIT;
-	s->earliestError = 0;
-	s->errorLine = 0;
-	s->errorCode = LFV_OK;
-	s->log = 0;
-	s->logPath = logPath;
+	char *copy = 0, *old;
 
-	if(s->chk)
+	if(dir && *dir)
 	{
-		/* Given a string */
-		size_t chkLen = strlen(s->chk);
-		s->f = 0;
+		size_t len = strlen(dir);
 
-		if(s->streamThruBuf)
-			s->numBuf = MIN(chkLen, INIT_BUF_SIZE - 1); /* Allocate buffer for partial copy */
-		else
-			s->numBuf = chkLen; /* Allocate buffer to fit the whole thing */
+		if(!(copy = (char*)malloc(len + 1)))
+			return 0;
 
-		s->bufSize = s->numBuf + 1;
-		s->buf = (char*)malloc(s->bufSize);
+		memcpy(copy, dir, len + 1);
+	}
 
-		if(!s->buf)
-		{
-			SetReaderError(s, "Failed to malloc buf", s->line, LFV_ERR_MEMORY);
-			SetEmptyBufferSize(s);
-			return s->errorCode;
-		}
+	LOCK_CACHE_DIR();
+	old = cacheDir;
+	cacheDir = copy;
+	UNLOCK_CACHE_DIR();
+	free(old);
+	return 1;
+}
 
-		s->chk += CopyStringNoTerm(s->buf, s->chk, s->numBuf);
-		s->buf[s->numBuf] = 0;
-	}
-	else if(s->f)
-	{
-		/* Only given a file, allocate buffer and initialize with first read */
-		if(!EnsureBufSize(s, INIT_BUF_SIZE, FALSE))
-			return s->errorCode;
+/*--------------------------------------
+	lfvNewFeed
+--------------------------------------*/
+lfv_feed* lfvNewFeed(lfv_context* ctx, const char* name, int forceExpand, const char* logPath,
+	lfv_writer write, void* ud)
+{
+	lfv_alloc alloc = ctx ? ctx->alloc : DefaultAlloc;
+	void* allocUd = ctx ? ctx->allocUd : 0;
+	lfv_feed* feed = (lfv_feed*)alloc(allocUd, 0, 0, sizeof(lfv_feed));
 
-		if(!s->buf) /* Suppress warning */
-		{
-			SetReaderError(s, "s->buf is null", s->line, LFV_ERR_RUNTIME);
-			return s->errorCode;
-		}
+	if(!feed)
+		return 0;
 
-		s->numBuf = EOFCheckedFRead(s->buf, 1, INIT_BUF_SIZE - 1, s->f);
-		s->buf[s->numBuf] = 0;
-	}
+	memset(feed, 0, sizeof(lfv_feed));
+	feed->alloc = alloc;
+	feed->allocUd = allocUd;
+	feed->write = write;
+	feed->writeUd = ud;
 
-	if(BinaryScript(s))
+	if(InitReaderState(ctx, 0, 0, 0, 0, 0, feed, name, forceExpand, TRUE, TRUE, logPath,
+	&feed->rs))
 	{
-		SetReaderError(s, "Chunk is precompiled binary", s->line, LFV_ERR_BINARY);
-		return s->errorCode;
+		lfvFreeFeed(feed);
+		return 0;
 	}
 
-	return s->errorCode;
+	return feed;
 }
 
 /*--------------------------------------
-	lfvTermReaderState
+	lfvFeed
+
+Chars before the stat being expanded have been written and are released before appending, so in
+only grows past the longest stat plus the largest feed.
 --------------------------------------*/
-void lfvTermReaderState(lfv_reader_state* s, int freeBuf)
+int lfvFeed(lfv_feed* feed, const char* data, size_t len)
 {
-	if(freeBuf && s->buf)
+	lfv_reader_state* s = &feed->rs;
+	size_t drop, keep;
+
+	if(s->earliestError)
+		return 0;
+
+	if(feed->finished)
 	{
-		free(s->buf);
-		s->buf = 0;
+		SetReaderError(s, "Fed after lfvFinish", s->line, LFV_ERR_RUNTIME);
+		return 0;
 	}
 
-	if(s->marks)
+	drop = (s->chk ? (size_t)(s->chk - feed->in) : 0) - (s->numBuf - s->tok);
+	keep = feed->numIn - drop;
+
+	if(drop)
 	{
-		free(s->marks);
-		s->marks = 0;
+		memmove(feed->in, feed->in + drop, keep);
+		feed->vecScan = feed->vecScan > drop ? feed->vecScan - drop : 0;
+		feed->numIn = keep;
 	}
 
-	if(s->log)
+	if(feed->inAlloc - keep < len)
 	{
-		fputc('\n', s->log);
-		fclose(s->log);
-		s->log = 0;
+		size_t newAlloc = keep + len < keep ? 0 : CeilPow2(keep + len);
+		char* newIn = 0;
+
+		if(s->maxMemory && newAlloc - feed->inAlloc > s->maxMemory - MIN(s->memUsed, s->maxMemory))
+		{
+			SetReaderError(s, "Exceeded memory limit", s->line, LFV_ERR_MEMORY);
+			return 0;
+		}
+
+		if(newAlloc)
+			newIn = (char*)feed->alloc(feed->allocUd, feed->in, feed->inAlloc, newAlloc);
+
+		if(!newIn)
+		{
+			SetReaderError(s, "Failed to buffer fed chars", s->line, LFV_ERR_MEMORY);
+			return 0;
+		}
+
+		s->memUsed += newAlloc - feed->inAlloc;
+		feed->in = newIn;
+		feed->inAlloc = newAlloc;
 	}
+
+	if(len)
+		memcpy(feed->in + keep, data, len);
+
+	feed->numIn = keep + len;
+	s->chk = feed->in + (s->numBuf - s->tok);
+	s->chkEnd = feed->in + feed->numIn;
+	return WriteFed(feed);
 }
 
 /*--------------------------------------
-	lfvTruncatedName
+	lfvFinish
 --------------------------------------*/
-char* lfvTruncatedName(const char* name, char* buf, size_t size)
+int lfvFinish(lfv_feed* feed, const char** errMsg, unsigned* errLine)
 {
-	const size_t NUM_DOTS = 3;
-	size_t len = 0;
-	for(; len < size - 1 && name[len] && name[len] != '\n'; len++);
-	memcpy(buf, name, len);
-	buf[len] = 0;
+	lfv_reader_state* s = &feed->rs;
 
-	if(name[len])
+	if(!feed->finished && !s->earliestError)
 	{
-		/* Truncated, append dots */
-		size_t i;
-		size_t end = MIN(size - 1, len + NUM_DOTS);
-		buf[end] = 0;
-
-		for(i = 0; i < NUM_DOTS && end; i++)
-			buf[--end] = '.';
+		feed->finished = TRUE;
+		WriteFed(feed);
 	}
 
-	return buf;
+	feed->finished = TRUE;
+
+	if(errMsg) *errMsg = s->earliestError;
+	if(errLine) *errLine = s->earliestError ? s->errorLine : 0;
+	return !s->earliestError;
 }
 
 /*--------------------------------------
-	lfvResolveName
+	lfvFreeFeed
 --------------------------------------*/
-const char* lfvResolveName(const lfv_reader_state* s, char* buf, size_t size)
+void lfvFreeFeed(lfv_feed* feed)
 {
-	if(s->name)
-		return s->f ? s->name : lfvTruncatedName(s->name, buf, size);
-	else
-		return s->f ? "file" : "string";
+	if(!feed)
+		return;
+
+	lfvTermReaderState(&feed->rs, TRUE);
+
+	if(feed->in)
+		feed->alloc(feed->allocUd, feed->in, feed->inAlloc, 0);
+
+	feed->alloc(feed->allocUd, feed, sizeof(lfv_feed), 0);
 }
 
 /*--------------------------------------
-	ReaderNoSetJmp
+	lfvNewContext
+--------------------------------------*/
+lfv_context* lfvNewContext(void)
+{
+	return lfvNewContextAlloc(0, 0);
+}
 
-Don't call this directly, call lfvReader.
+/*--------------------------------------
+	lfvNewContextAlloc
 --------------------------------------*/
-static char* ReaderNoSetJmp(void* data, size_t* size)
+lfv_context* lfvNewContextAlloc(lfv_alloc alloc, void* ud)
 {
-	char nameBuf[LFV_NAME_BUF_SIZE];
-	lfv_reader_state* s = (lfv_reader_state*)data;
-	*size = 0;
+	lfv_context* ctx;
 
-	if(!s->buf || s->topResult == EXPAND_ERR)
-		return 0;
+	if(!alloc)
+		alloc = DefaultAlloc;
 
-	/* Flush characters sent out last call */
-	if(s->tok && s->numBuf > s->tok)
-	{
-		size_t i;
+	ctx = (lfv_context*)alloc(ud, 0, 0, sizeof(lfv_context));
 
-		for(i = s->tok; i < s->numBuf; i++)
-			s->buf[i - s->tok] = s->buf[i];
+	if(!ctx)
+		return 0;
+
+	memset(ctx, 0, sizeof(lfv_context));
+	ctx->alloc = alloc;
+	ctx->allocUd = ud;
+	return ctx;
+}
+
+/*--------------------------------------
+	lfvContextSetOptions
+--------------------------------------*/
+void lfvContextSetOptions(lfv_context* ctx, const lfv_options* opts)
+{
+	ctx->opts = *opts;
+
+	if(ctx->opts.readSize && ctx->opts.readSize < MIN_READ_SIZE)
+		ctx->opts.readSize = MIN_READ_SIZE;
+}
+
+/*--------------------------------------
+	lfvContextSetLogSink
+--------------------------------------*/
+void lfvContextSetLogSink(lfv_context* ctx, lfv_writer write, void* ud)
+{
+	ctx->logWrite = write;
+	ctx->logUd = write ? ud : 0;
+}
+
+/*--------------------------------------
+	lfvContextExpandFile
+--------------------------------------*/
+const char* lfvContextExpandFile(lfv_context* ctx, const char* filePath, int forceExpand,
+	const char* logPath, const char** errMsg, unsigned* errLine)
+{
+	lfv_reader_state rs;
+	FILE* f;
+	const char* ret = 0;
+	size_t retSize = 0;
+
+	if(errMsg) *errMsg = 0;
+	if(errLine) *errLine = 0;
+
+	if(ctx->busy)
+	{
+		if(errMsg) *errMsg = "Context is in use";
+		return 0;
+	}
+
+	if(filePath)
+		f = fopen(filePath, "r");
+	else
+		f = stdin;
+
+	if(!f)
+	{
+		if(errMsg) *errMsg = strerror(errno);
+		return 0;
+	}
+
+	if(!lfvInitContextReaderState(ctx, 0, 0, f, filePath ? filePath : "stdin", forceExpand,
+	FALSE, TRUE, logPath, &rs))
+		ret = lfvReader(&rs, &retSize);
+
+	if(filePath)
+		fclose(f);
+
+	if(rs.earliestError)
+	{
+		if(errMsg) *errMsg = rs.earliestError;
+		if(errLine) *errLine = rs.errorLine;
+		ret = 0;
+	}
+
+	lfvTermReaderState(&rs, TRUE);
+	return ret;
+}
+
+/*--------------------------------------
+	lfvContextExpandString
+--------------------------------------*/
+const char* lfvContextExpandString(lfv_context* ctx, const char* chunk, int forceExpand,
+	const char* logPath, const char** errMsg, unsigned* errLine)
+{
+	if(ctx->busy)
+	{
+		if(errMsg) *errMsg = "Context is in use";
+		if(errLine) *errLine = 0;
+		return 0;
+	}
+
+	return ExpandChunk(ctx, chunk, LFV_NULL_TERMINATED, chunk, forceExpand, logPath, errMsg,
+		errLine);
+}
+
+/*--------------------------------------
+	lfvContextExpandStringN
+--------------------------------------*/
+const char* lfvContextExpandStringN(lfv_context* ctx, const char* chunk, size_t len,
+	int forceExpand, const char* logPath, const char** errMsg, unsigned* errLine)
+{
+	if(ctx->busy)
+	{
+		if(errMsg) *errMsg = "Context is in use";
+		if(errLine) *errLine = 0;
+		return 0;
+	}
+
+	return ExpandChunk(ctx, chunk, len, 0, forceExpand, logPath, errMsg, errLine);
+}
+
+/*--------------------------------------
+	lfvFreeContext
+--------------------------------------*/
+void lfvFreeContext(lfv_context* ctx)
+{
+	if(!ctx)
+		return;
+
+	FreeContextBuffers(ctx);
+	ctx->alloc(ctx->allocUd, ctx, sizeof(lfv_context), 0);
+}
+
+/*--------------------------------------
+	lfvNewIncremental
+--------------------------------------*/
+lfv_incremental* lfvNewIncremental(void)
+{
+	lfv_incremental* inc = (lfv_incremental*)calloc(1, sizeof(lfv_incremental));
+
+	if(inc)
+		inc->ctx.alloc = DefaultAlloc;
+
+	return inc;
+}
+
+/*--------------------------------------
+	lfvReexpandString
+
+A top-level stat's expansion only depends on its own chars and on the first token after it, which
+decides where the stat ends. So if stat k + 1 ends before the first changed char, everything up to
+the end of stat k is kept and expansion restarts there. Once a restarted stat ends in the unchanged
+suffix at a char where an old stat also ended, the rest of the old expansion is moved into place
+instead of being expanded again.
+
+Finding the changed chars and splicing are memcmp/memmove passes over the chunk; only the
+restarted stats are parsed.
+
+If the restarted stats fail to expand, the whole chunk is expanded so that errors and vector-free
+chunks are handled exactly like lfvExpandString does.
+--------------------------------------*/
+const char* lfvReexpandString(lfv_incremental* inc, const char* chunk, int forceExpand,
+	const char** errMsg, unsigned* errLine)
+{
+	size_t len = strlen(chunk);
+
+	if(errMsg) *errMsg = 0;
+	if(errLine) *errLine = 0;
+
+	if(inc->valid && inc->force == forceExpand)
+	{
+		size_t pre = CommonPrefix(chunk, inc->in, MIN(len, inc->numIn));
+		size_t suf, numKept;
+
+		if(pre == len && len == inc->numIn)
+			return inc->out; /* Unchanged */
+
+		suf = CommonSuffix(chunk + len, inc->in + inc->numIn, MIN(len, inc->numIn) - pre);
+		numKept = CountBoundsUpTo(inc->bounds, inc->numBounds, pre);
+
+		/* The last stat that ends before the change may end differently now, keep the ones
+		before it */
+		if(numKept >= 2 && ExpandIncremental(inc, chunk, len, numKept - 1, len - suf, 0, 0))
+			return inc->out;
+	}
+
+	/* Expand everything */
+	inc->numOut = inc->numBounds = 0;
+	inc->force = forceExpand;
+
+	if(!ExpandIncremental(inc, chunk, len, 0, len, errMsg, errLine))
+		return 0;
+
+	return inc->out;
+}
+
+/*--------------------------------------
+	lfvFreeIncremental
+--------------------------------------*/
+void lfvFreeIncremental(lfv_incremental* inc)
+{
+	if(!inc)
+		return;
+
+	free(inc->in);
+	free(inc->out);
+	free(inc->bounds);
+	free(inc->mid);
+	free(inc->midBounds);
+	FreeContextBuffers(&inc->ctx);
+	free(inc);
+}
+
+/*--------------------------------------
+	lfvNewLogBuffer
+--------------------------------------*/
+lfv_log_buffer* lfvNewLogBuffer(const char* path, size_t flushSize)
+{
+	lfv_log_buffer* b = (lfv_log_buffer*)calloc(1, sizeof(lfv_log_buffer));
+
+	if(!b)
+		return 0;
+
+	b->flushSize = flushSize ? flushSize : LOG_FLUSH_SIZE;
+
+	if(!(b->f = fopen(path, "a")))
+	{
+		free(b);
+		return 0;
+	}
+
+#if defined(LFV_PTHREADS)
+	pthread_mutex_init(&b->mutex, 0);
+	pthread_cond_init(&b->wake, 0);
+	pthread_cond_init(&b->written, 0);
+
+	if(pthread_create(&b->thread, 0, LogBufferThread, b))
+	{
+		pthread_cond_destroy(&b->written);
+		pthread_cond_destroy(&b->wake);
+		pthread_mutex_destroy(&b->mutex);
+		fclose(b->f);
+		free(b);
+		return 0;
+	}
+#elif defined(LFV_WIN32_THREADS)
+	InitializeCriticalSection(&b->mutex);
+	InitializeConditionVariable(&b->wake);
+	InitializeConditionVariable(&b->written);
+
+	if(!(b->thread = CreateThread(0, 0, LogBufferThread, b, 0, 0)))
+	{
+		DeleteCriticalSection(&b->mutex);
+		fclose(b->f);
+		free(b);
+		return 0;
+	}
+#endif
+
+	return b;
+}
+
+/*--------------------------------------
+	lfvLogBufferWrite
+
+If the thread falls more than LOG_MAX_BATCHES batches behind, waits for it to catch up rather than
+letting the logs pile up in memory.
+--------------------------------------*/
+int lfvLogBufferWrite(const void* p, size_t size, void* ud)
+{
+	lfv_log_buffer* b = (lfv_log_buffer*)ud;
+	int ret = 0;
+	LOCK_LOG(b);
+
+#if defined(LFV_THREADS)
+	while(b->numBuf && b->numBuf / LOG_MAX_BATCHES >= b->flushSize)
+		WAIT_LOG(b, written);
+#endif
+
+	if(b->bufSize - b->numBuf < size)
+	{
+		size_t newSize = CeilPow2(b->numBuf + size);
+		char* newBuf;
+
+		if(b->numBuf + size < size || !(newBuf = (char*)realloc(b->buf, newSize)))
+			ret = 1;
+		else
+		{
+			b->buf = newBuf;
+			b->bufSize = newSize;
+		}
+	}
+
+	if(!ret)
+	{
+		memcpy(b->buf + b->numBuf, p, size);
+		b->numBuf += size;
+
+		if(b->numBuf >= b->flushSize)
+		{
+#if defined(LFV_THREADS)
+			SIGNAL_LOG(b, wake);
+#else
+			fwrite(b->buf, 1, b->numBuf, b->f);
+			fflush(b->f);
+			b->numBuf = 0;
+#endif
+		}
+	}
+
+	UNLOCK_LOG(b);
+	return ret;
+}
+
+/*--------------------------------------
+	lfvFlushLogBuffer
+--------------------------------------*/
+void lfvFlushLogBuffer(lfv_log_buffer* b)
+{
+	LOCK_LOG(b);
+
+#if defined(LFV_THREADS)
+	{
+		unsigned long flush = ++b->numFlushes;
+		SIGNAL_LOG(b, wake);
+
+		while(b->numFlushed < flush)
+			WAIT_LOG(b, written);
+	}
+#else
+	fwrite(b->buf, 1, b->numBuf, b->f);
+	fflush(b->f);
+	b->numBuf = 0;
+#endif
+
+	UNLOCK_LOG(b);
+}
+
+/*--------------------------------------
+	lfvFreeLogBuffer
+--------------------------------------*/
+void lfvFreeLogBuffer(lfv_log_buffer* b)
+{
+	if(!b)
+		return;
+
+#if defined(LFV_THREADS)
+	/* Thread writes what's left before it returns */
+	LOCK_LOG(b);
+	b->stop = TRUE;
+	SIGNAL_LOG(b, wake);
+	UNLOCK_LOG(b);
+#endif
+
+#if defined(LFV_PTHREADS)
+	pthread_join(b->thread, 0);
+	pthread_cond_destroy(&b->written);
+	pthread_cond_destroy(&b->wake);
+	pthread_mutex_destroy(&b->mutex);
+#elif defined(LFV_WIN32_THREADS)
+	WaitForSingleObject(b->thread, INFINITE);
+	CloseHandle(b->thread);
+	DeleteCriticalSection(&b->mutex);
+#else
+	fwrite(b->buf, 1, b->numBuf, b->f);
+#endif
+
+	fclose(b->f);
+	free(b->buf);
+	free(b->out);
+	free(b);
+}
+
+/*--------------------------------------
+	lfvReader
+
+Returns a pointer into data->buf. *data must be a lfv_reader_state initialized with
+lfvInitReaderState. When streaming a string, mapped file or source that isn't being expanded, the
+rest of it is returned in place after the buffer is sent. *size is set to the length of the
+returned buf that has been preprocessed and is ready to be sent to the Lua interpreter.
+
+If data->streamThruBuf is 1, keep calling until *size is 0.
+
+If data->streamThruBuf is 0, call once to get the entire null-terminated result, which is
+data->buf itself. *size does not include the null terminator.
+
+On failed malloc, sets data's error info and does longjmp to data->memErrJmp.
+--------------------------------------*/
+char* lfvReader(void* data, size_t* size)
+{
+	lfv_reader_state* s = (lfv_reader_state*)data;
+	char* ret;
+
+	/* Only time spent in here counts toward s->maxTime, so start as if earlier calls' time was
+	spent in this one */
+	if(s->maxTime)
+		s->timeStart = ClockMS() - s->timeUsed;
+
+	if(!setjmp(s->memErrJmp))
+		ret = ReaderNoSetJmp(data, size);
+	else
+	{
+		/* After longjmp */
+		if(s->feed && s->feed->starved)
+			RestoreFeedPoint(s); /* Ran out of fed chars, try again when more come */
+
+		*size = 0;
+		ret = 0;
+	}
+
+	if(s->maxTime)
+		s->timeUsed = ClockMS() - s->timeStart;
+
+	return ret;
+}
+
+/*--------------------------------------
+	lfvInitReaderState
+
+Returns LFV_OK (0) on success. Otherwise, sets error info in s and returns error code.
+--------------------------------------*/
+int lfvInitReaderState(const char* chunk, FILE* file, const char* name, int force, int stream,
+	int skipBOMPound, const char* logPath, lfv_reader_state* s)
+{
+	return lfvInitContextReaderState(0, chunk, LFV_NULL_TERMINATED, file, name, force, stream,
+		skipBOMPound, logPath, s);
+}
+
+/*--------------------------------------
+	lfvInitContextReaderState
+
+Like lfvInitReaderState, but s uses ctx's buffers instead of allocating its own, and
+lfvTermReaderState gives them back to ctx, grown as needed. ctx can be 0. If ctx is already lent
+to another reader state, e.g. by a nested call, s allocates its own buffers.
+
+Either way, s allocates with ctx's allocator.
+
+chunkLen is the number of chars in chunk, which may include null chars, or LFV_NULL_TERMINATED.
+chunk is read in place as needed rather than copied up front.
+--------------------------------------*/
+int lfvInitContextReaderState(lfv_context* ctx, const char* chunk, size_t chunkLen, FILE* file,
+	const char* name, int force, int stream, int skipBOMPound, const char* logPath,
+	lfv_reader_state* s)
+{
+	return InitReaderState(ctx, chunk, chunkLen, file, 0, 0, 0, name, force, stream, skipBOMPound,
+		logPath, s);
+}
+
+/*--------------------------------------
+	lfvInitSourceReaderState
+
+Like lfvInitContextReaderState, but the script is pulled from read as the reader needs it.
+--------------------------------------*/
+int lfvInitSourceReaderState(lfv_context* ctx, lfv_source read, void* readUd, const char* name,
+	int force, int stream, int skipBOMPound, const char* logPath, lfv_reader_state* s)
+{
+	return InitReaderState(ctx, 0, 0, 0, read, readUd, 0, name, force, stream, skipBOMPound,
+		logPath, s);
+}
+
+/*--------------------------------------
+	lfvTermReaderState
+--------------------------------------*/
+void lfvTermReaderState(lfv_reader_state* s, int freeBuf)
+{
+	if(s->ctx)
+	{
+		/* Give buffers back, including buf regardless of freeBuf */
+		lfv_context* ctx = s->ctx;
+		ctx->buf = s->buf;
+		ctx->bufSize = s->buf ? s->bufSize : 0;
+		ctx->marks = s->marks;
+		ctx->numMarksAlloc = s->marks ? s->numMarksAlloc : 0;
+		ctx->frames = s->frames;
+		ctx->numFramesAlloc = s->frames ? s->numFramesAlloc : 0;
+		ctx->blocks = s->blocks;
+		ctx->numBlocksAlloc = s->blocks ? s->numBlocksAlloc : 0;
+		ctx->busy = FALSE;
+		s->ctx = 0;
+		s->buf = 0;
+		s->marks = 0;
+		s->frames = 0;
+		s->blocks = 0;
+	}
+
+	if(freeBuf && s->buf)
+	{
+		s->alloc(s->allocUd, s->buf, s->bufSize, 0);
+		s->buf = 0;
+	}
+
+	if(s->marks)
+	{
+		s->alloc(s->allocUd, s->marks, s->numMarksAlloc * sizeof(size_t), 0);
+		s->marks = 0;
+	}
+
+	if(s->frames)
+	{
+		s->alloc(s->allocUd, s->frames, s->numFramesAlloc * sizeof(exp_frame), 0);
+		s->frames = 0;
+	}
+
+	if(s->blocks)
+	{
+		s->alloc(s->allocUd, s->blocks, s->numBlocksAlloc * sizeof(open_block), 0);
+		s->blocks = 0;
+	}
+
+	if(s->log || s->logRec)
+	{
+		LogWrite(s, "\n", 1);
+		CloseLog(s);
+	}
+
+#if defined(LFV_MMAP)
+	if(s->map)
+	{
+		munmap(s->map, s->mapSize);
+		s->map = 0;
+	}
+#endif
+}
+
+/*--------------------------------------
+	lfvTruncatedName
+--------------------------------------*/
+char* lfvTruncatedName(const char* name, char* buf, size_t size)
+{
+	const size_t NUM_DOTS = 3;
+	size_t len = 0;
+	for(; len < size - 1 && name[len] && name[len] != '\n'; len++);
+	memcpy(buf, name, len);
+	buf[len] = 0;
+
+	if(name[len])
+	{
+		/* Truncated, append dots */
+		size_t i;
+		size_t end = MIN(size - 1, len + NUM_DOTS);
+		buf[end] = 0;
+
+		for(i = 0; i < NUM_DOTS && end; i++)
+			buf[--end] = '.';
+	}
+
+	return buf;
+}
+
+/*--------------------------------------
+	lfvResolveName
+--------------------------------------*/
+const char* lfvResolveName(const lfv_reader_state* s, char* buf, size_t size)
+{
+	if(s->name)
+		return s->f || s->src || s->feed ? s->name : lfvTruncatedName(s->name, buf, size);
+	else
+		return s->f ? "file" : s->src || s->feed ? "source" : "string";
+}
+
+/*--------------------------------------
+	lfvOpenDiskCache
+
+Looks up the expansion of file in the cache directory set with lfvSetCacheDir. file is hashed with
+lfvHashFile, so it must be seekable. Returns 0 if there's no cache directory or file can't be read
+twice; dc isn't touched and file is read as it would be otherwise.
+
+The cache file is named after the file's 128-bit hash and length, and its header repeats them, so
+a hit costs hashing the file and one read of the expansion. The hash is wide enough that files
+colliding by accident isn't a concern; a cache directory others can write to is, see
+lfvSetCacheDir.
+
+If 1 is returned, dc must be closed with lfvCloseDiskCache. dc->text is the cached expansion if
+there is one. Otherwise, the expansion should be passed to lfvWriteDiskCache as it's made, and
+lfvCloseDiskCache stores it if the expansion succeeded. file is rewound either way.
+--------------------------------------*/
+int lfvOpenDiskCache(FILE* f, int force, lfv_disk_cache* dc)
+{
+	lfv_file_hash hash;
+
+	if(!HasCacheDir() || !lfvHashFile(f, force, &hash))
+		return FALSE;
+
+	return lfvOpenHashedDiskCache(&hash, dc);
+}
+
+/*--------------------------------------
+	lfvOpenHashedDiskCache
+
+Like lfvOpenDiskCache, but for a file the caller already hashed with lfvHashFile, so it isn't read
+again. hash must have been made with the force flag the file is expanded with.
+--------------------------------------*/
+int lfvOpenHashedDiskCache(const lfv_file_hash* hash, lfv_disk_cache* dc)
+{
+	char name[80];
+
+	/* Name the file after the hash and length of the contents */
+	sprintf(name, "%016llx%016llx-%llx.lua", hash->hi, hash->lo, hash->len);
+
+	if(!lfvDiskCachePath(name, dc->path, sizeof(dc->path)))
+		return FALSE;
+
+	dc->hash = *hash;
+	dc->text = 0;
+	dc->textLen = 0;
+	dc->numTmp = 0;
+	dc->tmpErr = FALSE;
+
+	if(ReadDiskCache(dc))
+	{
+		dc->tmp = 0;
+		return TRUE;
+	}
+
+	/* Missed; the text length in the header is filled in by lfvCloseDiskCache */
+	if((dc->tmp = lfvCreateTempFile(dc->path, dc->tmpPath, sizeof(dc->tmpPath))) &&
+	fprintf(dc->tmp, DISK_HEADER_FORMAT, dc->hash.hi, dc->hash.lo, dc->hash.len, 0ULL) !=
+	(int)DISK_HEADER_SIZE)
+		dc->tmpErr = TRUE;
+
+	return TRUE;
+}
+
+/*--------------------------------------
+	lfvWriteDiskCache
+
+lfv_writer that appends to the temp file of dc, a lfv_disk_cache. A failed write stops the
+expansion from being stored but doesn't fail it, so 0 is always returned.
+--------------------------------------*/
+int lfvWriteDiskCache(const void* p, size_t size, void* ud)
+{
+	lfv_disk_cache* dc = (lfv_disk_cache*)ud;
+
+	if(dc->tmp && !dc->tmpErr && size)
+	{
+		if(fwrite(p, 1, size, dc->tmp) != size)
+			dc->tmpErr = TRUE;
+
+		dc->numTmp += size;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------
+	lfvCloseDiskCache
+
+Frees dc->text. If store is true and the whole expansion was written, the temp file is renamed
+into the cache; otherwise, it's removed.
+--------------------------------------*/
+void lfvCloseDiskCache(lfv_disk_cache* dc, int store)
+{
+	free(dc->text);
+	dc->text = 0;
+
+	if(!dc->tmp)
+		return;
+
+	store = store && !dc->tmpErr && !fseek(dc->tmp, 0, SEEK_SET) &&
+		fprintf(dc->tmp, DISK_HEADER_FORMAT, dc->hash.hi, dc->hash.lo, dc->hash.len,
+		(unsigned long long)dc->numTmp) == (int)DISK_HEADER_SIZE;
+
+	lfvPublishTempFile(dc->tmp, dc->tmpPath, dc->path, store);
+	dc->tmp = 0;
+}
+
+/*--------------------------------------
+	lfvHashFile
+
+Hashes all of file with LFV_VERSION and the force flag, then rewinds it. Returns 0 if file can't
+be read twice, e.g. if it's a pipe.
+--------------------------------------*/
+int lfvHashFile(FILE* f, int force, lfv_file_hash* hash)
+{
+	char buf[DISK_READ_SIZE];
+	char forceByte = force != 0;
+	size_t n;
+	int failed;
+
+	if(fseek(f, 0, SEEK_SET))
+		return FALSE;
+
+	hash->hi = HASH_OFFSET_HI;
+	hash->lo = HASH_OFFSET_LO;
+	HashBytes(LFV_VERSION, sizeof(LFV_VERSION), hash);
+	HashBytes(&forceByte, 1, hash);
+	hash->len = 0;
+
+	while((n = fread(buf, 1, sizeof(buf), f)))
+	{
+		HashBytes(buf, n, hash);
+		hash->len += n;
+	}
+
+	failed = ferror(f);
+	clearerr(f);
+	return !fseek(f, 0, SEEK_SET) && !failed;
+}
+
+/*--------------------------------------
+	lfvDiskCachePath
+
+Sets buf to the path of the file called name in the lfvSetCacheDir directory. Returns 0 if there's
+no directory or the path doesn't fit in size chars.
+--------------------------------------*/
+int lfvDiskCachePath(const char* name, char* buf, size_t size)
+{
+	size_t len = 0;
+	int ret = FALSE;
+
+	LOCK_CACHE_DIR();
+
+	if(cacheDir)
+	{
+		len = strlen(cacheDir);
+		ret = (size_t)snprintf(buf, size, "%s%s%s", cacheDir,
+			cacheDir[len - 1] == '/' || cacheDir[len - 1] == '\\' ? "" : "/", name) < size;
+	}
+
+	UNLOCK_CACHE_DIR();
+	return ret;
+}
+
+/*--------------------------------------
+	lfvCreateTempFile
+
+Creates a new file to be renamed to path by lfvPublishTempFile and sets tmpPath to its path. The
+file is opened exclusively, so an existing file, e.g. another writer's or one left by a crash, is
+never reused; the next suffix is tried instead. Returns 0 on failure.
+--------------------------------------*/
+FILE* lfvCreateTempFile(const char* path, char* tmpPath, size_t size)
+{
+	unsigned long seed = (unsigned long)(size_t)tmpPath, i;
+
+	for(i = 0; i < TEMP_FILE_TRIES; i++)
+	{
+		FILE* f;
+		int fd;
+
+		if((size_t)snprintf(tmpPath, size, "%s.%lx.%lx.tmp", path, (unsigned long)GET_PID(),
+		seed + i) >= size)
+			return 0;
+
+		if((fd = OPEN_NEW(tmpPath)) == -1)
+		{
+			if(errno == EEXIST)
+				continue;
+
+			return 0;
+		}
+
+		if(!(f = FDOPEN(fd, "wb")))
+		{
+			CLOSE_FD(fd);
+			remove(tmpPath);
+		}
+
+		return f;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------
+	lfvPublishTempFile
+
+Closes tmp, opened by lfvCreateTempFile, and renames it to path if store is true. Otherwise, or if
+closing fails, it's removed.
+--------------------------------------*/
+void lfvPublishTempFile(FILE* tmp, const char* tmpPath, const char* path, int store)
+{
+	if(fclose(tmp))
+		store = FALSE;
+
+	/* The file is only seen under its final name once complete. If rename fails because another
+	process stored the same file first, e.g. on Windows, that copy is just as good. */
+	if(!store || rename(tmpPath, path))
+		remove(tmpPath);
+}
+
+/*--------------------------------------
+	ExpandChunk
+
+Expands len chars of chunk in one go. If ctx is 0, the result is allocated and must be freed with
+lfvFreeBuffer. Otherwise, it points into ctx's buffer.
+--------------------------------------*/
+static const char* ExpandChunk(lfv_context* ctx, const char* chunk, size_t len, const char* name,
+	int forceExpand, const char* logPath, const char** errMsg, unsigned* errLine)
+{
+	lfv_reader_state rs;
+	char* ret = 0;
+	size_t retSize = 0;
+
+	if(errMsg) *errMsg = 0;
+	if(errLine) *errLine = 0;
+
+	if(!lfvInitContextReaderState(ctx, chunk, len, 0, name, forceExpand, FALSE, FALSE, logPath,
+	&rs))
+		ret = lfvReader(&rs, &retSize);
+
+	if(rs.earliestError)
+	{
+		if(errMsg) *errMsg = rs.earliestError;
+		if(errLine) *errLine = rs.errorLine;
+		lfvTermReaderState(&rs, TRUE);
+		return 0;
+	}
+
+	lfvTermReaderState(&rs, ctx != 0); /* With ctx, gives buf, which ret points into, back */
+	return ret;
+}
+
+/*--------------------------------------
+	ExpandTo
+
+Streams s, which was just initialized with result initErr, to write and terminates s. Returns 1 on
+success or 0 on error.
+--------------------------------------*/
+static int ExpandTo(lfv_reader_state* s, int initErr, lfv_writer write, void* ud,
+	const char** errMsg, unsigned* errLine)
+{
+	int ret;
+
+	if(errMsg) *errMsg = 0;
+	if(errLine) *errLine = 0;
+
+	if(!initErr)
+	{
+		while(1)
+		{
+			size_t size;
+			const char* out = lfvReader(s, &size);
+
+			if(s->earliestError || !size)
+				break;
+
+			if(write(out, size, ud))
+			{
+				SetReaderError(s, "Failed to write output", s->line, LFV_ERR_FILE);
+				break;
+			}
+		}
+	}
+
+	if(s->earliestError)
+	{
+		if(errMsg) *errMsg = s->earliestError;
+		if(errLine) *errLine = s->errorLine;
+	}
+
+	ret = !s->earliestError;
+	lfvTermReaderState(s, TRUE);
+	return ret;
+}
+
+/*--------------------------------------
+	InitReaderState
+
+Initializes s for lfvInitContextReaderState, lfvInitSourceReaderState or lfvNewFeed. A source or
+feed's chars aren't read until the first lfvReader call.
+--------------------------------------*/
+static int InitReaderState(lfv_context* ctx, const char* chunk, size_t chunkLen, FILE* file,
+	lfv_source read, void* readUd, lfv_feed* feed, const char* name, int force, int stream,
+	int skipBOMPound, const char* logPath, lfv_reader_state* s)
+{
+	s->level = 0;
+	s->streamThruBuf = stream;
+	s->skipBOMAndPound = skipBOMPound;
+	s->passVecFree = FALSE;
+	s->chk = chunk;
+	s->chkEnd = 0;
+	s->map = 0;
+	s->mapSize = 0;
+	s->f = file;
+	s->src = read;
+	s->srcUd = readUd;
+	s->feed = feed;
+	s->name = name;
+	s->buf = 0;
+	s->bufSize = 0;
+	s->numBuf = 0;
+	s->tok = 0;
+	s->tokSize = 0;
+	s->line = 1;
+	s->beforeSkip = 0;
+	s->lex.kind = LEX_NONE;
+	s->lex.offset = 0;
+	s->marks = 0;
+	s->numMarks = 0;
+	s->numMarksAlloc = 0;
+	s->frames = 0;
+	s->numFrames = 0;
+	s->numFramesAlloc = 0;
+	s->blocks = 0;
+	s->numBlocks = 0;
+	s->numBlocksAlloc = 0;
+	s->ctx = 0;
+	s->alloc = ctx ? ctx->alloc : DefaultAlloc;
+	s->allocUd = ctx ? ctx->allocUd : 0;
+	s->readSize = ctx && ctx->opts.readSize ? ctx->opts.readSize : INIT_BUF_SIZE;
+	s->passSize = ctx && ctx->opts.readSize ? ctx->opts.readSize : PASS_BUF_SIZE;
+	s->minFlush = ctx ? ctx->opts.minFlush : 0;
+	s->maxMemory = ctx ? ctx->opts.maxMemory : 0;
+	s->memUsed = 0;
+	s->maxOutput = ctx ? ctx->opts.maxOutput : 0;
+	s->maxOutputRatio = ctx ? ctx->opts.maxOutputRatio : 0;
+	s->maxDuplications = ctx ? ctx->opts.maxDuplications : 0;
+	s->maxTime = ctx ? ctx->opts.maxTime : 0;
+	s->numRead = 0;
+	s->numInserted = 0;
+	s->numDups = 0;
+	s->timeStart = s->timeUsed = 0.0;
+	s->topResult = force ? EXPAND_INIT_FORCE : EXPAND_INIT;
+	s->earliestError = 0;
+	s->errorLine = 0;
+	s->errorCode = LFV_OK;
+	s->log = 0;
+	s->logPath = logPath;
+	s->logWrite = ctx ? ctx->logWrite : 0;
+	s->logUd = ctx ? ctx->logUd : 0;
+	s->logRec = 0;
+	s->numLogRec = s->logRecSize = 0;
+
+	if(ctx && !ctx->busy)
+	{
+		/* Borrow ctx's buffers */
+		ctx->busy = TRUE;
+		s->ctx = ctx;
+		s->buf = ctx->buf;
+		s->bufSize = ctx->bufSize;
+		s->marks = ctx->marks;
+		s->numMarksAlloc = ctx->numMarksAlloc;
+		s->frames = ctx->frames;
+		s->numFramesAlloc = ctx->numFramesAlloc;
+		s->blocks = ctx->blocks;
+		s->numBlocksAlloc = ctx->numBlocksAlloc;
+		ctx->buf = 0; /* s owns them until lfvTermReaderState */
+		ctx->marks = 0;
+		ctx->frames = 0;
+		ctx->blocks = 0;
+		s->memUsed = s->bufSize + s->numMarksAlloc * sizeof(size_t) +
+			s->numFramesAlloc * sizeof(exp_frame) + s->numBlocksAlloc * sizeof(open_block);
+	}
+
+	if(s->chk)
+	{
+		/* Given a string */
+		s->chkEnd = s->chk + (chunkLen == LFV_NULL_TERMINATED ? strlen(s->chk) : chunkLen);
+		s->f = 0;
+	}
+	else if(s->f && s->streamThruBuf)
+		MapFile(s);
+
+	if(s->chk)
+	{
+		/* Copy the start of the string or mapped file */
+		s->numBuf = MIN((size_t)(s->chkEnd - s->chk), s->readSize - 1);
+
+		if(!EnsureBufSize(s, s->numBuf + 1, FALSE))
+			return s->errorCode;
+
+		memcpy(s->buf, s->chk, s->numBuf);
+		s->chk += s->numBuf;
+		s->buf[s->numBuf] = 0;
+	}
+	else if(s->src || s->feed)
+	{
+		/* Input comes later, start with an empty buffer */
+		if(!EnsureBufSize(s, s->readSize, FALSE))
+			return s->errorCode;
+
+		s->numBuf = 0;
+		s->buf[0] = 0;
+	}
+	else if(s->f)
+	{
+		/* Only given a file, allocate buffer and initialize with first read */
+		if(!EnsureBufSize(s, s->readSize, FALSE))
+			return s->errorCode;
+
+		if(!s->buf) /* Suppress warning */
+		{
+			SetReaderError(s, "s->buf is null", s->line, LFV_ERR_RUNTIME);
+			return s->errorCode;
+		}
+
+		s->numBuf = EOFCheckedFRead(s->buf, 1, s->readSize - 1, s->f);
+		s->buf[s->numBuf] = 0;
+	}
+
+	s->numRead = s->numBuf;
+
+	if(BinaryScript(s))
+	{
+		SetReaderError(s, "Chunk is precompiled binary", s->line, LFV_ERR_BINARY);
+		return s->errorCode;
+	}
+
+	return s->errorCode;
+}
+
+/*--------------------------------------
+	WriteFed
+
+Expands as far as the fed chars allow and writes the result. Returns 1 unless there's an error.
+--------------------------------------*/
+static int WriteFed(lfv_feed* feed)
+{
+	lfv_reader_state* s = &feed->rs;
+
+	while(1)
+	{
+		size_t size;
+		const char* out;
+		feed->starved = FALSE;
+		out = lfvReader(s, &size);
+
+		if(s->earliestError || feed->starved || !size)
+			break;
+
+		if(feed->write(out, size, feed->writeUd))
+		{
+			SetReaderError(s, "Failed to write output", s->line, LFV_ERR_FILE);
+			break;
+		}
+	}
+
+	return !s->earliestError;
+}
+
+/*--------------------------------------
+	SaveFeedPoint
+
+Called at the start of each lfvReader call with fed input. Everything in s->buf from s->tok on is
+still a copy of the fed chars, so restoring only needs the index of s->tok's char in them.
+--------------------------------------*/
+static void SaveFeedPoint(lfv_reader_state* s)
+{
+	lfv_feed* feed = s->feed;
+	feed_point* p = &feed->point;
+	p->in = (s->chk ? (size_t)(s->chk - feed->in) : 0) - (s->numBuf - s->tok);
+	p->tok = s->tok;
+	p->numBuf = s->numBuf;
+	p->tokSize = s->tokSize;
+	p->beforeSkip = s->beforeSkip;
+	p->line = s->line;
+	p->level = s->level;
+	p->lex = s->lex;
+	p->numMarks = s->numMarks;
+	p->numFrames = s->numFrames;
+	p->numBlocks = s->numBlocks;
+	p->numRead = s->numRead;
+	p->numInserted = s->numInserted;
+	p->numDups = s->numDups;
+
+	if(s->numBlocks)
+		p->topBlock = s->blocks[s->numBlocks - 1];
+
+	p->topResult = s->topResult;
+	p->earliestError = s->earliestError;
+	p->errorLine = s->errorLine;
+	p->errorCode = s->errorCode;
+}
+
+/*--------------------------------------
+	RestoreFeedPoint
+
+Undoes the lfvReader call that ran out of fed chars. The chars it had in s->buf past s->tok are
+copied back from the fed chars over its edits, and the chars read since are read again next call.
+--------------------------------------*/
+static void RestoreFeedPoint(lfv_reader_state* s)
+{
+	lfv_feed* feed = s->feed;
+	const feed_point* p = &feed->point;
+	s->tok = p->tok;
+	s->numBuf = p->numBuf;
+	memcpy(s->buf + s->tok, feed->in + p->in, s->numBuf - s->tok);
+	s->buf[s->numBuf] = 0;
+	s->chk = feed->in + p->in + (s->numBuf - s->tok);
+	s->tokSize = p->tokSize;
+	s->beforeSkip = p->beforeSkip;
+	s->line = p->line;
+	s->level = p->level;
+	s->lex = p->lex;
+	s->numMarks = p->numMarks;
+	s->numFrames = p->numFrames;
+	s->numBlocks = p->numBlocks;
+	s->numRead = p->numRead;
+	s->numInserted = p->numInserted;
+	s->numDups = p->numDups;
+
+	if(s->numBlocks)
+		s->blocks[s->numBlocks - 1] = p->topBlock;
+
+	s->topResult = p->topResult;
+	s->earliestError = p->earliestError;
+	s->errorLine = p->errorLine;
+	s->errorCode = p->errorCode;
+}
+
+#if defined(LFV_THREADS)
+/*--------------------------------------
+	RunLogBuffer
+
+Body of b's thread. Waits until a batch builds up or a flush is asked for, then takes the batch
+and writes it with b unlocked so lfvLogBufferWrite can keep adding to the other buffer. Returns
+once lfvFreeLogBuffer is called and everything is written.
+--------------------------------------*/
+static void RunLogBuffer(lfv_log_buffer* b)
+{
+	LOCK_LOG(b);
+
+	while(1)
+	{
+		unsigned long flushes;
+		char* batch;
+		size_t num, size;
+
+		while(!b->stop && b->numBuf < b->flushSize && b->numFlushed == b->numFlushes)
+			WAIT_LOG(b, wake);
+
+		/* Take the batch and give out's memory to the next one */
+		flushes = b->numFlushes;
+		batch = b->buf;
+		num = b->numBuf;
+		size = b->bufSize;
+		b->buf = b->out;
+		b->bufSize = b->outSize;
+		b->numBuf = 0;
+		b->out = batch;
+		b->outSize = size;
+		UNLOCK_LOG(b);
+
+		if(num)
+			fwrite(batch, 1, num, b->f);
+
+		fflush(b->f);
+		LOCK_LOG(b);
+		b->numFlushed = flushes;
+		SIGNAL_LOG(b, written);
+
+		if(b->stop && !b->numBuf)
+			break;
+	}
+
+	UNLOCK_LOG(b);
+}
+#endif
+
+#if defined(LFV_PTHREADS)
+/*--------------------------------------
+	LogBufferThread
+--------------------------------------*/
+static void* LogBufferThread(void* b)
+{
+	RunLogBuffer((lfv_log_buffer*)b);
+	return 0;
+}
+#elif defined(LFV_WIN32_THREADS)
+/*--------------------------------------
+	LogBufferThread
+--------------------------------------*/
+static DWORD WINAPI LogBufferThread(LPVOID b)
+{
+	RunLogBuffer((lfv_log_buffer*)b);
+	return 0;
+}
+#endif
+
+/*--------------------------------------
+	HasCacheDir
+--------------------------------------*/
+static int HasCacheDir(void)
+{
+	int ret;
+	LOCK_CACHE_DIR();
+	ret = cacheDir != 0;
+	UNLOCK_CACHE_DIR();
+	return ret;
+}
+
+/*--------------------------------------
+	ReadDiskCache
+
+Reads the cache file at dc->path into dc->text if its header has dc's hash and length. Returns 0
+if it's missing, made from another source or isn't a complete cache file.
+--------------------------------------*/
+static int ReadDiskCache(lfv_disk_cache* dc)
+{
+	char header[DISK_HEADER_SIZE + 1], expected[DISK_HEADER_SIZE + 1], *end;
+	unsigned long long textLen;
+	FILE* f = fopen(dc->path, "rb");
+	int ok;
+
+	if(!f)
+		return FALSE;
+
+	/* Everything but the text length must match */
+	sprintf(expected, DISK_HEADER_FORMAT, dc->hash.hi, dc->hash.lo, dc->hash.len, 0ULL);
+	header[DISK_HEADER_SIZE] = 0;
+	ok = fread(header, 1, DISK_HEADER_SIZE, f) == DISK_HEADER_SIZE &&
+		!memcmp(header, expected, DISK_HEADER_SIZE - 17);
+
+	if(ok)
+	{
+		textLen = strtoull(header + DISK_HEADER_SIZE - 17, &end, 16);
+		ok = end == header + DISK_HEADER_SIZE - 1 && *end == '\n' && textLen < (size_t)-1 &&
+			(dc->text = (char*)malloc((size_t)textLen + 1));
 	}
 
-	s->numBuf -= s->tok;
-	s->buf[s->numBuf] = 0;
-	s->tok = 0;
+	if(ok)
+	{
+		/* The text must end where the file does */
+		dc->textLen = (size_t)textLen;
+		ok = fread(dc->text, 1, dc->textLen, f) == dc->textLen && fgetc(f) == EOF;
+		dc->text[dc->textLen] = 0;
+	}
 
-	if(!s->streamThruBuf)
-		while(ReadMore(s)); /* Not streaming; read everything into buffer */
+	fclose(f);
+
+	if(!ok)
+	{
+		free(dc->text);
+		dc->text = 0;
+		dc->textLen = 0;
+	}
+
+	return ok;
+}
+
+/*--------------------------------------
+	WriteTee
+
+lfv_writer that passes the output to the tee's writer and its disk cache.
+--------------------------------------*/
+static int WriteTee(const void* p, size_t size, void* ud)
+{
+	disk_tee* tee = (disk_tee*)ud;
+	lfvWriteDiskCache(p, size, tee->dc);
+	return tee->write(p, size, tee->ud);
+}
+
+/*--------------------------------------
+	HashBytes
+
+Continues a 128-bit FNV-1a hash with len bytes at p. Multiplying by the prime 2^88 + 0x13b is done
+as a multiply by 0x13b, split into 32-bit halves so no 128-bit type is needed, plus lo shifted 88
+bits.
+--------------------------------------*/
+static void HashBytes(const void* p, size_t len, lfv_file_hash* hash)
+{
+	const unsigned char *c = (const unsigned char*)p, *end = c + len;
+	unsigned long long hi = hash->hi, lo = hash->lo;
+
+	for(; c < end; c++)
+	{
+		unsigned long long low, high, carry;
+		lo ^= *c;
+		low = (lo & 0xffffffffULL) * HASH_PRIME_LOW_BITS;
+		high = (lo >> 32) * HASH_PRIME_LOW_BITS;
+		carry = (high >> 32) + (((low >> 32) + (high & 0xffffffffULL)) >> 32);
+		hi = hi * HASH_PRIME_LOW_BITS + carry + (lo << 24);
+		lo = low + (high << 32);
+	}
+
+	hash->hi = hi;
+	hash->lo = lo;
+}
+
+/*--------------------------------------
+	DefaultAlloc
+
+Allocator used when none is given; works like lua_Alloc.
+--------------------------------------*/
+static void* DefaultAlloc(void* ud, void* ptr, size_t oldSize, size_t newSize)
+{
+	(void)ud;
+	(void)oldSize;
+
+	if(!newSize)
+	{
+		free(ptr);
+		return 0;
+	}
+
+	return realloc(ptr, newSize);
+}
+
+/*--------------------------------------
+	FreeContextBuffers
+--------------------------------------*/
+static void FreeContextBuffers(lfv_context* ctx)
+{
+	ctx->alloc(ctx->allocUd, ctx->buf, ctx->bufSize, 0);
+	ctx->alloc(ctx->allocUd, ctx->marks, ctx->numMarksAlloc * sizeof(size_t), 0);
+	ctx->alloc(ctx->allocUd, ctx->frames, ctx->numFramesAlloc * sizeof(exp_frame), 0);
+	ctx->alloc(ctx->allocUd, ctx->blocks, ctx->numBlocksAlloc * sizeof(open_block), 0);
+	ctx->buf = 0;
+	ctx->marks = 0;
+	ctx->frames = 0;
+	ctx->blocks = 0;
+	ctx->bufSize = ctx->numMarksAlloc = ctx->numFramesAlloc = ctx->numBlocksAlloc = 0;
+}
+
+/*--------------------------------------
+	ExpandIncremental
+
+Expands chunk into inc, keeping inc's first from bounds and the expansion before them. If from is
+0, the whole chunk is expanded, including the checks done at the start of a chunk.
+
+Once a stat ends at or after sufStart, the chars left are the same as at the end of inc->in. If
+one of inc's later bounds is at the same spot, the old expansion after it is kept and shifted.
+
+Returns TRUE on success. Otherwise, sets inc->valid to FALSE and the err parameters, which are
+optional.
+--------------------------------------*/
+static int ExpandIncremental(lfv_incremental* inc, const char* chunk, size_t len, size_t from,
+	size_t sufStart, const char** errMsg, unsigned* errLine)
+{
+	lfv_reader_state rs;
+	stat_bound start = {0, 0, 1};
+	size_t join = inc->numBounds; /* Old bound the new expansion continues from */
+	size_t tailOut, numTail, numOut, numBounds;
+	const char* err = 0;
+	unsigned line = 0;
+	void* mem;
+
+	if(from)
+		start = inc->bounds[from - 1];
+
+	inc->numMid = inc->numMidBounds = 0;
+
+	if(!lfvInitContextReaderState(&inc->ctx, chunk + start.in, len - start.in, 0, chunk,
+	from ? TRUE : inc->force, TRUE, FALSE, 0, &rs))
+	{
+		if(from)
+		{
+			/* Continue after stat; the chunk's first stat was already checked */
+			rs.topResult = EXPAND_OK;
+			rs.line = start.line;
+		}
+
+		while(1)
+		{
+			size_t size;
+			const char* ret = lfvReader(&rs, &size);
+			stat_bound b;
+
+			if(rs.earliestError || !size)
+				break;
+
+			if(!(mem = ReserveArray(inc->mid, &inc->midAlloc, inc->numMid + size, 1)))
+			{
+				err = "Failed to grow re-expanded stats";
+				line = rs.line;
+				break;
+			}
+
+			inc->mid = (char*)mem;
+			memcpy(inc->mid + inc->numMid, ret, size);
+			inc->numMid += size;
+
+			if(rs.topResult != EXPAND_OK || rs.numBlocks)
+				continue; /* Not at the end of a top-level stat */
+
+			/* Chars after tok have not been touched yet */
+			b.in = start.in + (size_t)(rs.chk - (chunk + start.in)) - (rs.numBuf - rs.tok);
+			b.out = start.out + inc->numMid;
+			b.line = rs.line;
+
+			if(!(mem = ReserveArray(inc->midBounds, &inc->midBoundsAlloc, inc->numMidBounds + 1,
+			sizeof(stat_bound))))
+			{
+				err = "Failed to grow re-expanded stat bounds";
+				line = rs.line;
+				break;
+			}
+
+			inc->midBounds = (stat_bound*)mem;
+			inc->midBounds[inc->numMidBounds++] = b;
+
+			if(b.in >= sufStart)
+			{
+				/* Rest of chunk is unchanged; continue from old bound at the same char if any */
+				size_t oldIn = b.in + inc->numIn - len;
+				size_t num = CountBoundsUpTo(inc->bounds, inc->numBounds, oldIn);
+
+				if(num > from && inc->bounds[num - 1].in == oldIn)
+				{
+					join = num - 1;
+					break;
+				}
+			}
+		}
+	}
+
+	if(rs.earliestError)
+	{
+		err = rs.earliestError;
+		line = rs.errorLine;
+	}
+
+	lfvTermReaderState(&rs, TRUE);
+
+	/* Splice new expansion between kept head and old tail */
+	tailOut = join < inc->numBounds ? inc->bounds[join].out : inc->numOut;
+	numTail = inc->numOut - tailOut;
+	numOut = start.out + inc->numMid + numTail;
+
+	if(!err && !(mem = ReserveArray(inc->out, &inc->outAlloc, numOut + 1, 1)))
+		err = "Failed to grow incremental expansion";
+	else if(!err)
+	{
+		inc->out = (char*)mem;
+		memmove(inc->out + start.out + inc->numMid, inc->out + tailOut, numTail);
+
+		if(inc->numMid)
+			memcpy(inc->out + start.out, inc->mid, inc->numMid);
+
+		inc->out[numOut] = 0;
+		inc->numOut = numOut;
+	}
+
+	/* Same for bounds, shifting the old ones after join */
+	numTail = join < inc->numBounds ? inc->numBounds - join - 1 : 0;
+	numBounds = from + inc->numMidBounds + numTail;
+
+	if(!err && !(mem = ReserveArray(inc->bounds, &inc->boundsAlloc, numBounds,
+	sizeof(stat_bound))))
+		err = "Failed to grow incremental stat bounds";
+	else if(!err)
+	{
+		stat_bound* b;
+		stat_bound oldJoin, newJoin;
+		inc->bounds = (stat_bound*)mem;
+
+		if(numTail)
+		{
+			oldJoin = inc->bounds[join];
+			newJoin = inc->midBounds[inc->numMidBounds - 1];
+			memmove(inc->bounds + from + inc->numMidBounds, inc->bounds + join + 1,
+				numTail * sizeof(stat_bound));
+
+			for(b = inc->bounds + numBounds - numTail; b < inc->bounds + numBounds; b++)
+			{
+				b->in = b->in + len - inc->numIn;
+				b->out = b->out + newJoin.out - oldJoin.out;
+				b->line = b->line + newJoin.line - oldJoin.line;
+			}
+		}
+
+		if(inc->numMidBounds)
+			memcpy(inc->bounds + from, inc->midBounds, inc->numMidBounds * sizeof(stat_bound));
+
+		inc->numBounds = numBounds;
+	}
+
+	/* Keep chunk to compare with the next one */
+	if(!err && !(mem = ReserveArray(inc->in, &inc->inAlloc, len + 1, 1)))
+		err = "Failed to copy chunk for incremental expansion";
+	else if(!err)
+	{
+		inc->in = (char*)mem;
+		memcpy(inc->in, chunk, len + 1);
+		inc->numIn = len;
+	}
+
+	if(err)
+	{
+		inc->valid = FALSE;
+		if(errMsg) *errMsg = err;
+		if(errLine) *errLine = line;
+		return FALSE;
+	}
+
+	inc->valid = TRUE;
+	return TRUE;
+}
+
+/*--------------------------------------
+	CountBoundsUpTo
+
+Returns the number of bounds with in <= the given in.
+--------------------------------------*/
+static size_t CountBoundsUpTo(const stat_bound* bounds, size_t num, size_t in)
+{
+	size_t lo = 0, hi = num;
+
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if(bounds[mid].in <= in)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*--------------------------------------
+	ReaderNoSetJmp
+
+Don't call this directly, call lfvReader.
+--------------------------------------*/
+static char* ReaderNoSetJmp(void* data, size_t* size)
+{
+	char nameBuf[LFV_NAME_BUF_SIZE];
+	lfv_reader_state* s = (lfv_reader_state*)data;
+	int noVectors = FALSE, readHeader = FALSE;
+	size_t start; /* Index of first char to send out this call */
+	*size = 0;
+
+	if(!s->buf || s->topResult == EXPAND_ERR)
+		return 0;
+
+	/* Chars before tok were sent out last call and are released by starting after them. Only move
+	the unsent tail to the front once the released chars take up half the buffer, so each char is
+	moved no more than once on average. */
+	if(s->tok == s->numBuf || s->tok >= s->bufSize / 2)
+	{
+		memmove(s->buf, s->buf + s->tok, s->numBuf - s->tok + 1);
+		s->numBuf -= s->tok;
+		s->tok = 0;
+		s->lex.kind = LEX_NONE;
+	}
+
+	start = s->tok;
+
+	if(s->feed)
+		SaveFeedPoint(s);
 
 	if(s->topResult >= EXPAND_INIT /* includes EXPAND_INIT_FORCE */ )
 	{
 		/* First call to reader */
+		readHeader = TRUE;
+
+		if(s->src || s->feed)
+		{
+			/* Chars weren't read at init, check now */
+			while(s->numBuf < sizeof(BINARY_SIGNATURE) - 1 && ReadMore(s));
+
+			if(BinaryScript(s))
+			{
+				SetReaderError(s, "Chunk is precompiled binary", s->line, LFV_ERR_BINARY);
+				s->topResult = EXPAND_ERR;
+				return 0;
+			}
+		}
+
 		if(s->skipBOMAndPound)
 			SkipBOMAndPound(s);
 
@@ -413,32 +2423,47 @@ static char* ReaderNoSetJmp(void* data, size_t* size)
 		else
 			s->topResult = s->topResult == EXPAND_INIT_FORCE ? EXPAND_OK : EXPAND_OFF;
 
-		if(s->logPath)
+		if(s->topResult == EXPAND_OK && s->passVecFree && !FindVectorPrefix(s))
 		{
-			s->log = fopen(s->logPath, "a");
+			noVectors = TRUE;
+			s->topResult = EXPAND_OFF; /* Pass the chunk through unparsed */
+		}
 
-			if(s->log)
-			{
-				const char* name = lfvResolveName(s, nameBuf, sizeof(nameBuf));
+		if((s->logWrite || s->logPath) && OpenLog(s))
+		{
+			const char* name = lfvResolveName(s, nameBuf, sizeof(nameBuf));
 
-				if(s->topResult == EXPAND_OK)
-					fprintf(s->log, LOG_PREFIX "vector expansion of '%s'\n", name);
-				else
-				{
-					fprintf(s->log, LOG_PREFIX "not expanding '%s'\n", name);
-					fclose(s->log);
-					s->log = 0;
-				}
+			if(s->topResult == EXPAND_OK)
+				LogPrintf(s, LOG_PREFIX "vector expansion of '%s'\n", name);
+			else
+			{
+				LogPrintf(s, LOG_PREFIX "not expanding '%s'%s\n", name,
+					noVectors ? " (no vector Names)" : "");
+				CloseLog(s);
 			}
 		}
 	}
 
-	if(s->topResult == EXPAND_OK)
+	if(readHeader && s->feed && s->tok == start)
+	{
+		/* Header left nothing to send; if fed chars run out in the first stat, start over from
+		here */
+		SaveFeedPoint(s);
+		readHeader = FALSE;
+	}
+
+	if(readHeader && s->feed)
+	{
+		/* Send the header on its own so running out of fed chars in the first stat doesn't
+		read it again */
+		*size = s->tok - start;
+	}
+	else if(s->topResult == EXPAND_OK)
 	{
 		while(1)
 		{
-			/* Start/continue main block; like ExpandBlock but pause so we can return back to
-			caller after each stat or retstat */
+			/* Start/continue main block or the innermost open block; like ExpandBlock but pause
+			so we can return back to caller after each stat, retstat or block end */
 			size_t saveTok = s->tok;
 			unsigned line = s->line;
 			int statRes = ExpandStat(s);
@@ -449,7 +2474,25 @@ static char* ReaderNoSetJmp(void* data, size_t* size)
 				line = s->line;
 				res = ExpandRetstat(s);
 
-				if(res == EXPAND_UNFIT)
+				if(res == EXPAND_ERR)
+				{
+					SetReaderError(s, "Bad retstat in main block", line, LFV_ERR_SYNTAX);
+					s->topResult = EXPAND_ERR;
+				}
+				else if(s->numBlocks)
+				{
+					/* Open block's stats ended */
+					res = CloseBlock(s, &s->blocks[s->numBlocks - 1]);
+
+					if(res == EXPAND_OK)
+						s->numBlocks--;
+					else if(res == EXPAND_ERR)
+					{
+						SetReaderError(s, "Bad block in main block", line, LFV_ERR_SYNTAX);
+						s->topResult = EXPAND_ERR;
+					}
+				}
+				else if(res == EXPAND_UNFIT)
 				{
 					ExtendTokenSize(s, 1);
 
@@ -460,11 +2503,6 @@ static char* ReaderNoSetJmp(void* data, size_t* size)
 						s->topResult = EXPAND_ERR;
 					}
 				}
-				else if(res == EXPAND_ERR)
-				{
-					SetReaderError(s, "Bad retstat in main block", line, LFV_ERR_SYNTAX);
-					s->topResult = EXPAND_ERR;
-				}
 			}
 			else if(statRes == EXPAND_ERR)
 			{
@@ -472,9 +2510,14 @@ static char* ReaderNoSetJmp(void* data, size_t* size)
 				s->topResult = EXPAND_ERR;
 			}
 
-			*size = s->tok;
+			*size = s->tok - start;
+
+			if(s->topResult != EXPAND_OK || s->tok == saveTok)
+				break;
 
-			if(s->topResult != EXPAND_OK || s->streamThruBuf || s->tok == saveTok)
+			/* Streamed stats are sent together until there are enough chars. Fed input sends
+			each stat so running out of fed chars only repeats one. */
+			if(s->streamThruBuf && (*size >= s->minFlush || s->feed))
 				break;
 		}
 	}
@@ -483,38 +2526,55 @@ static char* ReaderNoSetJmp(void* data, size_t* size)
 		/* Not doing expansion anymore */
 		if(s->streamThruBuf)
 		{
-			if(s->tok)
-				*size = s->tok; /* First iteration: output everything up to token */
-			else
+			if(start == s->numBuf && (s->chk || s->src || s->feed))
 			{
-				/* Second iteration: output anything leftover in buffer */
-				/* Subsequent iterations: read and output as much as buf can handle */
-				if(!s->numBuf)
-					ReadMore(s);
-
-				*size = s->numBuf;
-				s->numBuf = 0; /* Pretend we flushed for next call */
+				/* Buffer is sent; pass the rest of the string, mapped file or source's piece out
+				in place */
+				const char* rest;
+
+				if(s->chk == s->chkEnd)
+					NextChunk(s);
+
+				rest = s->chk;
+				*size = s->chkEnd - s->chk;
+				s->chk = s->chkEnd;
+				s->numRead += *size;
+				CheckLimits(s);
+				return (char*)rest;
 			}
+
+			/* Output everything in the buffer, or read and output as much as it can hold */
+			if(s->tok == s->numBuf)
+				ReadMoreSize(s, MAX(s->bufSize, s->passSize) - 1);
+
+			*size = s->numBuf - start;
+			s->tok = s->numBuf;
 		}
 		else
+		{
+			/* Read everything, filling the free space before doubling so a reused buffer that is
+			already big enough doesn't grow */
+			while(ReadMoreSize(s, s->numBuf + 1 < s->bufSize ? s->bufSize - s->numBuf - 1 :
+				s->bufSize));
 			*size = s->numBuf;
+		}
 	}
 
-	if(s->log)
+	if(s->log || s->logRec)
 	{
-		fwrite(s->buf, 1, *size, s->log); /* Log preprocessed result */
+		LogWrite(s, s->buf + start, *size); /* Log preprocessed result */
 
 		if(s->earliestError)
 		{
-			fprintf(s->log, "\n" LOG_PREFIX "expansion error ('%s' ln %u): %s",
+			LogPrintf(s, "\n" LOG_PREFIX "expansion error ('%s' ln %u): %s",
 				lfvResolveName(s, nameBuf, sizeof(nameBuf)), s->errorLine, s->earliestError);
 		}
 	}
 
 	if(!s->streamThruBuf)
-		s->buf[*size] = 0;
+		s->buf[start + *size] = 0;
 
-	return s->buf;
+	return s->buf + start;
 }
 
 /*--------------------------------------
@@ -526,9 +2586,108 @@ static void SetReaderError(lfv_reader_state* s, const char* str, unsigned line,
 {
 	if(!s->earliestError)
 	{
-		s->earliestError = str;
-		s->errorLine = line;
-		s->errorCode = code;
+		s->earliestError = str;
+		s->errorLine = line;
+		s->errorCode = code;
+	}
+}
+
+/*--------------------------------------
+	OpenLog
+
+Starts s's log record if it has a log sink or opens s->logPath otherwise. Returns FALSE if that
+fails, in which case nothing is logged.
+--------------------------------------*/
+static int OpenLog(lfv_reader_state* s)
+{
+	if(s->logWrite)
+	{
+		s->logRec = (char*)s->alloc(s->allocUd, 0, 0, LOG_REC_SIZE);
+		s->logRecSize = s->logRec ? LOG_REC_SIZE : 0;
+		s->numLogRec = 0;
+		return s->logRec != 0;
+	}
+
+	s->log = fopen(s->logPath, "a");
+	return s->log != 0;
+}
+
+/*--------------------------------------
+	LogWrite
+
+If the log record can't grow, it's dropped rather than failing the expansion.
+--------------------------------------*/
+static void LogWrite(lfv_reader_state* s, const char* str, size_t len)
+{
+	if(s->log)
+	{
+		fwrite(str, 1, len, s->log);
+		return;
+	}
+
+	if(!s->logRec)
+		return;
+
+	if(s->logRecSize - s->numLogRec < len)
+	{
+		size_t newSize = CeilPow2(s->numLogRec + len);
+		char* rec = s->numLogRec + len < len ? 0 :
+			(char*)s->alloc(s->allocUd, s->logRec, s->logRecSize, newSize);
+
+		if(!rec)
+		{
+			s->alloc(s->allocUd, s->logRec, s->logRecSize, 0);
+			s->logRec = 0;
+			s->numLogRec = s->logRecSize = 0;
+			return;
+		}
+
+		s->logRec = rec;
+		s->logRecSize = newSize;
+	}
+
+	memcpy(s->logRec + s->numLogRec, str, len);
+	s->numLogRec += len;
+}
+
+/*--------------------------------------
+	LogPrintf
+
+Formatted text longer than 255 chars is cut short.
+--------------------------------------*/
+static void LogPrintf(lfv_reader_state* s, const char* format, ...)
+{
+	char str[256];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(str, sizeof(str), format, args);
+	va_end(args);
+
+	if(len > 0)
+		LogWrite(s, str, MIN((size_t)len, sizeof(str) - 1));
+}
+
+/*--------------------------------------
+	CloseLog
+
+Closes s's log file or sends its log record to s->logWrite in one piece.
+--------------------------------------*/
+static void CloseLog(lfv_reader_state* s)
+{
+	if(s->log)
+	{
+		fclose(s->log);
+		s->log = 0;
+	}
+
+	if(s->logRec)
+	{
+		s->logWrite(s->logRec, s->numLogRec, s->logUd);
+		s->alloc(s->allocUd, s->logRec, s->logRecSize, 0);
+		s->logRec = 0;
+		s->numLogRec = s->logRecSize = 0;
 	}
 }
 
@@ -538,6 +2697,8 @@ static void SetReaderError(lfv_reader_state* s, const char* str, unsigned line,
 static int ExpandBlock(lfv_reader_state* s)
 {
 	unsigned line = s->line;
+	int ret = EXPAND_OK;
+	IncRecursionLevel(s);
 	
 	while(1)
 	{
@@ -546,13 +2707,17 @@ static int ExpandBlock(lfv_reader_state* s)
 		if(res == EXPAND_UNFIT)
 			break;
 		else if(res == EXPAND_ERR)
-			return SYNTAX_ERR("Bad stat in block");
+		{
+			ret = SYNTAX_ERR("Bad stat in block");
+			break;
+		}
 	}
 
-	if(ExpandRetstat(s) == EXPAND_ERR)
-		return SYNTAX_ERR("Bad retstat in block");
+	if(ret == EXPAND_OK && ExpandRetstat(s) == EXPAND_ERR)
+		ret = SYNTAX_ERR("Bad retstat in block");
 
-	return EXPAND_OK;
+	DecRecursionLevel(s);
+	return ret;
 }
 
 /*--------------------------------------
@@ -562,6 +2727,7 @@ static int ExpandStat(lfv_reader_state* s)
 {
 	int res;
 	unsigned line = s->line;
+	CheckLimits(s); /* Catches s->maxTime in stats that don't grow the output */
 	ExtendTokenSize(s, 1);
 
 	if(s->buf[s->tok] == ';')
@@ -580,256 +2746,284 @@ static int ExpandStat(lfv_reader_state* s)
 		return EXPAND_OK;
 	}
 
-	ExtendToken(s, IDENTIFIER_CHARS);
-
-	if(EqualToken(s, "break"))
-	{
-		NextTokenSkipCom(s);
-		return EXPAND_OK;
-	}
-
-	if(EqualToken(s, "goto"))
-	{
-		NextTokenSkipCom(s);
-
-		if(ExpandName(s, FALSE) != EXPAND_OK)
-			return SYNTAX_ERR("Expected Name after 'goto'");
-
-		return EXPAND_OK;
-	}
-
-	if(EqualToken(s, "do"))
-	{
-		NextTokenSkipCom(s);
-
-		if(ExpandBlock(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected block after 'do'");
-
-		ExtendToken(s, IDENTIFIER_CHARS);
-
-		if(!EqualToken(s, "end"))
-			return SYNTAX_ERR("Expected 'end' after 'do block'");
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-		NextTokenSkipCom(s);
-		return EXPAND_OK;
-	}
-
-	if(EqualToken(s, "while"))
+	switch(s->lex.keyword)
 	{
-		NextTokenSkipCom(s);
-
-		if(ExpandExp(s, 0) != EXPAND_OK)
-			return SYNTAX_ERR("Expected exp after 'while'");
-
-		ExtendToken(s, IDENTIFIER_CHARS);
-		
-		if(!EqualToken(s, "do"))
-			return SYNTAX_ERR("Expected 'do' after 'while exp'");
-
-		NextTokenSkipCom(s);
-
-		if(ExpandBlock(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected block after 'while exp do'");
+		case KW_BREAK:
+		{
+			NextTokenSkipCom(s);
+			return EXPAND_OK;
+		}
+		case KW_GOTO:
+		{
+			NextTokenSkipCom(s);
 
-		ExtendToken(s, IDENTIFIER_CHARS);
+			if(ExpandName(s, FALSE) != EXPAND_OK)
+				return SYNTAX_ERR("Expected Name after 'goto'");
 
-		if(!EqualToken(s, "end"))
-			return SYNTAX_ERR("Expected 'end' after 'while exp do block'");
+			return EXPAND_OK;
+		}
+		case KW_DO:
+		{
+			NextTokenSkipCom(s);
+			return ExpandStatBlock(s, line, CLOSE_END, "Expected block after 'do'",
+				"Expected 'end' after 'do block'");
+		}
+		case KW_WHILE:
+		{
+			NextTokenSkipCom(s);
 
-		NextTokenSkipCom(s);
-		return EXPAND_OK;
-	}
+			if(ExpandExp(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected exp after 'while'");
 
-	if(EqualToken(s, "repeat"))
-	{
-		NextTokenSkipCom(s);
+			ExtendTokenClass(s, CC_IDENTIFIER);
+			
+			if(s->lex.keyword != KW_DO)
+				return SYNTAX_ERR("Expected 'do' after 'while exp'");
 
-		if(ExpandBlock(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected block after 'repeat'");
+			NextTokenSkipCom(s);
+			return ExpandStatBlock(s, line, CLOSE_END, "Expected block after 'while exp do'",
+				"Expected 'end' after 'while exp do block'");
+		}
+		case KW_REPEAT:
+		{
+			NextTokenSkipCom(s);
+			return ExpandStatBlock(s, line, CLOSE_UNTIL, "Expected block after 'repeat'",
+				"Expected 'until' after 'repeat block'");
+		}
+		case KW_IF:
+		{
+			NextTokenSkipCom(s);
 
-		ExtendToken(s, IDENTIFIER_CHARS);
+			if(ExpandExp(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected exp after 'if'");
 
-		if(!EqualToken(s, "until"))
-			return SYNTAX_ERR("Expected 'until' after 'repeat block'");
+			ExtendTokenClass(s, CC_IDENTIFIER);
 
-		NextTokenSkipCom(s);
+			if(s->lex.keyword != KW_THEN)
+				return SYNTAX_ERR("Expected 'then' after 'if exp'");
 
-		if(ExpandExp(s, 0) != EXPAND_OK)
-			return SYNTAX_ERR("Expected exp after 'repeat block until'");
+			NextTokenSkipCom(s);
+			return ExpandStatBlock(s, line, CLOSE_IF, "Expected block after 'if exp then'",
+				"Expected 'end' after 'if exp then block {elseif exp then block} [else block]'");
+		}
+		case KW_FOR:
+		{
+			NextTokenSkipCom(s);
 
-		return EXPAND_OK;
-	}
+			if(ExpandExplist(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected explist after 'for'");
 
-	if(EqualToken(s, "if"))
-	{
-		NextTokenSkipCom(s);
+			ExtendTokenSize(s, 1);
 
-		if(ExpandExp(s, 0) != EXPAND_OK)
-			return SYNTAX_ERR("Expected exp after 'if'");
+			if(s->buf[s->tok] != '=')
+			{
+				ExtendTokenClass(s, CC_IDENTIFIER);
 
-		ExtendToken(s, IDENTIFIER_CHARS);
+				if(s->lex.keyword != KW_IN)
+					return SYNTAX_ERR("Expected '=' or 'in' after 'for explist'");
+			}
 
-		if(!EqualToken(s, "then"))
-			return SYNTAX_ERR("Expected 'then' after 'if exp'");
+			NextTokenSkipCom(s);
 
-		NextTokenSkipCom(s);
+			if(ExpandExplist(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected explist after 'for explist =|in'");
 
-		if(ExpandBlock(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected block after 'if exp then'");
+			ExtendTokenClass(s, CC_IDENTIFIER);
 
-		ExtendToken(s, IDENTIFIER_CHARS);
+			if(s->lex.keyword != KW_DO)
+				return SYNTAX_ERR("Expected 'do' after 'for explist =|in explist'");
 
-		while(EqualToken(s, "elseif"))
+			NextTokenSkipCom(s);
+			return ExpandStatBlock(s, line, CLOSE_END,
+				"Expected block after 'for explist =|in explist do'",
+				"Expected 'end' after 'for explist =|in explist do block'");
+		}
+		case KW_FUNCTION:
 		{
 			NextTokenSkipCom(s);
 
-			if(ExpandExp(s, 0) != EXPAND_OK)
-				return SYNTAX_ERR("Expected exp after 'elseif'");
+			if(ExpandFuncname(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected funcname after 'function'");
 
-			ExtendToken(s, IDENTIFIER_CHARS);
-
-			if(!EqualToken(s, "then"))
-				return SYNTAX_ERR("Expected 'then' after 'elseif exp'");
+			if(ExpandFuncbody(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected funcbody after 'function funcname'");
 
+			return EXPAND_OK;
+		}
+		case KW_LOCAL:
+		{
 			NextTokenSkipCom(s);
+			ExtendTokenClass(s, CC_IDENTIFIER);
 
-			if(ExpandBlock(s) != EXPAND_OK)
-				return SYNTAX_ERR("Expected block after 'elseif exp then'");
+			if(s->lex.keyword == KW_FUNCTION)
+			{
+				NextTokenSkipCom(s);
 
-			ExtendToken(s, IDENTIFIER_CHARS);
-		}
+				if(ExpandName(s, FALSE) != EXPAND_OK)
+					return SYNTAX_ERR("Expected Name after 'local function'");
 
-		if(EqualToken(s, "else"))
-		{
-			NextTokenSkipCom(s);
+				if(ExpandFuncbody(s) != EXPAND_OK)
+					return SYNTAX_ERR("Expected funcbody after 'local function Name'");
+			}
+			else
+			{
+				if(ExpandAttnamelist(s) != EXPAND_OK)
+					return SYNTAX_ERR("Expected 'function' or attnamelist after 'local'");
 
-			if(ExpandBlock(s) != EXPAND_OK)
-				return SYNTAX_ERR("Expected block after 'else'");
+				if(ExtendToken(s, "=") == 1)
+				{
+					NextTokenSkipCom(s);
 
-			ExtendToken(s, IDENTIFIER_CHARS);
-		}
+					if(ExpandExplist(s) != EXPAND_OK)
+						return SYNTAX_ERR("Expected explist after 'local attnamelist ='");
+				}
+			}
 
-		if(!EqualToken(s, "end"))
-		{
-			return SYNTAX_ERR("Expected 'end' after 'if exp then block {elseif exp then block} "
-				"[else block]'");
+			return EXPAND_OK;
 		}
-
-		NextTokenSkipCom(s);
-		return EXPAND_OK;
 	}
 
-	if(EqualToken(s, "for"))
-	{
-		NextTokenSkipCom(s);
-
-		if(ExpandExplist(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected explist after 'for'");
+	/*
+	Do explist ['=' explist] to handle:
+		varlist '=' explist
+		functioncall
+	*/
+	res = ExpandExplist(s);
 
+	if(res == EXPAND_OK)
+	{
 		ExtendTokenSize(s, 1);
 
-		if(s->buf[s->tok] != '=')
+		if(s->buf[s->tok] == '=')
 		{
-			ExtendToken(s, IDENTIFIER_CHARS);
+			NextTokenSkipCom(s);
 
-			if(!EqualToken(s, "in"))
-				return SYNTAX_ERR("Expected '=' or 'in' after 'for explist'");
+			if(ExpandExplist(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected explist after 'explist ='");
 		}
 
-		NextTokenSkipCom(s);
+		return EXPAND_OK;
+	}
+	else if(res == EXPAND_ERR)
+		return SYNTAX_ERR("Bad explist at start of stat");
 
-		if(ExpandExplist(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected explist after 'for explist =|in'");
+	return EXPAND_UNFIT;
+}
 
-		ExtendToken(s, IDENTIFIER_CHARS);
+/*--------------------------------------
+	ExpandStatBlock
 
-		if(!EqualToken(s, "do"))
-			return SYNTAX_ERR("Expected 'do' after 'for explist =|in explist'");
+Expands the block of a stat and what closes it. line is the stat's line, only used for errors.
 
-		NextTokenSkipCom(s);
+If no exp or vector marks are pending, the block is pushed onto s->blocks and EXPAND_OK is returned
+right away instead; ReaderNoSetJmp then expands the block's stats one at a time and calls
+CloseBlock when they end. Everything before each of those stats is final, so the reader can send
+it out without waiting for the outermost stat to end.
+--------------------------------------*/
+static int ExpandStatBlock(lfv_reader_state* s, unsigned line, int closer, const char* blockMsg,
+	const char* closeMsg)
+{
+	open_block b;
+	int res;
+	b.closer = closer;
+	b.line = line;
+	b.blockMsg = blockMsg;
+	b.closeMsg = closeMsg;
 
-		if(ExpandBlock(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected block after 'for explist =|in explist do'");
+	if(!s->numFrames && !s->numMarks)
+	{
+		if(s->numBlocksAlloc <= s->numBlocks)
+		{
+			size_t oldAlloc = s->numBlocksAlloc;
+			s->numBlocksAlloc = CeilPow2(AddSizeT(s, s->numBlocks, 1));
 
-		ExtendToken(s, IDENTIFIER_CHARS);
+			s->blocks = (open_block*)ReallocOrFree(s, s->blocks, oldAlloc * sizeof(open_block),
+				MulSizeT(s, sizeof(open_block), s->numBlocksAlloc));
 
-		if(!EqualToken(s, "end"))
-			return SYNTAX_ERR("Expected 'end' after 'for explist =|in explist do block'");
+			if(!s->blocks)
+			{
+				SetReaderError(s, "Failed to push open block", s->line, LFV_ERR_MEMORY);
+				s->numBlocks = s->numBlocksAlloc = 0;
+				longjmp(s->memErrJmp, 1);
+			}
+		}
 
-		NextTokenSkipCom(s);
+		s->blocks[s->numBlocks++] = b;
 		return EXPAND_OK;
 	}
 
-	if(EqualToken(s, "function"))
+	do
 	{
-		NextTokenSkipCom(s);
+		if(ExpandBlock(s) != EXPAND_OK)
+			return SYNTAX_ERR(b.blockMsg);
+	} while((res = CloseBlock(s, &b)) == BLOCK_REOPENED);
 
-		if(ExpandFuncname(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected funcname after 'function'");
+	return res;
+}
 
-		if(ExpandFuncbody(s) != EXPAND_OK)
-			return SYNTAX_ERR("Expected funcbody after 'function funcname'");
+/*--------------------------------------
+	CloseBlock
 
-		return EXPAND_OK;
-	}
+Expands what follows the end of block b's stats. Returns BLOCK_REOPENED if another block follows
+and b was updated for it.
+--------------------------------------*/
+static int CloseBlock(lfv_reader_state* s, open_block* b)
+{
+	unsigned line = b->line;
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-	if(EqualToken(s, "local"))
+	switch(b->closer)
 	{
-		NextTokenSkipCom(s);
-		ExtendToken(s, IDENTIFIER_CHARS);
-
-		if(EqualToken(s, "function"))
+		case CLOSE_UNTIL:
 		{
+			if(s->lex.keyword != KW_UNTIL)
+				return SYNTAX_ERR(b->closeMsg);
+
 			NextTokenSkipCom(s);
 
-			if(ExpandName(s, FALSE) != EXPAND_OK)
-				return SYNTAX_ERR("Expected Name after 'local function'");
+			if(ExpandExp(s) != EXPAND_OK)
+				return SYNTAX_ERR("Expected exp after 'repeat block until'");
 
-			if(ExpandFuncbody(s) != EXPAND_OK)
-				return SYNTAX_ERR("Expected funcbody after 'local function Name'");
+			return EXPAND_OK;
 		}
-		else
+		case CLOSE_IF:
 		{
-			if(ExpandAttnamelist(s) != EXPAND_OK)
-				return SYNTAX_ERR("Expected 'function' or attnamelist after 'local'");
-
-			if(ExtendToken(s, "=") == 1)
+			if(s->lex.keyword == KW_ELSEIF)
 			{
 				NextTokenSkipCom(s);
 
-				if(ExpandExplist(s) != EXPAND_OK)
-					return SYNTAX_ERR("Expected explist after 'local attnamelist ='");
-			}
-		}
+				if(ExpandExp(s) != EXPAND_OK)
+					return SYNTAX_ERR("Expected exp after 'elseif'");
 
-		return EXPAND_OK;
-	}
+				ExtendTokenClass(s, CC_IDENTIFIER);
 
-	/*
-	Do explist ['=' explist] to handle:
-		varlist '=' explist
-		functioncall
-	*/
-	res = ExpandExplist(s);
+				if(s->lex.keyword != KW_THEN)
+					return SYNTAX_ERR("Expected 'then' after 'elseif exp'");
 
-	if(res == EXPAND_OK)
-	{
-		ExtendTokenSize(s, 1);
+				NextTokenSkipCom(s);
+				b->blockMsg = "Expected block after 'elseif exp then'";
+				return BLOCK_REOPENED;
+			}
 
-		if(s->buf[s->tok] == '=')
-		{
-			NextTokenSkipCom(s);
+			if(s->lex.keyword == KW_ELSE)
+			{
+				NextTokenSkipCom(s);
+				b->closer = CLOSE_END;
+				b->blockMsg = "Expected block after 'else'";
+				return BLOCK_REOPENED;
+			}
 
-			if(ExpandExplist(s) != EXPAND_OK)
-				return SYNTAX_ERR("Expected explist after 'explist ='");
+			break;
 		}
-
-		return EXPAND_OK;
 	}
-	else if(res == EXPAND_ERR)
-		return SYNTAX_ERR("Bad explist at start of stat");
 
-	return EXPAND_UNFIT;
+	if(s->lex.keyword != KW_END)
+		return SYNTAX_ERR(b->closeMsg);
+
+	NextTokenSkipCom(s);
+	return EXPAND_OK;
 }
 
 /*--------------------------------------
@@ -916,9 +3110,9 @@ static int ExpandAttrib(lfv_reader_state* s)
 static int ExpandRetstat(lfv_reader_state* s)
 {
 	unsigned line = s->line;
-	ExtendToken(s, IDENTIFIER_CHARS);
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-	if(!EqualToken(s, "return"))
+	if(s->lex.keyword != KW_RETURN)
 		return EXPAND_UNFIT;
 
 	NextTokenSkipCom(s);
@@ -965,58 +3159,16 @@ s->marks may be realloc'd.
 --------------------------------------*/
 static int ExpandName(lfv_reader_state* s, int checkVector)
 {
-	ExtendTokenSize(s, 1);
-
-	if(StrChrNull("0123456789", s->buf[s->tok]))
-		return EXPAND_UNFIT;
-
-	ExtendToken(s, IDENTIFIER_CHARS);
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-	if(!s->tokSize)
+	if(s->lex.kind != LEX_NAME)
 		return EXPAND_UNFIT;
 
-	if(
-		EqualToken(s, "and") ||
-		EqualToken(s, "break") ||
-		EqualToken(s, "do") ||
-		EqualToken(s, "else") ||
-		EqualToken(s, "elseif") ||
-		EqualToken(s, "end") ||
-		EqualToken(s, "false") ||
-		EqualToken(s, "for") ||
-		EqualToken(s, "function") ||
-		EqualToken(s, "goto") ||
-		EqualToken(s, "if") ||
-		EqualToken(s, "in") ||
-		EqualToken(s, "local") ||
-		EqualToken(s, "nil") ||
-		EqualToken(s, "not") ||
-		EqualToken(s, "or") ||
-		EqualToken(s, "repeat") ||
-		EqualToken(s, "return") ||
-		EqualToken(s, "then") ||
-		EqualToken(s, "true") ||
-		EqualToken(s, "until") ||
-		EqualToken(s, "while")
-	)
+	if(s->lex.keyword != KW_NONE)
 		return EXPAND_UNFIT;
 
-	if(checkVector && s->tokSize >= 2)
-	{
-		int add = FALSE;
-		const char* c = &s->buf[s->tok];
-
-		if(c[0] == 'v')
-		{
-			if(c[1] == '2' || c[1] == '3')
-				add = TRUE;
-		}
-		else if(c[0] == 'q' && c[1] == '4')
-			add = TRUE;
-
-		if(add)
-			AddMark(s, s->tok);
-	}
+	if(checkVector && s->lex.vecPrefix)
+		AddMark(s, s->tok);
 
 	NextTokenSkipCom(s);
 	return EXPAND_OK;
@@ -1029,15 +3181,15 @@ static int ExpandNumeral(lfv_reader_state* s)
 {
 	unsigned line = s->line;
 	char *tok;
-	size_t cur;
+	size_t cur, len;
 	int hex = FALSE;
 
 	/* Needs to start with a digit */
-	if(!StrChrNull("0123456789", s->buf[s->tok]))
+	if(!(CHAR_CLASS(s->buf[s->tok]) & CC_DIGIT))
 		return EXPAND_UNFIT;
 
 	/* Get potential numeral chars */
-	ExtendToken(s, NUMERAL_CHARS);
+	len = ExtendTokenClass(s, CC_NUMERAL);
 	tok = s->buf + s->tok;
 	cur = 0;
 
@@ -1045,16 +3197,21 @@ static int ExpandNumeral(lfv_reader_state* s)
 	if(tok[0] == '0' && tolower(tok[1]) == 'x')
 	{
 		/* Hexadecimal */
-		size_t digits = 0;
+		size_t digits;
 		hex = TRUE;
 		cur += 2;
 
 		/* Whole part */
-		for(; StrChrNull("0123456789abcdef", tolower(tok[cur])); cur++, digits++);
+		digits = ClassSpan(tok + cur, len - cur, CC_HEX);
+		cur += digits;
 
 		/* Fractional part */
 		if(tok[cur] == '.')
-			for(cur++; StrChrNull("0123456789abcdef", tolower(tok[cur])); cur++, digits++);
+		{
+			size_t frac = ClassSpan(tok + cur + 1, len - cur - 1, CC_HEX);
+			cur += frac + 1;
+			digits += frac;
+		}
 
 		if(!digits)
 			return SYNTAX_ERR("Hex numeral must have a digit");
@@ -1063,11 +3220,11 @@ static int ExpandNumeral(lfv_reader_state* s)
 	{
 		/* Decimal */
 		/* Whole part */
-		for(; StrChrNull("0123456789", tok[cur]); cur++);
+		cur += ClassSpan(tok + cur, len - cur, CC_DIGIT);
 
 		/* Fractional part */
 		if(tok[cur] == '.')
-			for(cur++; StrChrNull("0123456789", tok[cur]); cur++);
+			cur += ClassSpan(tok + cur + 1, len - cur - 1, CC_DIGIT) + 1;
 	}
 
 	/* Exponent */
@@ -1080,7 +3237,7 @@ static int ExpandNumeral(lfv_reader_state* s)
 			cur++;
 
 		save = cur;
-		for(; StrChrNull("0123456789", tok[cur]); cur++);
+		cur += ClassSpan(tok + cur, len > cur ? len - cur : 0, CC_DIGIT);
 
 		if(cur == save)
 			return SYNTAX_ERR("Exponent of numeral must have a digit");
@@ -1103,23 +3260,53 @@ static int ExpandString(lfv_reader_state* s)
 
 	if(openQuote == '"' || openQuote == '\'')
 	{
+		const char cset[] = {openQuote, '\\', '\n', 0};
+		size_t cur = s->tok + 1;
+
 		while(1)
 		{
-			NextTokenNoSkip(s, 0);
-			ExtendCToken(s, "'\"\n");
-			NextTokenNoSkip(s, 0);
+			cur = SeekCSet(s, cur, cset);
+
+			if(s->buf[cur] == openQuote)
+				break;
+			else if(s->buf[cur] != '\\')
+				return SYNTAX_ERR("Unclosed short string literal");
+
+			/* Skip escape sequence; only the char after the backslash can be special */
+			while(s->numBuf < cur + 3 && ReadMore(s));
 
-			if(StrChrNull("'\"", s->buf[s->tok]))
+			cur++;
+
+			if(s->buf[cur] == '\n' || s->buf[cur] == '\r')
 			{
-				if(s->buf[s->tok] != openQuote || (s->tok && s->buf[s->tok - 1] == '\\'))
-					continue; /* Not matching or escaped */
+				/* Escaped line break, may be a two-char pair */
+				char first = s->buf[cur++];
 
-				NextTokenSkipCom(s);
-				return EXPAND_OK;
+				if((s->buf[cur] == '\n' || s->buf[cur] == '\r') && s->buf[cur] != first)
+					cur++;
 			}
-			else
-				return SYNTAX_ERR("Unclosed short string literal");
+			else if(s->buf[cur] == 'z')
+			{
+				/* \z skips the following white space, including line breaks */
+				cur++;
+
+				while(1)
+				{
+					cur += ClassSpan(s->buf + cur, s->numBuf - cur, CC_WHITESPACE);
+
+					if(cur < s->numBuf || !ReadMore(s))
+						break;
+				}
+			}
+			else if(s->buf[cur])
+				cur++;
 		}
+
+		s->line += CountNewlines(s->buf + s->tok, cur - s->tok);
+		s->tok = cur;
+		s->tokSize = 1;
+		NextTokenSkipCom(s);
+		return EXPAND_OK;
 	}
 	else if(SkipLongBracket(s))
 	{
@@ -1150,190 +3337,270 @@ static int ExpandFuncname(lfv_reader_state* s)
 			return SYNTAX_ERR("funcname expected Name after 'Name.'");
 	}
 
-	if(s->buf[s->tok] == ':')
-	{
-		NextTokenSkipCom(s);
-
-		if(ExpandName(s, FALSE) != EXPAND_OK)
-			return SYNTAX_ERR("funcname expected Name after ':'");
-	}
-
-	return EXPAND_OK;
-}
-
-/*--------------------------------------
-	ExpandExplist
---------------------------------------*/
-static int ExpandExplist(lfv_reader_state* s)
-{
-	unsigned line = s->line;
-	int res = ExpandExp(s, 0);
-
-	if(res != EXPAND_OK)
-		return res;
-
-	ExtendTokenSize(s, 1);
-
-	while(s->buf[s->tok] == ',')
+	if(s->buf[s->tok] == ':')
 	{
 		NextTokenSkipCom(s);
 
-		if(ExpandExp(s, 0) != EXPAND_OK)
-			return SYNTAX_ERR("explist expected exp after ','");
+		if(ExpandName(s, FALSE) != EXPAND_OK)
+			return SYNTAX_ERR("funcname expected Name after ':'");
 	}
 
 	return EXPAND_OK;
 }
 
+/*--------------------------------------
+	ExpandExplist
+--------------------------------------*/
+static int ExpandExplist(lfv_reader_state* s)
+{
+	return RunExpFrames(s, PushExpFrame(s, FRAME_EXPLIST));
+}
+
 /*--------------------------------------
 	ExpandExp
 
-If dd is given, vector Names are left marked and dd's members are filled. Otherwise,
-DuplicateVecs is called for the marks found.
+DuplicateVecs is called for the vector Names found.
 --------------------------------------*/
-#define EXP_ERROR(str) return (s->numMarks = saveNumMarks, DecRecursionLevel(s), SYNTAX_ERR(str))
+static int ExpandExp(lfv_reader_state* s)
+{
+	return RunExpFrames(s, PushExpFrame(s, FRAME_EXP));
+}
 
-static int ExpandExp(lfv_reader_state* s, delayed_duplication* dd)
+/*--------------------------------------
+	RunExpFrames
+
+Runs s->frames[base] and everything it pushes until it returns, then returns its result.
+
+Expressions nest through parentheses, brackets, args and table constructors. Instead of calling
+each other, the Resume* functions push a frame for the nested construct and return FRAME_PUSHED.
+When a frame finishes, its result is passed to the frame below, which picks up at its saved step.
+This way, nesting only grows s->frames and does not use the native stack.
+--------------------------------------*/
+static int RunExpFrames(lfv_reader_state* s, size_t base)
 {
-	unsigned line = s->line;
-	size_t start = s->tok;
-	int hang = TRUE; /* Next token should be a ref or value (true on start and after
-					 operator) */
-	int ref = FALSE; /* Last token completed a potential object reference
-					 (callable/accessible) */
-	int par = 0; /* Parenthesis level, expression ends if below 0 */
 	size_t saveNumMarks = s->numMarks;
-	IncRecursionLevel(s);
+	int res = EXPAND_OK;
 
 	while(1)
 	{
-		int unop;
-
-		if(!hang)
+		switch(s->frames[s->numFrames - 1].kind)
 		{
-			/* Try binop */
-			int binop = ExpandBinop(s);
-
-			if(binop == EXPAND_OK)
-			{
-				hang = TRUE;
-				ref = FALSE;
-				continue;
-			}
-			else if(binop == EXPAND_ERR)
-				EXP_ERROR("Bad binop in exp");
+			case FRAME_EXP: res = ResumeExp(s, res); break;
+			case FRAME_EXPLIST: res = ResumeExplist(s, res); break;
+			case FRAME_ARGS: res = ResumeArgs(s, res); break;
+			default: res = ResumeTable(s, res);
 		}
 
-		/* Try unop */
-		unop = ExpandUnop(s);
+		if(res == FRAME_PUSHED)
+			continue;
+
+		s->numFrames--;
 
-		if(unop == EXPAND_OK)
+		if(res == EXPAND_ERR)
 		{
-			hang = TRUE;
-			ref = FALSE;
-			continue;
+			/* The failing frame set the error and it must propagate, so skip the frames below */
+			s->numFrames = base;
+			s->numMarks = saveNumMarks;
+			return EXPAND_ERR;
 		}
-		else if(unop == EXPAND_ERR)
-			EXP_ERROR("Bad unop in exp");
 
-		if(hang)
-		{
-			int res;
+		if(s->numFrames == base)
+			return res;
+	}
+}
 
-			/* Try reserved values */
-			ExtendToken(s, IDENTIFIER_CHARS);
+/*--------------------------------------
+	ResumeExp
 
-			if(EqualToken(s, "nil") || EqualToken(s, "false") || EqualToken(s, "true"))
-			{
-				NextTokenSkipCom(s);
-				hang = FALSE;
-				ref = FALSE;
-				continue;
-			}
+Parses an exp. If the frame's delay is true, vector Names are left marked and the dd of the frame
+below is filled. Otherwise, DuplicateVecs is called for the marks found.
+--------------------------------------*/
+static int ResumeExp(lfv_reader_state* s, int res)
+{
+	exp_frame* f = &s->frames[s->numFrames - 1];
+	unsigned line = f->line;
 
-			/* Try literals */
-			res = ExpandString(s);
+	switch(f->step)
+	{
+		case EXP_STEP_TABLE:
+		{
+			/* Returned from tableconstructor */
+			f->hang = FALSE;
+			f->ref = FALSE; /* Tables can't be called or accessed immediately */
+			break;
+		}
+		case EXP_STEP_CALL:
+		{
+			/* Returned from args */
+			f->hang = FALSE;
+			f->ref = TRUE;
+			break;
+		}
+		case EXP_STEP_INDEX:
+		{
+			/* Returned from '[' exp */
+			if(res != EXPAND_OK)
+				return SYNTAX_ERR("Expected exp after '[' in exp var");
 
-			if(res == EXPAND_OK)
-			{
-				hang = FALSE;
-				ref = FALSE;
-				continue;
-			}
-			else if(res == EXPAND_ERR)
-				EXP_ERROR("Bad LiteralString in exp");
+			if(s->buf[s->tok] != ']')
+				return SYNTAX_ERR("Expected ']' after '[explist' in exp var");
+
+			NextTokenSkipCom(s);
+			f->hang = FALSE;
+			f->ref = TRUE;
+			break;
+		}
+	}
 
-			res = ExpandNumeral(s);
+	while(1)
+	{
+		if(!f->hang)
+		{
+			/* Try binop */
+			res = ExpandBinop(s);
 
 			if(res == EXPAND_OK)
 			{
-				hang = FALSE;
-				ref = FALSE;
+				f->hang = TRUE;
+				f->ref = FALSE;
 				continue;
 			}
 			else if(res == EXPAND_ERR)
-				EXP_ERROR("Bad Numeral in exp");
+				return SYNTAX_ERR("Bad binop in exp");
+		}
 
-			/* Try ... */
-			ExtendToken(s, ".");
+		/* Try unop */
+		res = ExpandUnop(s);
 
-			if(s->tokSize == 3)
-			{
-				hang = FALSE;
-				ref = FALSE;
-				NextTokenSkipCom(s);
-				continue;
-			}
+		if(res == EXPAND_OK)
+		{
+			f->hang = TRUE;
+			f->ref = FALSE;
+			continue;
+		}
+		else if(res == EXPAND_ERR)
+			return SYNTAX_ERR("Bad unop in exp");
 
-			/* Try functiondef */
-			res = ExpandFunctiondef(s);
+		if(f->hang)
+		{
+			/* Try the value or prefixexp start that can begin with this token */
+			ExtendTokenClass(s, CC_IDENTIFIER);
 
-			if(res == EXPAND_OK)
+			if(s->lex.kind == LEX_NAME)
 			{
-				hang = FALSE;
-				ref = TRUE;
-				continue;
-			}
-			else if(res == EXPAND_ERR)
-				EXP_ERROR("Bad functiondef in exp");
-
-			/* Try tableconstructor */
-			res = ExpandTableconstructor(s);
+				switch(s->lex.keyword)
+				{
+					case KW_NIL: case KW_FALSE: case KW_TRUE:
+					{
+						/* Reserved values */
+						NextTokenSkipCom(s);
+						f->hang = FALSE;
+						f->ref = FALSE;
+						continue;
+					}
+					case KW_FUNCTION:
+					{
+						/* functiondef */
+						res = ExpandFunctiondef(s);
+						f = &s->frames[s->numFrames - 1]; /* Body's exps may have realloc'd frames */
+
+						if(res == EXPAND_OK)
+						{
+							f->hang = FALSE;
+							f->ref = TRUE;
+							continue;
+						}
+						else if(res == EXPAND_ERR)
+							return SYNTAX_ERR("Bad functiondef in exp");
 
-			if(res == EXPAND_OK)
-			{
-				hang = FALSE;
-				ref = FALSE; /* Tables can't be called or accessed immediately */
-				continue;
+						break;
+					}
+					default:
+					{
+						/* Start a prefixexp with a Name */
+						res = ExpandName(s, TRUE);
+
+						if(res == EXPAND_OK)
+						{
+							f->hang = FALSE;
+							f->ref = TRUE;
+							continue;
+						}
+						else if(res == EXPAND_ERR)
+							return SYNTAX_ERR("Bad Name in exp");
+					}
+				}
 			}
-			else if(res == EXPAND_ERR)
-				EXP_ERROR("Bad tableconstructor in exp");
-
-			/* Try to start a prefixexp, either a Name or a '(' */
-			ExtendTokenSize(s, 1);
-
-			if(s->buf[s->tok] == '(')
+			else if(s->lex.kind == LEX_NUMERAL)
 			{
-				NextTokenSkipCom(s);
-				par++;
-				hang = TRUE;
-				ref = FALSE;
-				continue;
+				res = ExpandNumeral(s);
+
+				if(res == EXPAND_OK)
+				{
+					f->hang = FALSE;
+					f->ref = FALSE;
+					continue;
+				}
+				else if(res == EXPAND_ERR)
+					return SYNTAX_ERR("Bad Numeral in exp");
 			}
+			else
+			{
+				switch(s->buf[s->tok])
+				{
+					case '"': case '\'': case '[':
+					{
+						/* LiteralString */
+						res = ExpandString(s);
+
+						if(res == EXPAND_OK)
+						{
+							f->hang = FALSE;
+							f->ref = FALSE;
+							continue;
+						}
+						else if(res == EXPAND_ERR)
+							return SYNTAX_ERR("Bad LiteralString in exp");
+
+						break;
+					}
+					case '.':
+					{
+						/* ... */
+						ExtendToken(s, ".");
 
-			res = ExpandName(s, TRUE);
+						if(s->tokSize == 3)
+						{
+							f->hang = FALSE;
+							f->ref = FALSE;
+							NextTokenSkipCom(s);
+							continue;
+						}
 
-			if(res == EXPAND_OK)
-			{
-				hang = FALSE;
-				ref = TRUE;
-				continue;
+						break;
+					}
+					case '{':
+					{
+						/* tableconstructor */
+						f->step = EXP_STEP_TABLE;
+						PushExpFrame(s, FRAME_TABLE);
+						return FRAME_PUSHED;
+					}
+					case '(':
+					{
+						/* Start a prefixexp with a parenthesized exp */
+						s->tokSize = 1;
+						NextTokenSkipCom(s);
+						f->par++;
+						f->hang = TRUE;
+						f->ref = FALSE;
+						continue;
+					}
+				}
 			}
-			else if(res == EXPAND_ERR)
-				EXP_ERROR("Bad Name in exp");
 		}
 
-		if(ref)
+		if(f->ref)
 		{
 			/* Some sort of object/prefixexp set up */
 			/* Check for function call */
@@ -1344,27 +3611,31 @@ static int ExpandExp(lfv_reader_state* s, delayed_duplication* dd)
 				NextTokenSkipCom(s);
 
 				if(ExpandName(s, FALSE) != EXPAND_OK)
-					EXP_ERROR("Expected Name after ':' in exp functioncall");
+					return SYNTAX_ERR("Expected Name after ':' in exp functioncall");
 
-				if(ExpandArgs(s) != EXPAND_OK)
-					EXP_ERROR("Expected args after ':Name' in exp functioncall");
+				if((res = StartArgs(s)) == FRAME_PUSHED)
+					return FRAME_PUSHED;
 
-				hang = FALSE;
-				ref = TRUE;
+				if(res != EXPAND_OK)
+					return SYNTAX_ERR("Expected args after ':Name' in exp functioncall");
+
+				f->hang = FALSE;
+				f->ref = TRUE;
 				continue;
 			}
 			else
 			{
-				int res = ExpandArgs(s);
+				if((res = StartArgs(s)) == FRAME_PUSHED)
+					return FRAME_PUSHED;
 
 				if(res == EXPAND_OK)
 				{
-					hang = FALSE;
-					ref = TRUE;
+					f->hang = FALSE;
+					f->ref = TRUE;
 					continue;
 				}
 				else if(res == EXPAND_ERR)
-					EXP_ERROR("Bad args in exp functioncall");
+					return SYNTAX_ERR("Bad args in exp functioncall");
 			}
 
 			/* Check for access */
@@ -1373,17 +3644,9 @@ static int ExpandExp(lfv_reader_state* s, delayed_duplication* dd)
 			if(s->buf[s->tok] == '[')
 			{
 				NextTokenSkipCom(s);
-
-				if(ExpandExp(s, 0) != EXPAND_OK)
-					EXP_ERROR("Expected exp after '[' in exp var");
-
-				if(s->buf[s->tok] != ']')
-					EXP_ERROR("Expected ']' after '[explist' in exp var");
-
-				NextTokenSkipCom(s);
-				hang = FALSE;
-				ref = TRUE;
-				continue;
+				f->step = EXP_STEP_INDEX;
+				PushExpFrame(s, FRAME_EXP);
+				return FRAME_PUSHED;
 			}
 
 			if(s->buf[s->tok] == '.')
@@ -1391,10 +3654,10 @@ static int ExpandExp(lfv_reader_state* s, delayed_duplication* dd)
 				NextTokenSkipCom(s);
 
 				if(ExpandName(s, TRUE) != EXPAND_OK)
-					EXP_ERROR("Expected Name after '.' in exp var");
+					return SYNTAX_ERR("Expected Name after '.' in exp var");
 
-				hang = FALSE;
-				ref = TRUE;
+				f->hang = FALSE;
+				f->ref = TRUE;
 				continue;
 			}
 		}
@@ -1404,7 +3667,7 @@ static int ExpandExp(lfv_reader_state* s, delayed_duplication* dd)
 
 		if(s->buf[s->tok] == ')')
 		{
-			if(--par < 0)
+			if(--f->par < 0)
 				break;
 			else
 			{
@@ -1417,62 +3680,113 @@ static int ExpandExp(lfv_reader_state* s, delayed_duplication* dd)
 		break;
 	}
 
-	if(par > 0)
-		EXP_ERROR("exp has unclosed parenthesis");
+	if(f->par > 0)
+		return SYNTAX_ERR("exp has unclosed parenthesis");
 
-	if(start != s->tok && hang)
-		EXP_ERROR("exp has hanging operator");
+	if(f->start != s->tok && f->hang)
+		return SYNTAX_ERR("exp has hanging operator");
 
-	if(dd)
+	if(f->delay)
 	{
-		dd->expStart = start;
-		dd->marksStart = saveNumMarks;
+		exp_frame* field = f - 1;
+		field->dd.expStart = f->start;
+		field->dd.marksStart = f->saveNumMarks;
 	}
-	else if(DuplicateVecs(s, line, start, saveNumMarks, 0) != EXPAND_OK)
-		EXP_ERROR("Failed duplication of vectors in exp");
+	else if(DuplicateVecs(s, line, f->start, f->saveNumMarks, 0) != EXPAND_OK)
+		return SYNTAX_ERR("Failed duplication of vectors in exp");
 
-	DecRecursionLevel(s);
-	return start == s->tok ? EXPAND_UNFIT : EXPAND_OK;
+	return f->start == s->tok ? EXPAND_UNFIT : EXPAND_OK;
 }
 
 /*--------------------------------------
-	ExpandArgs
+	StartArgs
+
+Starts args for the exp frame on top. Returns FRAME_PUSHED if args continue in a new frame.
 --------------------------------------*/
-static int ExpandArgs(lfv_reader_state* s)
+static int StartArgs(lfv_reader_state* s)
 {
-	unsigned line = s->line;
-	int res;
 	ExtendTokenSize(s, 1);
 
-	if(s->buf[s->tok] == '(')
+	if(s->buf[s->tok] == '(' || s->buf[s->tok] == '{')
 	{
-		NextTokenSkipCom(s);
+		s->frames[s->numFrames - 1].step = EXP_STEP_CALL;
+		PushExpFrame(s, s->buf[s->tok] == '(' ? FRAME_ARGS : FRAME_TABLE);
+		return FRAME_PUSHED;
+	}
+
+	return ExpandString(s);
+}
+
+/*--------------------------------------
+	ResumeExplist
+--------------------------------------*/
+static int ResumeExplist(lfv_reader_state* s, int res)
+{
+	exp_frame* f = &s->frames[s->numFrames - 1];
+	unsigned line = f->line;
+
+	switch(f->step)
+	{
+		case EXPLIST_STEP_START:
+		{
+			f->step = EXPLIST_STEP_FIRST;
+			PushExpFrame(s, FRAME_EXP);
+			return FRAME_PUSHED;
+		}
+		case EXPLIST_STEP_FIRST:
+		{
+			if(res != EXPAND_OK)
+				return res;
 
-		if(ExpandExplist(s) == EXPAND_ERR)
-			return SYNTAX_ERR("Bad explist after '(' in args");
+			ExtendTokenSize(s, 1);
+			break;
+		}
+		case EXPLIST_STEP_NEXT:
+		{
+			if(res != EXPAND_OK)
+				return SYNTAX_ERR("explist expected exp after ','");
 
-		if(s->buf[s->tok] != ')')
-			return SYNTAX_ERR("Expected ')' after '(explist' in args");
+			break;
+		}
+	}
 
+	if(s->buf[s->tok] == ',')
+	{
 		NextTokenSkipCom(s);
-		return EXPAND_OK;
+		f->step = EXPLIST_STEP_NEXT;
+		PushExpFrame(s, FRAME_EXP);
+		return FRAME_PUSHED;
 	}
 
-	res = ExpandTableconstructor(s);
+	return EXPAND_OK;
+}
 
-	if(res == EXPAND_OK)
-		return EXPAND_OK;
-	else if(res == EXPAND_ERR)
-		return SYNTAX_ERR("Bad tableconstructor in args");
+/*--------------------------------------
+	ResumeArgs
+
+Parses '(' [explist] ')' args; the other forms are handled by StartArgs.
+--------------------------------------*/
+static int ResumeArgs(lfv_reader_state* s, int res)
+{
+	exp_frame* f = &s->frames[s->numFrames - 1];
+	unsigned line = f->line;
 
-	res = ExpandString(s);
+	if(f->step == ARGS_STEP_START)
+	{
+		NextTokenSkipCom(s);
+		f->step = ARGS_STEP_EXPLIST;
+		PushExpFrame(s, FRAME_EXPLIST);
+		return FRAME_PUSHED;
+	}
 
-	if(res == EXPAND_OK)
-		return EXPAND_OK;
-	else if(res == EXPAND_ERR)
-		return SYNTAX_ERR("Bad LiteralString in args");
+	/* Returned from explist, which may be empty */
+	(void)res;
 
-	return EXPAND_UNFIT;
+	if(s->buf[s->tok] != ')')
+		return SYNTAX_ERR("Expected ')' after '(explist' in args");
+
+	NextTokenSkipCom(s);
+	return EXPAND_OK;
 }
 
 /*--------------------------------------
@@ -1481,9 +3795,9 @@ static int ExpandArgs(lfv_reader_state* s)
 static int ExpandFunctiondef(lfv_reader_state* s)
 {
 	unsigned line = s->line;
-	ExtendToken(s, IDENTIFIER_CHARS);
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-	if(!EqualToken(s, "function"))
+	if(s->lex.keyword != KW_FUNCTION)
 		return EXPAND_UNFIT;
 
 	NextTokenSkipCom(s);
@@ -1516,243 +3830,244 @@ static int ExpandFuncbody(lfv_reader_state* s)
 		return SYNTAX_ERR("funcbody expected ')' after '(explist'");
 
 	NextTokenSkipCom(s);
-
-	if(ExpandBlock(s) != EXPAND_OK)
-		return SYNTAX_ERR("funcbody expected block after '(explist)'");
-
-	ExtendToken(s, IDENTIFIER_CHARS);
-
-	if(!EqualToken(s, "end"))
-		return SYNTAX_ERR("funcbody expected 'end' after '(explist) block'");
-
-	NextTokenSkipCom(s);
-	return EXPAND_OK;
+	return ExpandStatBlock(s, line, CLOSE_END, "funcbody expected block after '(explist)'",
+		"funcbody expected 'end' after '(explist) block'");
 }
 
 /*--------------------------------------
-	ExpandTableconstructor
---------------------------------------*/
-static int ExpandTableconstructor(lfv_reader_state* s)
-{
-	unsigned line = s->line;
-	ExtendTokenSize(s, 1);
-
-	if(s->buf[s->tok] != '{')
-		return EXPAND_UNFIT;
+	ResumeTable
 
-	NextTokenSkipCom(s);
-
-	if(ExpandFieldlist(s) == EXPAND_ERR)
-		return SYNTAX_ERR("Bad fieldlist in tableconstructor");
+Parses a tableconstructor, including its fieldlist and each field.
 
-	ExtendTokenSize(s, 1);
+A field of 'Name = exp' with a left-hand vector Name is prepped to be merged with the expressions
+that follow it. For example, "v2Var = a, b" becomes "xVar = a, yVar = b". The frame's
+markedVecComps and markedExps track the current field:
 
-	if(s->buf[s->tok] != '}')
-		return SYNTAX_ERR("tableconstructor expected '}' after '{fieldlist'");
+If the field is 'exp = exp' and the left hand side contains a vector Name, the Name is marked and
+markedVecComps is set to the number of components.
 
-	NextTokenSkipCom(s);
-	return EXPAND_OK;
-}
+If the field is 'exp', the beginning of the expression and each of its duplicates are marked and
+markedExps is set to the number of added marks.
 
-/*--------------------------------------
-	ExpandFieldlist
+If the field is 'exp = exp', only the duplicates of the right hand side are marked, not the left
+expression nor the original right expression.
 --------------------------------------*/
 #define UNMERGEABLE_MSG "Failed merge of fields in fieldlist"
 #define UNMERGEABLE_ERR() SYNTAX_ERR(UNMERGEABLE_MSG)
 
-static int ExpandFieldlist(lfv_reader_state* s)
+static int ResumeTable(lfv_reader_state* s, int res)
 {
-	size_t marksStart = 0;
-	size_t prepComps = 0;
-	size_t remExps = 0;
-	size_t mergeableEnd = 0;
-	int ret;
+	exp_frame* f = &s->frames[s->numFrames - 1];
+	unsigned line = f->fieldLine;
+	int fieldRes = EXPAND_OK; /* Result of the field that just finished */
 
-	while(1)
+	switch(f->step)
 	{
-		/* Get field */
-		unsigned line = s->line;
-		size_t saveNumMarks = s->numMarks;
-		size_t markedVecComps = 0, markedExps = 0;
-		ret = ExpandField(s, &markedVecComps, &markedExps);
-
-		if(ret == EXPAND_ERR)
-			return SYNTAX_ERR("Bad field in fieldlist");
-		else if(ret == EXPAND_UNFIT)
-			break;
-
-		/* Check state of prep */
-		if(markedVecComps)
+		case TABLE_STEP_START:
 		{
-			/* ExpandField marked a left-hand vector */
-			if(prepComps)
-			{
-				/* We're still prepping the last vector; cancel further prep and merge now */
-				if(MergeFields(s, line, marksStart, prepComps - remExps, mergeableEnd) != EXPAND_OK)
-					return UNMERGEABLE_ERR();
-			}
+			line = f->line;
+			ExtendTokenSize(s, 1);
 
-			/* Start prep */
-			marksStart = s->numMarks - markedExps - 1;
-			prepComps = markedVecComps;
-			remExps = prepComps - 1;
-			mergeableEnd = s->beforeSkip;
-		}
+			if(s->buf[s->tok] != '{')
+				return EXPAND_UNFIT;
 
-		if(prepComps)
+			NextTokenSkipCom(s);
+			f->marksStart = f->prepComps = f->remExps = f->mergeableEnd = 0;
+			fieldRes = FRAME_PUSHED; /* No field yet, start one */
+			break;
+		}
+		case TABLE_STEP_KEY:
 		{
-			/* Prepping a vector */
-			if(markedExps)
-			{
-				/* ExpandField marked mergeable expression(s) */
-				if(markedExps > remExps)
-					return RUNTIME_ERR("exp duplicates too many times for left-hand vector in fieldlist");
+			/* Returned from '[' exp */
+			if(res != EXPAND_OK)
+				return SYNTAX_ERR("field expected exp after '['");
 
-				remExps -= markedExps;
-				mergeableEnd = s->beforeSkip;
+			ExtendTokenSize(s, 1);
 
-				if(!remExps)
-				{
-					/* Prep is finished; merge */
-					if(MergeFields(s, line, marksStart, prepComps, mergeableEnd) != EXPAND_OK)
-						return UNMERGEABLE_ERR();
+			if(s->buf[s->tok] != ']')
+				return SYNTAX_ERR("field expected ']' after '[exp'");
 
-					prepComps = 0;
-				}
-			}
-			else if(!markedVecComps)
-			{
-				/* We're prepping and ExpandField did not mark anything; cancel further prep and
-				merge now */
-				if(MergeFields(s, line, marksStart, prepComps - remExps, mergeableEnd) != EXPAND_OK)
-					return UNMERGEABLE_ERR();
+			NextTokenSkipCom(s);
+			ExtendTokenSize(s, 1);
 
-				prepComps = 0;
-			}
-		}
-		else
-			s->numMarks = saveNumMarks; /* Not prepping; discard mergeable expression marks */
+			if(s->buf[s->tok] != '=')
+				return SYNTAX_ERR("field expected '=' after '[exp]'");
 
-		/* Get fieldsep */
-		ret = ExpandFieldsep(s);
+			NextTokenSkipCom(s);
+			f->step = TABLE_STEP_KEY_VALUE;
+			PushExpFrame(s, FRAME_EXP);
+			return FRAME_PUSHED;
+		}
+		case TABLE_STEP_KEY_VALUE:
+		{
+			/* Returned from '[' exp ']' '=' exp */
+			if(res != EXPAND_OK)
+				return SYNTAX_ERR("field expected exp after '[exp] ='");
 
-		if(ret == EXPAND_ERR)
-			return SYNTAX_ERR("Bad fieldsep in fieldlist");
-		else if(ret == EXPAND_UNFIT)
 			break;
-	}
-
-	if(prepComps)
-	{
-		/* fieldlist is done but we're still prepping; merge now */
-		if(MergeFields(s, s->line, marksStart, prepComps - remExps, mergeableEnd) != EXPAND_OK)
-			return (SetReaderError(s, UNMERGEABLE_MSG, s->line, LFV_ERR_SYNTAX), EXPAND_ERR);
-
-		prepComps = 0;
-	}
-
-	return EXPAND_OK;
-}
-
-/*--------------------------------------
-	ExpandField
-
-If markedVecComps is given, the field is 'exp = exp', and the left hand side contains a vector
-Name, the Name is marked and *markedVecComps is set to the number of components.
-
-If markedExps is given and the field is 'exp', the beginning of the expression and each of its
-duplicates are marked and *markedExps is set to the number of added marks.
+		}
+		case TABLE_STEP_EXP:
+		{
+			/* Returned from exp ['=' exp] */
+			if(res == EXPAND_UNFIT)
+			{
+				fieldRes = EXPAND_UNFIT;
+				break;
+			}
 
-If markedExps is given and the field is 'exp = exp', only the duplicates of the right hand side
-are marked, not the left expression nor the original right expression.
---------------------------------------*/
-static int ExpandField(lfv_reader_state* s, size_t* markedVecComps, size_t* markedExps)
-{
-	unsigned line = s->line;
-	int ret;
-	delayed_duplication dd;
-	ExtendTokenSize(s, 1);
+			ExtendTokenSize(s, 1);
 
-	if(s->buf[s->tok] == '[')
-	{
-		/* Do '[' exp ']' '=' exp */
-		NextTokenSkipCom(s);
+			if(s->buf[s->tok] == '=')
+			{
+				const char* err;
+				size_t numNameVecs = s->numMarks - f->dd.marksStart;
 
-		if(ExpandExp(s, 0) != EXPAND_OK)
-			return SYNTAX_ERR("field expected exp after '['");
+				if(numNameVecs > 1)
+					return SYNTAX_ERR("field expected 'exp =' to contain no more than one vector Name");
 
-		ExtendTokenSize(s, 1);
+				if(numNameVecs && (err = CheckMarkPrefix(s, s->numMarks - 1, &f->markedVecComps)))
+					return SYNTAX_ERR(err);
 
-		if(s->buf[s->tok] != ']')
-			return SYNTAX_ERR("field expected ']' after '[exp'");
+				NextTokenSkipCom(s);
+				f->step = TABLE_STEP_VALUE;
+				PushExpFrame(s, FRAME_EXP);
+				s->frames[s->numFrames - 1].delay = TRUE; /* Push may have realloc'd frames */
+				return FRAME_PUSHED;
+			}
 
-		NextTokenSkipCom(s);
-		ExtendTokenSize(s, 1);
+			/* exp */
+			if(DuplicateVecs(s, line, f->dd.expStart, f->dd.marksStart, &f->markedExps) != EXPAND_OK)
+				return SYNTAX_ERR("Failed duplication of vectors in exp of field");
 
-		if(s->buf[s->tok] != '=')
-			return SYNTAX_ERR("field expected '=' after '[exp]'");
+			break;
+		}
+		case TABLE_STEP_VALUE:
+		{
+			/* Returned from right-hand exp of exp '=' exp */
+			if(res != EXPAND_OK)
+				return SYNTAX_ERR("field expected exp after 'exp ='");
 
-		NextTokenSkipCom(s);
+			if(DuplicateVecs(s, line, f->dd.expStart, f->dd.marksStart, &f->markedExps) != EXPAND_OK)
+				return SYNTAX_ERR("Failed duplication of vectors in right-hand exp of field");
 
-		if(ExpandExp(s, 0) != EXPAND_OK)
-			return SYNTAX_ERR("field expected exp after '[exp] ='");
+			if(f->markedExps)
+			{
+				/* Only keep marks to duplicates */
+				RemoveMarks(s, s->numMarks - f->markedExps, 1);
+				f->markedExps--;
+			}
 
-		return EXPAND_OK;
+			break;
+		}
 	}
 
-	/*
-	Do exp ['=' exp] to handle:
-		Name '=' exp
-		exp
-	*/
-	ret = ExpandExp(s, &dd);
+	if(fieldRes == EXPAND_OK)
+	{
+		/* Check state of prep */
+		if(f->markedVecComps)
+		{
+			/* Field marked a left-hand vector */
+			if(f->prepComps)
+			{
+				/* We're still prepping the last vector; cancel further prep and merge now */
+				if(MergeFields(s, line, f->marksStart, f->prepComps - f->remExps,
+					f->mergeableEnd) != EXPAND_OK)
+					return UNMERGEABLE_ERR();
+			}
 
-	if(ret == EXPAND_ERR)
-		return SYNTAX_ERR("Bad exp in field");
-	else if(ret == EXPAND_UNFIT)
-		return EXPAND_UNFIT;
+			/* Start prep */
+			f->marksStart = s->numMarks - f->markedExps - 1;
+			f->prepComps = f->markedVecComps;
+			f->remExps = f->prepComps - 1;
+			f->mergeableEnd = s->beforeSkip;
+		}
 
-	ExtendTokenSize(s, 1);
+		if(f->prepComps)
+		{
+			/* Prepping a vector */
+			if(f->markedExps)
+			{
+				/* Field marked mergeable expression(s) */
+				if(f->markedExps > f->remExps)
+					return RUNTIME_ERR("exp duplicates too many times for left-hand vector in fieldlist");
 
-	if(s->buf[s->tok] == '=')
-	{
-		size_t numNameVecs = s->numMarks - dd.marksStart;
+				f->remExps -= f->markedExps;
+				f->mergeableEnd = s->beforeSkip;
 
-		if(numNameVecs > 1)
-			return SYNTAX_ERR("field expected 'exp =' to contain no more than one vector Name");
+				if(!f->remExps)
+				{
+					/* Prep is finished; merge */
+					if(MergeFields(s, line, f->marksStart, f->prepComps, f->mergeableEnd) != EXPAND_OK)
+						return UNMERGEABLE_ERR();
 
-		if(markedVecComps)
-		{
-			const char* err;
+					f->prepComps = 0;
+				}
+			}
+			else if(!f->markedVecComps)
+			{
+				/* We're prepping and field did not mark anything; cancel further prep and merge
+				now */
+				if(MergeFields(s, line, f->marksStart, f->prepComps - f->remExps,
+					f->mergeableEnd) != EXPAND_OK)
+					return UNMERGEABLE_ERR();
 
-			if(numNameVecs && (err = CheckMarkPrefix(s, s->numMarks - 1, markedVecComps)))
-				return SYNTAX_ERR(err);
+				f->prepComps = 0;
+			}
 		}
 		else
-			s->numMarks = dd.marksStart; /* Caller isn't tracking; discard the mark */
-
-		NextTokenSkipCom(s);
+			s->numMarks = f->fieldSaveNumMarks; /* Not prepping; discard mergeable exp marks */
 
-		if(ExpandExp(s, &dd) != EXPAND_OK)
-			return SYNTAX_ERR("field expected exp after 'exp ='");
+		/* Get fieldsep */
+		if(ExpandFieldsep(s) == EXPAND_OK)
+			fieldRes = FRAME_PUSHED;
+	}
 
-		if(DuplicateVecs(s, line, dd.expStart, dd.marksStart, markedExps) != EXPAND_OK)
-			return SYNTAX_ERR("Failed duplication of vectors in right-hand exp of field");
+	if(fieldRes == FRAME_PUSHED)
+	{
+		/* Start field */
+		f->fieldLine = s->line;
+		f->fieldSaveNumMarks = s->numMarks;
+		f->markedVecComps = f->markedExps = 0;
+		ExtendTokenSize(s, 1);
 
-		if(markedExps && *markedExps)
+		if(s->buf[s->tok] == '[')
 		{
-			/* Only keep marks to duplicates */
-			RemoveMarks(s, s->numMarks - *markedExps, 1);
-			(*markedExps)--;
+			/* Do '[' exp ']' '=' exp */
+			NextTokenSkipCom(s);
+			f->step = TABLE_STEP_KEY;
+			PushExpFrame(s, FRAME_EXP);
+			return FRAME_PUSHED;
 		}
 
-		return EXPAND_OK;
+		/*
+		Do exp ['=' exp] to handle:
+			Name '=' exp
+			exp
+		*/
+		f->step = TABLE_STEP_EXP;
+		PushExpFrame(s, FRAME_EXP);
+		s->frames[s->numFrames - 1].delay = TRUE; /* Push may have realloc'd frames */
+		return FRAME_PUSHED;
+	}
+
+	/* fieldlist is done */
+	if(f->prepComps)
+	{
+		/* Still prepping; merge now */
+		if(MergeFields(s, s->line, f->marksStart, f->prepComps - f->remExps,
+			f->mergeableEnd) != EXPAND_OK)
+			return (SetReaderError(s, UNMERGEABLE_MSG, s->line, LFV_ERR_SYNTAX), EXPAND_ERR);
+
+		f->prepComps = 0;
 	}
 
-	/* exp */
-	if(DuplicateVecs(s, line, dd.expStart, dd.marksStart, markedExps) != EXPAND_OK)
-		return SYNTAX_ERR("Failed duplication of vectors in exp of field");
+	line = f->line;
+	ExtendTokenSize(s, 1);
+
+	if(s->buf[s->tok] != '}')
+		return SYNTAX_ERR("tableconstructor expected '}' after '{fieldlist'");
 
+	NextTokenSkipCom(s);
 	return EXPAND_OK;
 }
 
@@ -1845,9 +4160,9 @@ static int ExpandBinop(lfv_reader_state* s)
 		}
 	}
 
-	ExtendToken(s, IDENTIFIER_CHARS);
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-	if(EqualToken(s, "and") || EqualToken(s, "or"))
+	if(s->lex.keyword == KW_AND || s->lex.keyword == KW_OR)
 	{
 		NextTokenSkipCom(s);
 		return EXPAND_OK;
@@ -1873,9 +4188,9 @@ static int ExpandUnop(lfv_reader_state* s)
 		return EXPAND_OK;
 	}
 
-	ExtendToken(s, IDENTIFIER_CHARS);
+	ExtendTokenClass(s, CC_IDENTIFIER);
 
-	if(EqualToken(s, "not"))
+	if(s->lex.keyword == KW_NOT)
 	{
 		NextTokenSkipCom(s);
 		return EXPAND_OK;
@@ -1928,7 +4243,8 @@ static int DuplicateVecs(lfv_reader_state* s, unsigned line, size_t expStart,
 	}
 
 	/* Duplicate expression to make it a per-component expression list */
-	/* Shift first */
+	/* Shift first; CopyShiftRight checks the new s->numDups */
+	s->numDups = AddSizeT(s, s->numDups, minVec - 1);
 	CopyShiftRight(
 		s,
 		expEnd,
@@ -2022,7 +4338,7 @@ static int MergeFields(lfv_reader_state* s, unsigned line, size_t marksStart, si
 {
 	const char COMPS[4] = {'x', 'y', 'z', 'w'};
 	const char* err = 0;
-	char* vecName;
+	size_t vecName; /* Char index; s->buf may be realloc'd while inserting */
 	size_t vecLen;
 	size_t wantComps;
 	int qua;
@@ -2033,7 +4349,7 @@ static int MergeFields(lfv_reader_state* s, unsigned line, size_t marksStart, si
 		return RUNTIME_ERR("MergeFields called without marks");
 
 	/* Turn first vector prefix into x component */
-	vecName = s->buf + s->marks[marksStart];
+	vecName = s->marks[marksStart];
 	
 	if((err = CheckMarkPrefix(s, marksStart, &wantComps)))
 		return SYNTAX_ERR(err);
@@ -2047,11 +4363,11 @@ static int MergeFields(lfv_reader_state* s, unsigned line, size_t marksStart, si
 	qua = (wantComps == 4) ? 1 : 0;
 
 	if(!qua)
-		vecName[0] = ' ';
+		s->buf[vecName] = ' ';
 
-	vecName[1] = 'x';
+	s->buf[vecName + 1] = 'x';
 	vecName += 2; /* Point to name without prefix */
-	vecLen = strspn(vecName, IDENTIFIER_CHARS);
+	vecLen = ClassSpan(s->buf + vecName, s->numBuf - vecName, CC_IDENTIFIER);
 	leftAssignLen = AddSizeT(s, AddSizeT(s, vecLen, qua), 2);
 		/* ['q'] + component + name + '=' */
 
@@ -2060,7 +4376,7 @@ static int MergeFields(lfv_reader_state* s, unsigned line, size_t marksStart, si
 		if(qua) \
 			s->buf[insert++] = 'q'; \
 		s->buf[insert++] = COMPS[i]; \
-		strncpy(s->buf + insert, vecName, vecLen); \
+		memcpy(s->buf + insert, s->buf + vecName, vecLen); \
 		insert += vecLen; \
 		s->buf[insert++] = '='; \
 	}
@@ -2157,28 +4473,11 @@ static void SkipBOMAndPound(lfv_reader_state* s)
 /*--------------------------------------
 	WhitespaceSpan
 --------------------------------------*/
-static size_t WhitespaceSpan(const char* str, unsigned* line)
+static size_t WhitespaceSpan(const char* str, size_t len, unsigned* line)
 {
-	size_t span = 0;
-
-	while(1)
-	{
-		switch(*str)
-		{
-			case '\n':
-				(*line)++;
-				/* fall through */
-			case ' ':
-			case '\t':
-			case '\f':
-			case '\r':
-				span++;
-				str++;
-				break;
-			default:
-				return span;
-		}
-	}
+	size_t span = ClassSpan(str, len, CC_WHITESPACE);
+	*line += CountNewlines(str, span);
+	return span;
 }
 
 /*--------------------------------------
@@ -2186,16 +4485,8 @@ static size_t WhitespaceSpan(const char* str, unsigned* line)
 --------------------------------------*/
 static void ConsumeToken(lfv_reader_state* s)
 {
-	size_t i;
-
-	for(i = 0; i < s->tokSize; i++)
-	{
-		if(s->buf[s->tok] == '\n')
-			s->line++;
-
-		s->tok++;
-	}
-
+	s->line += CountNewlines(s->buf + s->tok, s->tokSize);
+	s->tok += s->tokSize;
 	s->tokSize = 0;
 }
 
@@ -2204,17 +4495,9 @@ static void ConsumeToken(lfv_reader_state* s)
 --------------------------------------*/
 static void EraseToken(lfv_reader_state* s)
 {
-	size_t i;
-
-	for(i = 0; i < s->tokSize; i++)
-	{
-		if(s->buf[s->tok] == '\n')
-			s->line++;
-
-		s->buf[s->tok] = ' ';
-		s->tok++;
-	}
-
+	s->line += CountNewlines(s->buf + s->tok, s->tokSize);
+	memset(s->buf + s->tok, ' ', s->tokSize);
+	s->tok += s->tokSize;
 	s->tokSize = 0;
 }
 
@@ -2231,7 +4514,7 @@ static void NextTokenNoSkip(lfv_reader_state* s, size_t* afterConsume)
 	if(afterConsume)
 		*afterConsume = s->tok;
 
-	s->tok += WhitespaceSpan(s->buf + s->tok, &s->line);
+	s->tok += WhitespaceSpan(s->buf + s->tok, s->numBuf - s->tok, &s->line);
 
 	while(s->tok >= s->numBuf)
 	{
@@ -2243,124 +4526,457 @@ static void NextTokenNoSkip(lfv_reader_state* s, size_t* afterConsume)
 			return; /* No more tokens */
 		}
 
-		s->tok += WhitespaceSpan(s->buf + s->tok, &s->line);
+		s->tok += WhitespaceSpan(s->buf + s->tok, s->numBuf - s->tok, &s->line);
 	}
 
 	s->tokSize = s->buf[s->tok] ? 1 : 0;
 }
 
-/*--------------------------------------
-	NextTokenSkipCom
+/*--------------------------------------
+	NextTokenSkipCom
+
+NextTokenNoSkip that checks for and skips comments.
+--------------------------------------*/
+static void NextTokenSkipCom(lfv_reader_state* s)
+{
+	NextTokenNoSkip(s, &s->beforeSkip);
+
+	if(s->tokSize)
+	{
+		while(SkipComment(s));
+		s->tokSize = s->buf[s->tok] ? 1 : 0;
+	}
+}
+
+/*--------------------------------------
+	ExtendToken
+
+Probes the token only allowing chars in set, reading more into s->buf if needed. Sets and returns
+s->tokSize.
+--------------------------------------*/
+#define EXTEND_TOKEN_IMP(spnfunc) \
+	s->tokSize = spnfunc(s->buf + s->tok, set); \
+	\
+	if(s->tokSize) \
+	{ \
+		while(s->tok + s->tokSize >= s->numBuf) \
+		{ \
+			if(!ReadMore(s)) \
+				break; \
+			\
+			s->tokSize += spnfunc(s->buf + s->tok + s->tokSize, set); \
+		} \
+	} \
+	\
+	return s->tokSize;
+
+static size_t ExtendToken(lfv_reader_state* s, const char* set)
+{
+	EXTEND_TOKEN_IMP(strspn);
+}
+
+/*--------------------------------------
+	ExtendCToken
+
+Like ExtendToken but looks for characters not in set. set may have no more than 3 chars to be
+searched a vector at a time.
+--------------------------------------*/
+static size_t ExtendCToken(lfv_reader_state* s, const char* set)
+{
+	s->tokSize = SeekCSet(s, s->tok, set) - s->tok;
+	return s->tokSize;
+}
+
+/*--------------------------------------
+	ExtendTokenClass
+
+Like ExtendToken but only allows chars whose charClasses entry intersects cls.
+
+Parse functions probe each token for a Name several times before one of them consumes it, so
+CC_IDENTIFIER probes are lexed once into s->lex and answered from there while s->tok stays put.
+--------------------------------------*/
+static size_t ExtendTokenClass(lfv_reader_state* s, int cls)
+{
+	if(cls == CC_IDENTIFIER && s->lex.kind != LEX_NONE && s->lex.offset == s->tok)
+	{
+		s->tokSize = s->lex.size;
+		return s->tokSize;
+	}
+
+	s->tokSize = ClassSpan(s->buf + s->tok, s->numBuf - s->tok, cls);
+
+	if(s->tokSize)
+	{
+		while(s->tok + s->tokSize >= s->numBuf)
+		{
+			size_t end;
+
+			if(!ReadMore(s))
+				break;
+
+			end = s->tok + s->tokSize;
+			s->tokSize += ClassSpan(s->buf + end, s->numBuf - end, cls);
+		}
+	}
+
+	if(cls == CC_IDENTIFIER)
+		SetLexedToken(s);
+
+	return s->tokSize;
+}
+
+/*--------------------------------------
+	SetLexedToken
+
+Records the current token, which must span all identifier chars at s->tok, in s->lex.
+--------------------------------------*/
+static void SetLexedToken(lfv_reader_state* s)
+{
+	const char* c = s->buf + s->tok;
+	s->lex.offset = s->tok;
+	s->lex.size = s->tokSize;
+	s->lex.line = s->line;
+	s->lex.keyword = KW_NONE;
+	s->lex.vecPrefix = FALSE;
+
+	if(!s->tokSize)
+		s->lex.kind = LEX_OTHER;
+	else if(CHAR_CLASS(c[0]) & CC_DIGIT)
+		s->lex.kind = LEX_NUMERAL;
+	else
+	{
+		s->lex.kind = LEX_NAME;
+		s->lex.keyword = KeywordID(c, s->tokSize);
+
+		if(s->tokSize >= 2)
+			s->lex.vecPrefix = (c[0] == 'v' && (c[1] == '2' || c[1] == '3')) ||
+				(c[0] == 'q' && c[1] == '4');
+	}
+}
+
+/*--------------------------------------
+	KeywordID
+
+Returns the KW_* value of the reserved word str[0 .. len - 1] or KW_NONE. Switches on the first
+char so no more than 3 words are compared.
+--------------------------------------*/
+static int KeywordID(const char* str, size_t len)
+{
+	#define KEYWORD(word, id) \
+		if(len == sizeof(word) - 1 && !memcmp(str, word, sizeof(word) - 1)) \
+			return id
+
+	if(len < 2 || len > 8)
+		return KW_NONE;
+
+	switch(str[0])
+	{
+		case 'a':
+			KEYWORD("and", KW_AND);
+			break;
+		case 'b':
+			KEYWORD("break", KW_BREAK);
+			break;
+		case 'd':
+			KEYWORD("do", KW_DO);
+			break;
+		case 'e':
+			KEYWORD("else", KW_ELSE);
+			KEYWORD("elseif", KW_ELSEIF);
+			KEYWORD("end", KW_END);
+			break;
+		case 'f':
+			KEYWORD("false", KW_FALSE);
+			KEYWORD("for", KW_FOR);
+			KEYWORD("function", KW_FUNCTION);
+			break;
+		case 'g':
+			KEYWORD("goto", KW_GOTO);
+			break;
+		case 'i':
+			KEYWORD("if", KW_IF);
+			KEYWORD("in", KW_IN);
+			break;
+		case 'l':
+			KEYWORD("local", KW_LOCAL);
+			break;
+		case 'n':
+			KEYWORD("nil", KW_NIL);
+			KEYWORD("not", KW_NOT);
+			break;
+		case 'o':
+			KEYWORD("or", KW_OR);
+			break;
+		case 'r':
+			KEYWORD("repeat", KW_REPEAT);
+			KEYWORD("return", KW_RETURN);
+			break;
+		case 't':
+			KEYWORD("then", KW_THEN);
+			KEYWORD("true", KW_TRUE);
+			break;
+		case 'u':
+			KEYWORD("until", KW_UNTIL);
+			break;
+		case 'w':
+			KEYWORD("while", KW_WHILE);
+			break;
+	}
+
+	#undef KEYWORD
+	return KW_NONE;
+}
+
+/*--------------------------------------
+	ExtendTokenSize
+
+Tries to set s->tokSize equal to size, reading more into s->buf if needed. Returns s->tokSize.
+--------------------------------------*/
+static size_t ExtendTokenSize(lfv_reader_state* s, size_t size)
+{
+	if(s->tokSize >= size)
+	{
+		s->tokSize = size;
+		return s->tokSize;
+	}
+
+	while(s->tokSize < size)
+	{
+		size_t remaining = s->numBuf - s->tok;
+
+		if(remaining < size)
+		{
+			s->tokSize = remaining;
+
+			if(!ReadMore(s))
+				break;
+		}
+		else
+			s->tokSize = size;
+	}
+
+	return s->tokSize;
+}
+
+/*--------------------------------------
+	SeekCSet
+
+Returns the char index of the first char at or after from that is in cset or is the null
+terminator after the last char of input. Null chars within the input are skipped over. Reads more
+into s->buf as needed, doubling the read size each time so long sections cost a logarithmic
+number of reads.
+--------------------------------------*/
+static size_t SeekCSet(lfv_reader_state* s, size_t from, const char* cset)
+{
+	size_t size = s->readSize;
+
+	while(1)
+	{
+		from += CSetSpan(s->buf + from, s->numBuf - from, cset);
+
+		if(from < s->numBuf)
+		{
+			if(s->buf[from])
+				return from;
+
+			from++; /* Null char in a string, comment or file */
+			continue;
+		}
+
+		if(!ReadMoreSize(s, size))
+			return from;
+
+		size = MulSizeT(s, size, 2);
+	}
+}
+
+/*--------------------------------------
+	FindVectorPrefix
+
+Returns TRUE if a Name starting with a vector prefix may appear at or after s->tok. File input is
+read ahead until a prefix is found or the file ends; the rest of a string chunk is searched in
+place. So are fed chars, remembering where the search stopped while waiting for more.
+--------------------------------------*/
+static int FindVectorPrefix(lfv_reader_state* s)
+{
+	size_t from = s->tok;
+
+	while(1)
+	{
+		if(VectorPrefixSpan(s->buf + from, s->numBuf - from) < s->numBuf - from)
+			return TRUE;
+
+		if((s->chk && !s->src) || s->feed)
+		{
+			/* Start at the last char copied in case a prefix straddles the buffer's end */
+			const char* rest;
+			size_t len;
+
+			if(s->chk == s->chkEnd)
+			{
+				NextChunk(s);
+				return FALSE;
+			}
+
+			rest = s->chk - 1;
+
+			if(s->feed && rest < s->feed->in + s->feed->vecScan)
+				rest = s->feed->in + s->feed->vecScan;
+
+			len = s->chkEnd - rest;
+
+			if(VectorPrefixSpan(rest, len) < len)
+				return TRUE;
+
+			if(s->feed)
+			{
+				s->feed->vecScan = s->chkEnd - s->feed->in - 1;
+				NextChunk(s);
+			}
 
-NextTokenNoSkip that checks for and skips comments.
---------------------------------------*/
-static void NextTokenSkipCom(lfv_reader_state* s)
-{
-	NextTokenNoSkip(s, &s->beforeSkip);
+			return FALSE;
+		}
 
-	if(s->tokSize)
-	{
-		while(SkipComment(s));
-		s->tokSize = s->buf[s->tok] ? 1 : 0;
+		if(s->numBuf > from)
+			from = s->numBuf - 1; /* Prefix may straddle the read */
+
+		if(!ReadMoreSize(s, MAX(s->numBuf, s->readSize)))
+			return FALSE;
 	}
 }
 
 /*--------------------------------------
-	ExtendToken
-
-Probes the token only allowing chars in set, reading more into s->buf if needed. Sets and returns
-s->tokSize.
---------------------------------------*/
-#define EXTEND_TOKEN_IMP(spnfunc) \
-	s->tokSize = spnfunc(s->buf + s->tok, set); \
-	\
-	if(s->tokSize) \
-	{ \
-		while(s->tok + s->tokSize >= s->numBuf) \
-		{ \
-			if(!ReadMore(s)) \
-				break; \
-			\
-			s->tokSize += spnfunc(s->buf + s->tok + s->tokSize, set); \
-		} \
-	} \
-	\
-	return s->tokSize;
+	MapFile
 
-static size_t ExtendToken(lfv_reader_state* s, const char* set)
-{
-	EXTEND_TOKEN_IMP(strspn);
-}
+Maps s->f into memory and reads it as a string from then on if it's a large enough regular file
+that hasn't been read from yet. Otherwise, s->f is left to be read with stdio, e.g. if it's a
+pipe.
 
-/*--------------------------------------
-	ExtendCToken
+Only done when streaming. Streaming reads the file a little at a time, which costs stdio a read
+call every few KB, while the mapped file is copied straight from its pages. Without streaming, the
+whole file ends up in s->buf anyway and large freads fill it faster than page faults do.
 
-Like ExtendToken but looks for characters not in set.
+Only built with LFV_USE_MMAP. If the file is truncated while it's mapped, e.g. rewritten by an
+editor during a hot reload, touching the pages past its new end raises SIGBUS, which kills the
+process unless the host handles it. stdio just reads less.
 --------------------------------------*/
-static size_t ExtendCToken(lfv_reader_state* s, const char* set)
+static void MapFile(lfv_reader_state* s)
 {
-	EXTEND_TOKEN_IMP(strcspn);
+#if defined(LFV_MMAP)
+	struct stat st;
+	void* map;
+
+	if(fstat(fileno(s->f), &st) || !S_ISREG(st.st_mode) || st.st_size < MIN_MAP_SIZE ||
+	(unsigned long long)st.st_size > (size_t)-1 || ftell(s->f) != 0)
+		return;
+
+	map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(s->f), 0);
+
+	if(map == MAP_FAILED)
+		return;
+
+	s->map = map;
+	s->mapSize = (size_t)st.st_size;
+	s->chk = (const char*)map;
+	s->chkEnd = s->chk + s->mapSize;
+#else
+	(void)s;
+#endif
 }
 
 /*--------------------------------------
-	ExtendTokenSize
+	NextChunk
 
-Tries to set s->tokSize equal to size, reading more into s->buf if needed. Returns s->tokSize.
+Called when s->chk is used up. Points s->chk at the next piece from s->src, if any. If s->feed
+isn't finished, longjmps to s->memErrJmp to wait for more fed chars.
 --------------------------------------*/
-static size_t ExtendTokenSize(lfv_reader_state* s, size_t size)
+static void NextChunk(lfv_reader_state* s)
 {
-	if(s->tokSize >= size)
+	if(s->src)
 	{
-		s->tokSize = size;
-		return s->tokSize;
-	}
-
-	while(s->tokSize < size)
-	{
-		size_t remaining = s->numBuf - s->tok;
+		size_t size = 0;
+		const char* piece = s->src(s->srcUd, &size);
 
-		if(remaining < size)
+		if(piece && size)
 		{
-			s->tokSize = remaining;
-
-			if(!ReadMore(s))
-				break;
+			s->chk = piece;
+			s->chkEnd = piece + size;
 		}
 		else
-			s->tokSize = size;
+		{
+			/* Source ended, don't call it again */
+			s->src = 0;
+			s->chk = s->chkEnd = 0;
+		}
+	}
+	else if(s->feed && !s->feed->finished)
+	{
+		s->feed->starved = TRUE;
+		longjmp(s->memErrJmp, 1);
 	}
-
-	return s->tokSize;
 }
 
 /*--------------------------------------
 	ReadMore
 --------------------------------------*/
 static size_t ReadMore(lfv_reader_state* s)
+{
+	return ReadMoreSize(s, s->readSize);
+}
+
+/*--------------------------------------
+	ReadMoreSize
+
+Reads up to size more chars into s->buf, making room as needed. Returns the number of chars read.
+
+Reads are kept small so the unread input is not sitting in s->buf; every char past an insertion
+point has to be moved by CopyShiftRight.
+--------------------------------------*/
+static size_t ReadMoreSize(lfv_reader_state* s, size_t size)
 {
 	size_t read = 0;
 
+	if(s->chk == s->chkEnd)
+		NextChunk(s);
+
 	if(s->chk)
 	{
-		if(*s->chk)
+		/* A source's pieces may be short, keep pulling until size chars are read */
+		while(s->chk < s->chkEnd)
 		{
-			if(s->numBuf >= s->bufSize - 1)
-				EnsureBufSize(s, AddSizeT(s, AddSizeT(s, s->numBuf, INIT_BUF_SIZE), 1), TRUE);
+			size_t n = MIN(size - read, (size_t)(s->chkEnd - s->chk));
+
+			if(s->bufSize - s->numBuf - read - 1 < n)
+				EnsureBufSize(s, AddSizeT(s, AddSizeT(s, s->numBuf + read, n), 1), TRUE);
+
+			memcpy(s->buf + s->numBuf + read, s->chk, n);
+			s->chk += n;
+			read += n;
+
+			if(read == size || !s->src)
+				break;
 
-			read = CopyStringNoTerm(s->buf + s->numBuf, s->chk, s->bufSize - s->numBuf - 1);
-			s->chk += read;
+			NextChunk(s);
+
+			if(!s->chk)
+				break;
 		}
 	}
 	else if(s->f && !feof(s->f))
 	{
-		if(s->numBuf >= s->bufSize - 1)
-			EnsureBufSize(s, AddSizeT(s, AddSizeT(s, s->numBuf, INIT_BUF_SIZE), 1), TRUE);
+		if(s->bufSize - s->numBuf - 1 < size)
+			EnsureBufSize(s, AddSizeT(s, AddSizeT(s, s->numBuf, size), 1), TRUE);
 
-		read = fread(s->buf + s->numBuf, 1, s->bufSize - s->numBuf - 1, s->f);
+		read = fread(s->buf + s->numBuf, 1, size, s->f);
 	}
 
 	s->numBuf += read;
 	s->buf[s->numBuf] = 0;
+	s->numRead += read;
+
+	if(read)
+		CheckLimits(s);
+
 	return read;
 }
 
@@ -2417,7 +5033,7 @@ static int StringStartsWith(const char* str, size_t len, const char* cmp)
 static int SkipLongBracket(lfv_reader_state* s)
 {
 	const char* c;
-	size_t level;
+	size_t level, cur;
 
 	ExtendToken(s, "[=");
 	c = s->buf + s->tok;
@@ -2431,33 +5047,33 @@ static int SkipLongBracket(lfv_reader_state* s)
 	if(*c != '[')
 		return FALSE;
 
-	/* Skip bracket section */
-	NextTokenNoSkip(s, 0);
+	/* Skip bracket section; only stop at a ']' if it's followed by the closing bracket's tail */
+	cur = s->tok + level + 2;
 
 	while(1)
 	{
-		ExtendCToken(s, "]");
-		NextTokenNoSkip(s, 0);
-		ExtendToken(s, "]=");
-		c = s->buf + s->tok;
+		size_t i;
+		cur = SeekCSet(s, cur, "]");
 
-		if(*c == ']')
-		{
-			size_t endLevel = strspn(++c, "=");
-			c += endLevel;
-			s->tok = c - s->buf;
-			s->tokSize = s->buf[s->tok] ? 1 : 0;
+		if(!s->buf[cur])
+			break; /* Null terminator, unclosed section */
 
-			if(*c == ']' && level == endLevel)
-			{
-				NextTokenNoSkip(s, 0);
-				break;
-			}
+		while(s->numBuf < cur + level + 2 && ReadMore(s));
+		cur++;
+
+		for(i = 0; i < level && s->buf[cur] == '='; i++, cur++);
+
+		if(i == level && s->buf[cur] == ']')
+		{
+			cur++;
+			break;
 		}
-		else
-			break; /* Null terminator, unclosed section */
 	}
 
+	s->line += CountNewlines(s->buf + s->tok, cur - s->tok);
+	s->tok = cur;
+	s->tokSize = 0;
+	NextTokenNoSkip(s, 0);
 	return TRUE;
 }
 
@@ -2483,8 +5099,9 @@ static int SkipComment(lfv_reader_state* s)
 
 		if(!SkipLongBracket(s))
 		{
-			/* Not a long bracket section, normal comment, skip line */
-			ExtendCToken(s, "\n");
+			/* Not a long bracket section, normal comment, skip line; it has no newlines to count */
+			s->tok += ExtendCToken(s, "\n");
+			s->tokSize = 0;
 			NextTokenNoSkip(s, 0);
 		}
 
@@ -2509,27 +5126,20 @@ static int StringIsShortComment(const char* str)
 static void CopyShiftRight(lfv_reader_state* s, size_t start, size_t amount, int updateMarks)
 {
 	size_t i;
+	s->numInserted = AddSizeT(s, s->numInserted, amount);
+	CheckLimits(s); /* Before growing the buffer for the inserted chars */
 	EnsureBufSize(s, AddSizeT(s, AddSizeT(s, s->numBuf, amount), 1), TRUE);
 
 	if(s->numBuf)
-	{
-		i = s->numBuf;
-
-		while(1)
-		{
-			s->buf[i + amount] = s->buf[i];
-
-			if(i == start)
-				break;
-
-			i--;
-		}
-	}
+		memmove(s->buf + start + amount, s->buf + start, s->numBuf - start + 1);
 
 	s->numBuf += amount;
 	s->beforeSkip += amount;
 	s->tok += amount;
 
+	if(s->lex.offset >= start)
+		s->lex.offset += amount;
+
 	if(updateMarks)
 	{
 		for(i = 0; i < s->numMarks; i++)
@@ -2566,14 +5176,264 @@ static const char* StrChrNull(const char* str, int ch)
 }
 
 /*--------------------------------------
-	CopyStringNoTerm
+	ClassSpan
+
+Returns the number of chars at the start of str, looking at no more than len, whose charClasses
+entries intersect cls. Spans of the bulk classes are scanned a vector at a time when SIMD is
+available.
+
+If LFV_SCAN_STATS is defined, the chars looked at are added to lfvNumScanned.
 --------------------------------------*/
-static size_t CopyStringNoTerm(char* dest, const char* str, size_t maxNum)
+#if defined(LFV_SIMD_AVX2)
+	typedef __m256i simd_vec;
+	#define SIMD_WIDTH 32
+	#define SIMD_FULL_MASK 0xFFFFFFFFu
+	#define SIMD_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+	#define SIMD_SET1(c) _mm256_set1_epi8((char)(c))
+	#define SIMD_EQ(a, b) _mm256_cmpeq_epi8(a, b)
+	#define SIMD_GT(a, b) _mm256_cmpgt_epi8(a, b)
+	#define SIMD_OR(a, b) _mm256_or_si256(a, b)
+	#define SIMD_AND(a, b) _mm256_and_si256(a, b)
+	#define SIMD_ANDNOT(a, b) _mm256_andnot_si256(a, b)
+	#define SIMD_MOVEMASK(v) ((unsigned)_mm256_movemask_epi8(v))
+#elif defined(LFV_SIMD_SSE2)
+	typedef __m128i simd_vec;
+	#define SIMD_WIDTH 16
+	#define SIMD_FULL_MASK 0xFFFFu
+	#define SIMD_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+	#define SIMD_SET1(c) _mm_set1_epi8((char)(c))
+	#define SIMD_EQ(a, b) _mm_cmpeq_epi8(a, b)
+	#define SIMD_GT(a, b) _mm_cmpgt_epi8(a, b)
+	#define SIMD_OR(a, b) _mm_or_si128(a, b)
+	#define SIMD_AND(a, b) _mm_and_si128(a, b)
+	#define SIMD_ANDNOT(a, b) _mm_andnot_si128(a, b)
+	#define SIMD_MOVEMASK(v) ((unsigned)_mm_movemask_epi8(v))
+#endif
+
+#if defined(SIMD_WIDTH)
+
+/* Bytes >= 0x80 are negative as signed chars and fall outside every ASCII range */
+#define SIMD_IN_RANGE(v, lo, hi) \
+	SIMD_ANDNOT(SIMD_OR(SIMD_GT(SIMD_SET1(lo), v), SIMD_GT(v, SIMD_SET1(hi))), SIMD_SET1(0xFF))
+
+static unsigned ClassMaskSIMD(const char* str, int cls)
 {
-	size_t i;
+	simd_vec v = SIMD_LOAD(str);
+	simd_vec lower = SIMD_OR(v, SIMD_SET1(0x20)); /* ASCII letters to lowercase */
+	simd_vec in = SIMD_IN_RANGE(v, '0', '9');
+
+	switch(cls)
+	{
+	case CC_DIGIT:
+		break;
+	case CC_IDENTIFIER:
+		in = SIMD_OR(in, SIMD_IN_RANGE(lower, 'a', 'z'));
+		in = SIMD_OR(in, SIMD_EQ(v, SIMD_SET1('_')));
+		break;
+	case CC_NUMERAL:
+		in = SIMD_OR(in, SIMD_IN_RANGE(lower, 'a', 'f'));
+		in = SIMD_OR(in, SIMD_OR(SIMD_EQ(lower, SIMD_SET1('p')), SIMD_EQ(lower, SIMD_SET1('x'))));
+		in = SIMD_OR(in, SIMD_IN_RANGE(v, '-', '.'));
+		in = SIMD_OR(in, SIMD_EQ(v, SIMD_SET1('+')));
+		break;
+	case CC_WHITESPACE:
+		in = SIMD_OR(SIMD_IN_RANGE(v, '\t', '\n'), SIMD_IN_RANGE(v, '\f', '\r'));
+		in = SIMD_OR(in, SIMD_EQ(v, SIMD_SET1(' ')));
+		break;
+	default:
+		return 0;
+	}
+
+	return SIMD_MOVEMASK(in);
+}
+
+static unsigned CountTrailingZeros(unsigned n)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, n);
+	return (unsigned)index;
+#else
+	return (unsigned)__builtin_ctz(n);
+#endif
+}
 
-	for(i = 0; i < maxNum && str[i]; i++)
-		dest[i] = str[i];
+#endif
+
+#if defined(LFV_SCAN_STATS)
+	unsigned long long lfvNumScanned = 0;
+
+	/* The span's chars plus the one that ended it */
+	#define COUNT_SCAN(span, len) (lfvNumScanned += (span) + ((span) < (len)), (span))
+#else
+	#define COUNT_SCAN(span, len) (span)
+#endif
+
+static size_t ClassSpan(const char* str, size_t len, int cls)
+{
+	size_t i = 0;
+
+#if defined(SIMD_WIDTH)
+	/* Most tokens are short; only switch to vectors once the span outgrows one */
+	size_t head = MIN(len, SIMD_WIDTH);
+	for(; i < head && (CHAR_CLASS(str[i]) & cls); i++);
+
+	if(i < head)
+		return COUNT_SCAN(i, len);
+
+	if(cls == CC_IDENTIFIER || cls == CC_DIGIT || cls == CC_NUMERAL || cls == CC_WHITESPACE)
+	{
+		for(; len - i >= SIMD_WIDTH; i += SIMD_WIDTH)
+		{
+			unsigned outside = ~ClassMaskSIMD(str + i, cls) & SIMD_FULL_MASK;
+
+			if(outside)
+				return COUNT_SCAN(i + CountTrailingZeros(outside), len);
+		}
+	}
+#endif
+
+	for(; i < len && (CHAR_CLASS(str[i]) & cls); i++);
+	return COUNT_SCAN(i, len);
+}
+
+/*--------------------------------------
+	CSetSpan
+
+Like strcspn but looks at no more than len chars. Sets of up to 3 chars are searched a vector at
+a time when SIMD is available.
+--------------------------------------*/
+static size_t CSetSpan(const char* str, size_t len, const char* cset)
+{
+	size_t i = 0;
+
+#if defined(SIMD_WIDTH)
+	size_t numSet = strlen(cset);
+
+	if(numSet <= 3)
+	{
+		simd_vec needles[3];
+		simd_vec zero = SIMD_SET1(0);
+		size_t j;
+
+		for(j = 0; j < numSet; j++)
+			needles[j] = SIMD_SET1(cset[j]);
+
+		for(; len - i >= SIMD_WIDTH; i += SIMD_WIDTH)
+		{
+			simd_vec v = SIMD_LOAD(str + i);
+			simd_vec hit = SIMD_EQ(v, zero);
+			unsigned mask;
+
+			for(j = 0; j < numSet; j++)
+				hit = SIMD_OR(hit, SIMD_EQ(v, needles[j]));
+
+			if((mask = SIMD_MOVEMASK(hit)))
+				return i + CountTrailingZeros(mask);
+		}
+	}
+#endif
+
+	for(; i < len && str[i] && !strchr(cset, str[i]); i++);
+	return i;
+}
+
+/*--------------------------------------
+	CountNewlines
+--------------------------------------*/
+static unsigned CountNewlines(const char* str, size_t len)
+{
+	const char *nl = str, *end = str + len;
+	unsigned num = 0;
+
+	while((nl = (const char*)memchr(nl, '\n', end - nl)))
+	{
+		num++;
+		nl++;
+	}
+
+	return num;
+}
+
+/*--------------------------------------
+	VectorPrefixSpan
+
+Returns the index of the first "v2", "v3" or "q4" in str that is not preceded by an identifier
+char, or len if there is none. Char pairs are matched a vector at a time when SIMD is available.
+--------------------------------------*/
+#define VECTOR_PREFIX_AT(str, i) \
+	(((str)[i] == 'v' && ((str)[(i) + 1] == '2' || (str)[(i) + 1] == '3')) || \
+	((str)[i] == 'q' && (str)[(i) + 1] == '4'))
+
+#define IDENTIFIER_START_AT(str, i) (!(i) || !(CHAR_CLASS((str)[(i) - 1]) & CC_IDENTIFIER))
+
+static size_t VectorPrefixSpan(const char* str, size_t len)
+{
+	size_t i = 0;
+
+#if defined(SIMD_WIDTH)
+	simd_vec v = SIMD_SET1('v'), q = SIMD_SET1('q');
+	simd_vec two = SIMD_SET1('2'), three = SIMD_SET1('3'), four = SIMD_SET1('4');
+
+	for(; len - i > SIMD_WIDTH; i += SIMD_WIDTH)
+	{
+		simd_vec first = SIMD_LOAD(str + i), second = SIMD_LOAD(str + i + 1);
+		simd_vec hit = SIMD_OR(
+			SIMD_AND(SIMD_EQ(first, v), SIMD_OR(SIMD_EQ(second, two), SIMD_EQ(second, three))),
+			SIMD_AND(SIMD_EQ(first, q), SIMD_EQ(second, four)));
+		unsigned mask = SIMD_MOVEMASK(hit);
+
+		for(; mask; mask &= mask - 1)
+		{
+			size_t at = i + CountTrailingZeros(mask);
+
+			if(IDENTIFIER_START_AT(str, at))
+				return at;
+		}
+	}
+#endif
+
+	for(; i + 1 < len; i++)
+	{
+		if(VECTOR_PREFIX_AT(str, i) && IDENTIFIER_START_AT(str, i))
+			return i;
+	}
+
+	return len;
+}
+
+/*--------------------------------------
+	CommonPrefix
+
+Returns the number of leading chars a and b share, up to n.
+--------------------------------------*/
+static size_t CommonPrefix(const char* a, const char* b, size_t n)
+{
+	size_t i = 0;
+
+	while(i + 64 <= n && !memcmp(a + i, b + i, 64))
+		i += 64;
+
+	while(i < n && a[i] == b[i])
+		i++;
+
+	return i;
+}
+
+/*--------------------------------------
+	CommonSuffix
+
+Returns the number of trailing chars the strings ending at aEnd and bEnd share, up to n.
+--------------------------------------*/
+static size_t CommonSuffix(const char* aEnd, const char* bEnd, size_t n)
+{
+	size_t i = 0;
+
+	while(i + 64 <= n && !memcmp(aEnd - i - 64, bEnd - i - 64, 64))
+		i += 64;
+
+	while(i < n && *(aEnd - i - 1) == *(bEnd - i - 1))
+		i++;
 
 	return i;
 }
@@ -2608,8 +5468,9 @@ static size_t EnsureBufSize(lfv_reader_state* s, size_t n, int doMemJmp)
 {
 	if(s->bufSize < n)
 	{
+		size_t oldSize = s->bufSize;
 		s->bufSize = CeilPow2(n);
-		s->buf = (char*)ReallocOrFree(s->buf, s->bufSize);
+		s->buf = (char*)ReallocOrFree(s, s->buf, oldSize, s->bufSize);
 
 		if(!s->buf)
 		{
@@ -2633,9 +5494,10 @@ static size_t EnsureNumMarksAlloc(lfv_reader_state* s, size_t n, int doMemJmp)
 {
 	if(s->numMarksAlloc < n)
 	{
+		size_t oldAlloc = s->numMarksAlloc;
 		s->numMarksAlloc = CeilPow2(n);
 
-		s->marks = (size_t*)ReallocOrFree(s->marks,
+		s->marks = (size_t*)ReallocOrFree(s, s->marks, oldAlloc * sizeof(size_t),
 			MulSizeT(s, sizeof(size_t), s->numMarksAlloc));
 
 		if(!s->marks)
@@ -2653,22 +5515,95 @@ static size_t EnsureNumMarksAlloc(lfv_reader_state* s, size_t n, int doMemJmp)
 	return s->numMarksAlloc;
 }
 
+/*--------------------------------------
+	PushExpFrame
+
+Returns the index of the new frame, which starts at the current token.
+--------------------------------------*/
+static size_t PushExpFrame(lfv_reader_state* s, int kind)
+{
+	exp_frame* f;
+
+	if(s->numFramesAlloc <= s->numFrames)
+	{
+		size_t oldAlloc = s->numFramesAlloc;
+		s->numFramesAlloc = CeilPow2(AddSizeT(s, s->numFrames, 1));
+
+		s->frames = (exp_frame*)ReallocOrFree(s, s->frames, oldAlloc * sizeof(exp_frame),
+			MulSizeT(s, sizeof(exp_frame), s->numFramesAlloc));
+
+		if(!s->frames)
+		{
+			SetReaderError(s, "Failed to PushExpFrame", s->line, LFV_ERR_MEMORY);
+			s->numFrames = s->numFramesAlloc = 0;
+			longjmp(s->memErrJmp, 1);
+		}
+	}
+
+	f = &s->frames[s->numFrames];
+	f->kind = kind;
+	f->step = 0;
+	f->line = s->line;
+	f->start = s->tok;
+	f->saveNumMarks = s->numMarks;
+	f->hang = TRUE;
+	f->ref = FALSE;
+	f->par = 0;
+	f->delay = FALSE;
+	return s->numFrames++;
+}
+
 /*--------------------------------------
 	ReallocOrFree
+
+Resizes mem from oldSize to newSize bytes with s's allocator. If that fails or would grow s's
+buffers past s->maxMemory, mem is freed.
 --------------------------------------*/
-static void* ReallocOrFree(void* mem, size_t newSize)
+static void* ReallocOrFree(lfv_reader_state* s, void* mem, size_t oldSize, size_t newSize)
 {
-	void* newMem = realloc(mem, newSize);
+	void* newMem = 0;
+
+	if(s->maxMemory && newSize > oldSize &&
+	newSize - oldSize > s->maxMemory - MIN(s->memUsed, s->maxMemory))
+		SetReaderError(s, "Exceeded memory limit", s->line, LFV_ERR_MEMORY);
+	else
+		newMem = s->alloc(s->allocUd, mem, oldSize, newSize);
 
 	if(!newMem)
 	{
 		if(mem)
-			free(mem);
+			s->alloc(s->allocUd, mem, oldSize, 0);
+
+		s->memUsed -= oldSize;
 	}
+	else
+		s->memUsed += newSize - oldSize;
 
 	return newMem;
 }
 
+/*--------------------------------------
+	ReserveArray
+
+Returns mem realloc'd to hold at least n elements or mem itself if it already does. Returns 0 if
+realloc fails, in which case mem is not freed.
+--------------------------------------*/
+static void* ReserveArray(void* mem, size_t* alloc, size_t n, size_t elementSize)
+{
+	size_t newAlloc;
+
+	if(n <= *alloc && mem)
+		return mem;
+
+	newAlloc = CeilPow2(MAX(n, 1));
+
+	if(newAlloc > (size_t)-1 / elementSize || !(mem = realloc(mem, newAlloc * elementSize)))
+		return 0;
+
+	*alloc = newAlloc;
+	return mem;
+}
+
 /*--------------------------------------
 	AddMark
 --------------------------------------*/
@@ -2729,6 +5664,47 @@ static size_t MulSizeT(lfv_reader_state* s, size_t a, size_t b)
 	return c;
 }
 
+/*--------------------------------------
+	CheckLimits
+
+Sets error info and does longjmp to s->memErrJmp if the expansion has gone over one of s's limits.
+Output is counted as the chars read plus the chars inserted, so it's known before it's sent.
+--------------------------------------*/
+static void CheckLimits(lfv_reader_state* s)
+{
+	size_t out = s->numRead + s->numInserted;
+	size_t in = MAX(s->numRead, RATIO_MIN_INPUT);
+
+	if(s->maxOutput && out > s->maxOutput)
+		SetReaderError(s, "Exceeded output limit", s->line, LFV_ERR_OUTPUT);
+	else if(s->maxOutputRatio && out > in && (out - 1) / s->maxOutputRatio >= in)
+		SetReaderError(s, "Exceeded output ratio limit", s->line, LFV_ERR_RATIO);
+	else if(s->maxDuplications && s->numDups > s->maxDuplications)
+		SetReaderError(s, "Exceeded duplication limit", s->line, LFV_ERR_DUPS);
+	else if(s->maxTime && ClockMS() - s->timeStart > (double)s->maxTime)
+		SetReaderError(s, "Exceeded time limit", s->line, LFV_ERR_TIME);
+	else
+		return;
+
+	longjmp(s->memErrJmp, 1);
+}
+
+/*--------------------------------------
+	ClockMS
+
+Returns a wall-clock time in milliseconds for measuring how long expansion takes.
+--------------------------------------*/
+static double ClockMS(void)
+{
+#if defined(LFV_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#else
+	return clock() * 1000.0 / CLOCKS_PER_SEC; /* Processor time outside of Windows */
+#endif
+}
+
 /*--------------------------------------
 	IncRecursionLevel
 --------------------------------------*/
@@ -4,6 +4,11 @@
 #ifndef LFV_H
 #define LFV_H
 
+#include <stddef.h>
+
+/* Expansions kept by lfvSetCacheDir are only reused by the same version */
+#define LFV_VERSION "0.1"
+
 /* Returns string of file contents with vector expansion or 0 on error. Free result with
 lfvFreeBuffer.
 
@@ -17,7 +22,10 @@ If logPath is given and the file there can be opened, results are appended to th
 If 0 is returned, the err parameters are set to describe the error and are set to 0 otherwise.
 Each of these parameters is optional.
 
-UTF-8 BOM and first line starting with '#' are ignored and replaced with white space. */
+UTF-8 BOM and first line starting with '#' are ignored and replaced with white space.
+
+If a cache directory is set with lfvSetCacheDir, filePath is given and logPath is 0, the expansion
+is taken from the cache when there is one for the file's contents and is added to it otherwise. */
 char* lfvExpandFile(const char* filePath, int forceExpand, const char* logPath,
 	const char** errMsgOut, unsigned* errLineOut);
 
@@ -26,9 +34,211 @@ See lfvExpandFile for info on parameters. */
 char* lfvExpandString(const char* chunk, int forceExpand, const char* logPath,
 	const char** errMsgOut, unsigned* errLineOut);
 
+/* Like lfvExpandString, but takes len chars of chunk, which doesn't need to be null-terminated
+and may contain null chars. chunk is read as expansion goes instead of being copied up front. */
+char* lfvExpandStringN(const char* chunk, size_t len, int forceExpand, const char* logPath,
+	const char** errMsgOut, unsigned* errLineOut);
+
 /* Frees buffer returned by expand func; does nothing if 0 */
 void lfvFreeBuffer(char* buf);
 
+/* Receives size bytes of output at p, like lua_Writer. Returns 0 on success; otherwise, expansion
+stops with an error. */
+typedef int (*lfv_writer)(const void* p, size_t size, void* ud);
+
+/* Like lfvExpandFile, but instead of returning the expansion, hands it to write in pieces as soon
+as each piece is final. Only a few statements are held in memory at a time, so output can be
+piped with constant memory.
+
+Returns 1 on success or 0 on error. The pieces written before an error are not taken back. An
+expansion taken from the lfvSetCacheDir cache is written in one piece. */
+int lfvExpandFileTo(const char* filePath, int forceExpand, const char* logPath, lfv_writer write,
+	void* ud, const char** errMsgOut, unsigned* errLineOut);
+
+/* Like lfvExpandFileTo but takes the script as a string. */
+int lfvExpandStringTo(const char* chunk, int forceExpand, const char* logPath, lfv_writer write,
+	void* ud, const char** errMsgOut, unsigned* errLineOut);
+
+/* Like lfvExpandStringTo but takes len chars of chunk like lfvExpandStringN. */
+int lfvExpandStringNTo(const char* chunk, size_t len, int forceExpand, const char* logPath,
+	lfv_writer write, void* ud, const char** errMsgOut, unsigned* errLineOut);
+
+/* Sets the directory where lfvExpandFile, lfvExpandFileTo and the Lua loaders keep expansions of
+files between runs, or stops using one if dir is 0. dir is copied and must already exist. Returns 1
+on success or 0 if malloc fails.
+
+Each expansion is stored in its own file named after a 128-bit hash of the file's contents, the
+force flag and LFV_VERSION, and the file's length, so an unchanged file is only read and hashed
+instead of expanded, and an edited one is expanded again. Files are written under a temporary name
+and renamed into place, so processes can share the directory. Entries are never removed; clearing
+the directory is safe at any time.
+
+Cached text is loaded as if it were the expansion, so anyone who can write to the directory can
+make scripts run code of their choosing. Only use a directory that untrusted users can't write
+to. */
+int lfvSetCacheDir(const char* dir);
+
+/* Returns the next piece of a script and sets *size to its length, like lua_Reader. The piece
+must stay valid until the next call. Returning 0 or setting *size to 0 ends the script. */
+typedef const char* (*lfv_source)(void* ud, size_t* size);
+
+/* Like lfvExpandFileTo, but the script is pulled from read, which is passed readUd, only as
+expansion needs it. name is used in the log. */
+int lfvExpandSourceTo(lfv_source read, void* readUd, const char* name, int forceExpand,
+	const char* logPath, lfv_writer write, void* ud, const char** errMsgOut,
+	unsigned* errLineOut);
+
+typedef struct lfv_context_s lfv_context;
+
+/* Returns a new context or 0 if malloc fails. Free it with lfvFreeContext.
+
+A context keeps the buffers used during expansion so later expansions with the context can reuse
+them instead of allocating their own. Once the buffers have grown enough, expanding a string with
+a context allocates nothing unless logPath is given. */
+lfv_context* lfvNewContext(void);
+
+/* Allocator with the same contract as lua_Alloc: frees ptr and returns 0 if nsize is 0, otherwise
+returns ptr resized from osize to nsize bytes or 0 on failure, leaving ptr as it was. osize is 0
+when ptr is 0. */
+typedef void* (*lfv_alloc)(void* ud, void* ptr, size_t osize, size_t nsize);
+
+/* Like lfvNewContext, but the context and every buffer used by expansions with it are allocated
+with alloc, which is passed ud. If alloc is 0, realloc and free are used. A lua_State's allocator
+from lua_getallocf can be given. */
+lfv_context* lfvNewContextAlloc(lfv_alloc alloc, void* ud);
+
+/* Streaming parameters and limits of expansions with a context. A field left 0 keeps its
+default. */
+typedef struct lfv_options_s {
+	/* Chars read from the input at a time and the size of the first buffer; 256 by default and
+	no less than 16. Also replaces the 4096-char reads done when streaming a script that isn't
+	being expanded. */
+	size_t	readSize;
+
+	/* When streaming, e.g. to lua_load, stats are sent together until they add up to at least
+	this many chars or the script ends. By default, each stat is sent as soon as it's done. */
+	size_t	minFlush;
+
+	/* Most bytes the expansion's buffers may take up together, including a feed's unexpanded
+	chars. Growing past it fails with LFV_ERR_MEMORY ("Exceeded memory limit"). Unlimited by
+	default. Without streaming, the whole expansion is held in the buffer, so this limits the
+	size of the script too. */
+	size_t	maxMemory;
+
+	/* The limits below guard against scripts whose expansion blows up, e.g. vectors nested in
+	function args. Each is checked as the expansion grows and fails it with its own error code as
+	soon as it's exceeded. All are unlimited by default. */
+
+	/* Most chars the expansion may output. Fails with LFV_ERR_OUTPUT ("Exceeded output
+	limit"). */
+	size_t	maxOutput;
+
+	/* Most chars of output per char of input. Scripts shorter than 4096 chars are allowed as much
+	output as a 4096-char script. Fails with LFV_ERR_RATIO ("Exceeded output ratio limit"). */
+	size_t	maxOutputRatio;
+
+	/* Most expressions duplicated for vector components, e.g. "v3a + 1" counts as 2. Fails with
+	LFV_ERR_DUPS ("Exceeded duplication limit"). */
+	size_t	maxDuplications;
+
+	/* Most milliseconds of wall-clock time spent expanding. Only time inside the expansion is
+	counted, not time a feed spends waiting for lfvFeed or a writer spends writing. Fails with
+	LFV_ERR_TIME ("Exceeded time limit"). */
+	size_t	maxTime;
+} lfv_options;
+
+/* Sets the options used by later expansions with ctx. opts is copied. */
+void lfvContextSetOptions(lfv_context* ctx, const lfv_options* opts);
+
+/* Sends the log of every later expansion with ctx to write, which is passed ud, instead of
+appending it to logPath; logPath isn't needed. Each expansion's log is collected in memory and
+passed in one call when the expansion ends, so logs of expansions on different threads sharing a
+sink don't interleave. write's return value is ignored; a failed log doesn't fail the expansion.
+Passing 0 for write stops the sink. See lfvNewLogBuffer for a sink that writes to a file. */
+void lfvContextSetLogSink(lfv_context* ctx, lfv_writer write, void* ud);
+
+/* Like lfvExpandFile, but uses ctx's buffers. The returned string belongs to ctx and stays valid
+until ctx is used again. Returns 0 with an error if ctx is in use, e.g. by a reader state. */
+const char* lfvContextExpandFile(lfv_context* ctx, const char* filePath, int forceExpand,
+	const char* logPath, const char** errMsgOut, unsigned* errLineOut);
+
+/* Like lfvContextExpandFile but takes the script as a string. */
+const char* lfvContextExpandString(lfv_context* ctx, const char* chunk, int forceExpand,
+	const char* logPath, const char** errMsgOut, unsigned* errLineOut);
+
+/* Like lfvContextExpandString but takes len chars of chunk like lfvExpandStringN. */
+const char* lfvContextExpandStringN(lfv_context* ctx, const char* chunk, size_t len,
+	int forceExpand, const char* logPath, const char** errMsgOut, unsigned* errLineOut);
+
+/* Frees ctx and its buffers; does nothing if 0 */
+void lfvFreeContext(lfv_context* ctx);
+
+typedef struct lfv_feed_s lfv_feed;
+
+/* Returns a new feed or 0 if allocation fails. Free it with lfvFreeFeed.
+
+A feed expands a script that's pushed to it in pieces with lfvFeed, e.g. as they're decompressed
+or received. Each call expands as far as the chars fed so far allow and passes the finished
+output to write, like lfvExpandFileTo. Call lfvFinish after the last piece.
+
+If ctx is given, the feed uses its allocator and buffers until the feed is freed. See
+lfvExpandFile for the other parameters. */
+lfv_feed* lfvNewFeed(lfv_context* ctx, const char* name, int forceExpand, const char* logPath,
+	lfv_writer write, void* ud);
+
+/* Appends len chars of data to feed's script and expands what it can. data is copied, so it can
+be reused after the call. Returns 1 on success or 0 on error; lfvFinish gives the error.
+
+A stat that's cut off by the end of the fed chars is expanded again from its start on the next
+call, so feeding pieces smaller than a typical stat costs extra time. */
+int lfvFeed(lfv_feed* feed, const char* data, size_t len);
+
+/* Ends feed's script, expands the rest and returns 1 on success or 0 on error. The err
+parameters work like lfvExpandFile's. */
+int lfvFinish(lfv_feed* feed, const char** errMsgOut, unsigned* errLineOut);
+
+/* Frees feed; does nothing if 0 */
+void lfvFreeFeed(lfv_feed* feed);
+
+typedef struct lfv_incremental_s lfv_incremental;
+
+/* Returns a new incremental expansion for lfvReexpandString or 0 if malloc fails. Free it with
+lfvFreeIncremental. */
+lfv_incremental* lfvNewIncremental(void);
+
+/* Like lfvExpandString, but inc keeps the chunk, its expansion and where each top-level stat ends
+in both. When chunk is an edited version of the last chunk given to inc, only the stats around the
+edit are expanded again and spliced into the last expansion.
+
+The returned string belongs to inc and stays valid until the next call with inc. On error, 0 is
+returned and the next call expands its whole chunk. */
+const char* lfvReexpandString(lfv_incremental* inc, const char* chunk, int forceExpand,
+	const char** errMsgOut, unsigned* errLineOut);
+
+/* Frees inc and its expansion; does nothing if 0 */
+void lfvFreeIncremental(lfv_incremental* inc);
+
+typedef struct lfv_log_buffer_s lfv_log_buffer;
+
+/* Returns a buffered log writer that appends to the file at path, or 0 if the file can't be
+opened or malloc fails. Free it with lfvFreeLogBuffer.
+
+Logs passed to lfvLogBufferWrite are batched in memory and written by a background thread once
+flushSize bytes (64 KB if 0) build up, so expansions don't wait on the file. It can be shared by
+contexts on different threads. If built with LFV_NO_THREADS, the batch is written by the thread
+that fills it instead and the buffer must not be shared between threads. */
+lfv_log_buffer* lfvNewLogBuffer(const char* path, size_t flushSize);
+
+/* lfv_writer that adds size bytes at p to the lfv_log_buffer ud, e.g. for
+lfvContextSetLogSink(ctx, lfvLogBufferWrite, buffer). Returns 0 on success. */
+int lfvLogBufferWrite(const void* p, size_t size, void* ud);
+
+/* Returns once everything added to buffer so far is written to its file */
+void lfvFlushLogBuffer(lfv_log_buffer* buffer);
+
+/* Flushes buffer, stops its thread and frees it; does nothing if 0 */
+void lfvFreeLogBuffer(lfv_log_buffer* buffer);
+
 #endif
 
 /*
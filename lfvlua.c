@@ -4,7 +4,23 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#if !defined(LFV_NO_THREADS)
+	#if defined(_WIN32)
+		#define WIN32_LEAN_AND_MEAN
+		#define NOMINMAX
+		#include <windows.h>
+		#define LFV_WIN32_THREADS
+	#else
+		#include <pthread.h>
+		#define LFV_PTHREADS
+	#endif
+
+	#define LFV_THREADS
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -18,18 +34,22 @@
 	#define cross_lua_equal(L, idx1, idx2) lua_compare(L, idx1, idx2, LUA_OPEQ)
 	#define cross_lua_pushlstring(L, s, len) lua_pushlstring(L, s, len)
 	#define cross_lua_absindex(L, idx) lua_absindex(L, idx)
+	#define cross_luaL_loadbufferx(L, buff, sz, name, mode) luaL_loadbufferx(L, buff, sz, name, mode)
 #else
 	#define cross_lua_load(L, reader, data, chunkname, mode) lua_load(L, reader, data, chunkname)
+	#define cross_luaL_loadbufferx(L, buff, sz, name, mode) luaL_loadbuffer(L, buff, sz, name)
 	#define cross_lua_equal(L, idx1, idx2) lua_equal(L, idx1, idx2)
 	#define cross_lua_pushlstring(L, s, len) (lua_pushlstring(L, s, len), lua_tostring(L, -1))
 	#define cross_lua_absindex(L, idx) ((idx) < 0 ? lua_gettop(L) + ((idx) + 1) : (idx)) /* Doesn't support pseudo-indices */
 #endif
 
 #if LUA_VERSION_NUM >= 503
+	#define cross_lua_dump(L, writer, data, strip) lua_dump(L, writer, data, strip)
 	#define cross_lua_rawgeti(L, idx, n) lua_rawgeti(L, idx, n)
 	#define cross_lua_getglobal(L, name) lua_getglobal(L, name)
 	#define cross_lua_getfield(L, idx, k) lua_getfield(L, idx, k)
 #else
+	#define cross_lua_dump(L, writer, data, strip) lua_dump(L, writer, data)
 	#define cross_lua_rawgeti(L, idx, n) (lua_rawgeti(L, idx, n), lua_type(L, -1))
 	#define cross_lua_getglobal(L, name) (lua_getglobal(L, name), lua_type(L, -1))
 	#define cross_lua_getfield(L, idx, k) (lua_getfield(L, idx, k), lua_type(L, -1))
@@ -56,14 +76,196 @@
 	#define LUA_OK 0
 #endif
 
-typedef char* ExpandFunc(const char* str, int forceExpand, const char* logPath,
-	const char** errMsgOut, unsigned* errLineOut);
+#if defined(__linux__)
+	#define STAT_MTIME_NSEC(st) ((long long)(st).st_mtim.tv_nsec)
+#else
+	#define STAT_MTIME_NSEC(st) 0LL
+#endif
+
+#if defined(LFV_PTHREADS)
+	#define CACHE_LOCK_INIT PTHREAD_RWLOCK_INITIALIZER
+	#define READ_LOCK_CACHE(c) pthread_rwlock_rdlock(&(c)->lock)
+	#define READ_UNLOCK_CACHE(c) pthread_rwlock_unlock(&(c)->lock)
+	#define WRITE_LOCK_CACHE(c) pthread_rwlock_wrlock(&(c)->lock)
+	#define WRITE_UNLOCK_CACHE(c) pthread_rwlock_unlock(&(c)->lock)
+#elif defined(LFV_WIN32_THREADS)
+	#define CACHE_LOCK_INIT SRWLOCK_INIT
+	#define READ_LOCK_CACHE(c) AcquireSRWLockShared(&(c)->lock)
+	#define READ_UNLOCK_CACHE(c) ReleaseSRWLockShared(&(c)->lock)
+	#define WRITE_LOCK_CACHE(c) AcquireSRWLockExclusive(&(c)->lock)
+	#define WRITE_UNLOCK_CACHE(c) ReleaseSRWLockExclusive(&(c)->lock)
+#else
+	#define READ_LOCK_CACHE(c) ((void)0)
+	#define READ_UNLOCK_CACHE(c) ((void)0)
+	#define WRITE_LOCK_CACHE(c) ((void)0)
+	#define WRITE_UNLOCK_CACHE(c) ((void)0)
+#endif
+
+#if !defined(LFV_THREADS)
+	#define ATOMIC_ADD(p, n) (*(p) += (n))
+	#define ATOMIC_GET(p) (*(p))
+	#define ATOMIC_SET(p, v) (*(p) = (v))
+#elif defined(_MSC_VER)
+	#define ATOMIC_ADD(p, n) InterlockedAdd64((p), (n))
+	#define ATOMIC_GET(p) InterlockedCompareExchange64((p), 0, 0)
+	#define ATOMIC_SET(p, v) InterlockedExchange64((p), (v))
+#else
+	#define ATOMIC_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_ACQ_REL)
+	#define ATOMIC_GET(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+	#define ATOMIC_SET(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
+#define EXPANDER_META "lfv.Expander"
+#define LOG_SINK_META "lfv.LogSink"
+#define LOG_SINK_KEY "lfv.CurrentLogSink" /* Registry field of the sink set by lfvCLuaSetLogSink */
+#define PATH_CACHE_KEY "lfv.PathCache" /* Registry field of the module paths found by FindModule */
+#define CACHE_USER_META "lfv.CacheUser"
+#define CACHE_USER_KEY "lfv.StateCacheUser" /* Registry field of the userdata made by UseCache */
+#define CACHE_MIN_BUCKETS 64
+#define CAPTURE_MIN_SIZE 1024 /* Chars of expanded text room a capture starts with */
+#define HASH_OFFSET 14695981039346656037ULL /* FNV-1a */
+#define HASH_PRIME 1099511628211ULL
+#define ENTRY_TEXT(e) ((char*)((e) + 1) + (e)->key.len + 1)
+#define USE_MEMORY_CACHE 1 /* LoadChunk flag, see lfvCLuaSetCacheLimit */
+#define USE_DISK_CACHE 2 /* LoadChunk flag, see lfvSetCacheDir */
+#define BYTECODE_MAGIC "lfv bytecode"
+#define BYTECODE_HEADER_FORMAT BYTECODE_MAGIC " %s %d %016llx%016llx %016llx\n" /* LFV_VERSION,
+	LUA_VERSION_NUM, lfvHashFile hash and length of the module file */
+#define BYTECODE_HEADER_MAX 128
+
+/* Userdata made by lfvCLuaNewExpander */
+typedef struct lfv_lua_expander_s {
+	lfv_context*	ctx;
+} lua_expander;
+
+/* Userdata made by lfvCLuaSetLogSink for a log path */
+typedef struct lfv_lua_log_sink_s {
+	lfv_log_buffer*	buffer;
+} lua_log_sink;
+
+/* Identifies an expansion kept by the cache */
+typedef struct lfv_lua_cache_key_s {
+	const char*			data; /* Chunk, or path of the file */
+	size_t				len;
+	int					isFile, force;
+	long long			fileSize, mtime; /* mtime is in nanoseconds where stat gives them */
+	unsigned long long	hash;
+} cache_key;
+
+/* Expansion kept by the cache. The key's data and then the expanded text follow the entry, each
+null-terminated. Entries don't change once inserted, so loads read the text without the lock while
+holding a reference. */
+typedef struct lfv_lua_cache_entry_s {
+	struct lfv_lua_cache_entry_s	*prev, *next; /* Neighbors in the clock ring */
+	struct lfv_lua_cache_entry_s*	chain; /* Next entry in the same bucket */
+	cache_key						key;
+	size_t							textLen;
+	size_t							size; /* Bytes allocated, including the entry */
+	long long						refs; /* Held by the cache while inserted and by each load */
+	long long						used; /* Set by lookups, cleared as the clock hand passes */
+} cache_entry;
+
+/* Process-wide cache set by lfvCLuaSetCacheLimit and shared by every state. Lookups only take the
+lock for reading; inserting and evicting take it for writing. */
+typedef struct lfv_lua_cache_s {
+#if defined(LFV_PTHREADS)
+	pthread_rwlock_t	lock;
+#elif defined(LFV_WIN32_THREADS)
+	SRWLOCK				lock;
+#endif
+	cache_entry**		buckets;
+	size_t				numBuckets, numEntries;
+	cache_entry*		hand; /* Next entry the clock considers evicting, 0 if empty */
+	size_t				limit, used; /* Bytes */
+	long long			numHits, numMisses;
+	size_t				numUsers; /* States that opened the module and aren't closed yet */
+} lua_cache;
+
+/* Bytecode cache file of a module being loaded by lfvCLuaSearcher */
+typedef struct lfv_lua_bytecode_s {
+	char		header[BYTECODE_HEADER_MAX]; /* BYTECODE_HEADER_FORMAT text that starts the file */
+	int			headerLen;
+	char		path[FILENAME_MAX]; /* Empty if there's no cache file */
+} bytecode;
+
+/* Bytecode modes set by lfvCLuaSetBytecodeCache */
+enum
+{
+	BYTECODE_OFF,
+	BYTECODE_ON,
+	BYTECODE_STRIP
+};
+
+/* lua_load data of ReaderFile */
+typedef struct lfv_lua_file_reader_s {
+	FILE*				f;
+	char				buf[BUFSIZ];
+} file_reader;
+
+/* Expansion being copied into a new cache entry while lua_load reads it, see ReaderCapture */
+typedef struct lfv_lua_capture_s {
+	lfv_reader_state*	rs;
+	size_t				limit; /* Cache limit when the capture started */
+	cache_entry*		entry; /* 0 if nothing is being captured */
+	lfv_disk_cache*		disk; /* Disk cache the expansion is also written to, 0 if none */
+} capture;
+
+#if defined(LFV_THREADS)
+	static lua_cache cache = {CACHE_LOCK_INIT, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+#else
+	static lua_cache cache;
+#endif
+
+static long long bytecodeMode = BYTECODE_OFF; /* Process-wide like cache */
 
+static lfv_context* NewLuaContext(lua_State* l);
 static const char* ReaderLua(lua_State* l, void* dataIO, size_t* sizeOut);
 static int SetupLoadReturn(lua_State* l, const lfv_reader_state* rs, int loadRet);
 static int ConvertErrorLfvToLuaLoad(int loadRet);
-static const char* FindModulePath(lua_State* l, const char* moduleName);
-static int GenericCLuaExpand(lua_State* l, ExpandFunc* func, int isFilePath);
+static int LoadTextFile(lfv_context* ctxIO, lua_State* l, const char* filePath,
+			int forceExpand, const char* logPath, int* binOut, int caches);
+static int LoadChunk(lfv_context* ctxIO, lua_State* l, const char* chunk, size_t len,
+			FILE* f, const lfv_file_hash* hash, const char* name, int forceExpand,
+			const char* logPath, int* binOut, int caches);
+static const char* ReaderCapture(lua_State* l, void* dataIO, size_t* sizeOut);
+static FILE* FindModule(lua_State* l, const char* moduleName);
+static void PushPathCache(lua_State* l, int path);
+static FILE* OpenModuleFile(lua_State* l, const char* path, const char* moduleName);
+static int AppendPath(char* buf, size_t* numIO, const char* str, size_t len);
+static size_t CacheLimit(void);
+static int InitCacheKey(cache_key* keyOut, const char* data, size_t len, int isFile, int force);
+static unsigned long long HashBytes(const void* p, size_t len, unsigned long long hash);
+static cache_entry* FindCacheEntry(const cache_key* key, size_t* limitOut);
+static cache_entry* FindCacheBucket(const cache_key* key);
+static void ReleaseCacheEntry(cache_entry* entryIO);
+static void StartCapture(capture* capOut, const cache_key* key, size_t limit);
+static void AppendCapture(capture* capIO, const char* text, size_t len);
+static void StoreCapture(capture* capIO);
+static void DropCapture(capture* capIO);
+static void InsertCacheEntry(cache_entry* entryIO);
+static void RemoveCacheEntry(cache_entry* entryIO);
+static void TrimCache(size_t limit);
+static int LoadBytecode(lua_State* l, const lfv_file_hash* hash, const char* modulePath,
+			int strip, bytecode* bcOut);
+static void StoreBytecode(lua_State* l, int strip, const bytecode* bc);
+static const char* ReaderFile(lua_State* l, void* dataIO, size_t* sizeOut);
+static int WriteFile(lua_State* l, const void* p, size_t size, void* ud);
+static void UseCache(lua_State* l);
+static int CacheUserGC(lua_State* l);
+static int GenericCLuaLoad(lua_State* l, lua_expander* eIO, int isFilePath);
+static int GenericCLuaExpand(lua_State* l, lua_expander* eIO, int isFilePath);
+static int PushReaderString(lua_State* l);
+static lua_expander* CheckExpander(lua_State* l);
+static int ExpanderLoadTextFile(lua_State* l);
+static int ExpanderLoadString(lua_State* l);
+static int ExpanderExpandFile(lua_State* l);
+static int ExpanderExpandString(lua_State* l);
+static int ExpanderGC(lua_State* l);
+static void SetLuaLogSink(lua_State* l, lfv_context* ctxIO);
+static int WriteLuaLog(const void* p, size_t size, void* ud);
+static void FreeLuaLogSink(lua_State* l);
+static int LogSinkGC(lua_State* l);
+static size_t OptionField(lua_State* l, int t, const char* name);
 static int GetGlobalTableField(lua_State* l, const char* table, const char* field);
 static void TableRawInsert(lua_State* l, int t, int n);
 
@@ -73,12 +275,132 @@ static void TableRawInsert(lua_State* l, int t, int n);
 int lfvLoadTextFile(lua_State* l, const char* filePath, int forceExpand, const char* logPath,
 	int* bin)
 {
-	lfv_reader_state rs;
-	FILE* f;
+	return lfvContextLoadTextFile(0, l, filePath, forceExpand, logPath, bin);
+}
+
+/*--------------------------------------
+	SetLuaLogSink
+
+Points ctx's log sink at the one set with lfvCLuaSetLogSink, if any. A function sink is called
+with l, so it must be cleared once the call using ctx is done.
+--------------------------------------*/
+static void SetLuaLogSink(lua_State* l, lfv_context* ctx)
+{
+	int type = cross_lua_getfield(l, LUA_REGISTRYINDEX, LOG_SINK_KEY);
+
+	if(type == LUA_TFUNCTION)
+		lfvContextSetLogSink(ctx, WriteLuaLog, l);
+	else if(type == LUA_TUSERDATA)
+	{
+		lua_log_sink* sink = (lua_log_sink*)lua_touserdata(l, -1);
+		lfvContextSetLogSink(ctx, lfvLogBufferWrite, sink->buffer);
+	}
+	else
+		lfvContextSetLogSink(ctx, 0, 0);
+
+	lua_pop(l, 1);
+}
+
+/*--------------------------------------
+	WriteLuaLog
+
+Log sink that calls the function set with lfvCLuaSetLogSink. The reader state sends its log once
+it's terminated, after lua_load is done, so calling into l is safe. Errors are ignored like a
+failed log file.
+--------------------------------------*/
+static int WriteLuaLog(const void* p, size_t size, void* ud)
+{
+	lua_State* l = (lua_State*)ud;
+
+	if(!lua_checkstack(l, 2))
+		return 1;
+
+	if(cross_lua_getfield(l, LUA_REGISTRYINDEX, LOG_SINK_KEY) != LUA_TFUNCTION)
+	{
+		lua_pop(l, 1);
+		return 1;
+	}
+
+	lua_pushlstring(l, (const char*)p, size);
+
+	if(lua_pcall(l, 1, 0, 0) != LUA_OK)
+	{
+		lua_pop(l, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------
+	FreeLuaLogSink
+
+Flushes and frees the log buffer of the sink set with lfvCLuaSetLogSink, if any, and clears the
+sink.
+--------------------------------------*/
+static void FreeLuaLogSink(lua_State* l)
+{
+	if(cross_lua_getfield(l, LUA_REGISTRYINDEX, LOG_SINK_KEY) == LUA_TUSERDATA)
+	{
+		lua_log_sink* sink = (lua_log_sink*)lua_touserdata(l, -1);
+		lfvFreeLogBuffer(sink->buffer);
+		sink->buffer = 0;
+	}
+
+	lua_pop(l, 1);
+	lua_pushnil(l);
+	lua_setfield(l, LUA_REGISTRYINDEX, LOG_SINK_KEY);
+}
+
+/*--------------------------------------
+	LogSinkGC
+--------------------------------------*/
+static int LogSinkGC(lua_State* l)
+{
+	lua_log_sink* sink = (lua_log_sink*)luaL_checkudata(l, 1, LOG_SINK_META);
+	lfvFreeLogBuffer(sink->buffer);
+	sink->buffer = 0;
+	return 0;
+}
+
+/*--------------------------------------
+	lfvContextLoadTextFile
+
+If ctx is 0, a context using l's allocator is made for the call, and the lfvSetCacheDir cache is
+used unless logPath is given.
+--------------------------------------*/
+int lfvContextLoadTextFile(lfv_context* ctx, lua_State* l, const char* filePath, int forceExpand,
+	const char* logPath, int* bin)
+{
+	lfv_context* tempCtx = 0;
 	int ret;
 
 	if(bin) *bin = 0;
 
+	if(!ctx && !(ctx = tempCtx = NewLuaContext(l)))
+	{
+		lua_pushliteral(l, "Failed to create expansion context");
+		return LUA_ERRMEM;
+	}
+
+	ret = LoadTextFile(ctx, l, filePath, forceExpand, logPath, bin, tempCtx ? USE_DISK_CACHE : 0);
+	lfvFreeContext(tempCtx);
+	return ret;
+}
+
+/*--------------------------------------
+	LoadTextFile
+
+OUT	CompiledChunk | sError
+
+Opens filePath, or uses stdin if it's 0, and loads it with LoadChunk.
+--------------------------------------*/
+static int LoadTextFile(lfv_context* ctx, lua_State* l, const char* filePath, int forceExpand,
+	const char* logPath, int* bin, int caches)
+{
+	FILE* f;
+	int ret;
+
 	if(filePath)
 		f = fopen(filePath, "r");
 	else
@@ -90,22 +412,124 @@ int lfvLoadTextFile(lua_State* l, const char* filePath, int forceExpand, const c
 		return LUA_ERRFILE;
 	}
 
-	if(lfvInitReaderState(0, f, filePath ? filePath : "stdin", forceExpand, 1, 1, logPath, &rs))
+	ret = LoadChunk(ctx, l, 0, 0, f, 0, filePath ? filePath : "stdin", forceExpand, logPath, bin,
+		filePath ? caches : 0);
+
+	if(filePath)
+		fclose(f);
+
+	return ret;
+}
+
+/*--------------------------------------
+	LoadChunk
+
+OUT	CompiledChunk | sError
+
+Loads the text of f, which is left open, or len chars of chunk if f is 0, with ctx's buffers. name
+must stay valid until this returns.
+
+caches has the cache flags to use. With USE_MEMORY_CACHE, if the cache is enabled, an expansion of
+the same chunk, or of the same file path, size and modification time, is compiled from the cache
+without expanding. Otherwise, the expansion is copied into a new entry as lua_load reads it and
+kept if loading succeeds.
+
+With USE_DISK_CACHE, f is looked up in the lfvSetCacheDir cache after the memory cache, unless
+logPath is given. A found expansion is compiled and copied into the memory cache. Otherwise, the
+expansion is also written to the disk cache as lua_load reads it. If hash isn't 0, it's f's
+lfvHashFile hash with forceExpand, and f isn't hashed again.
+--------------------------------------*/
+static int LoadChunk(lfv_context* ctx, lua_State* l, const char* chunk, size_t len, FILE* f,
+	const lfv_file_hash* hash, const char* name, int forceExpand, const char* logPath, int* bin,
+	int caches)
+{
+	lfv_reader_state rs;
+	lfv_disk_cache dc;
+	cache_key key;
+	capture cap;
+	int ret;
+
+	if(bin) *bin = 0;
+
+	cap.entry = 0;
+	cap.disk = 0;
+
+	/* The key hashes the whole chunk or stats the file, so don't make one if the cache is off */
+	if((caches & USE_MEMORY_CACHE) && CacheLimit() && InitCacheKey(&key, f ? name : chunk,
+	f ? strlen(name) : len, f != 0, forceExpand))
+	{
+		size_t limit;
+		cache_entry* entry = FindCacheEntry(&key, &limit);
+
+		if(entry)
+		{
+			ret = cross_luaL_loadbufferx(l, ENTRY_TEXT(entry), entry->textLen, name, "t");
+			ReleaseCacheEntry(entry);
+			return ret;
+		}
+
+		if(limit)
+			StartCapture(&cap, &key, limit);
+	}
+
+	if((caches & USE_DISK_CACHE) && f && !logPath &&
+	(hash ? lfvOpenHashedDiskCache(hash, &dc) : lfvOpenDiskCache(f, forceExpand, &dc)))
+	{
+		if(dc.text)
+		{
+			ret = cross_luaL_loadbufferx(l, dc.text, dc.textLen, name, "t");
+
+			if(ret == LUA_OK)
+			{
+				AppendCapture(&cap, dc.text, dc.textLen);
+				StoreCapture(&cap);
+			}
+			else
+				DropCapture(&cap);
+
+			lfvCloseDiskCache(&dc, 0);
+			return ret;
+		}
+
+		cap.disk = &dc;
+	}
+
+	if(lfvInitContextReaderState(ctx, f ? 0 : chunk, len, f, name, forceExpand, 1, f != 0, logPath,
+	&rs))
 	{
 		lua_pushstring(l, rs.earliestError);
 
 		if(bin && rs.errorCode == LFV_ERR_BINARY)
 			*bin = 1;
 
-		return ConvertErrorLfvToLuaLoad(rs.errorCode);
+		ret = ConvertErrorLfvToLuaLoad(rs.errorCode);
+		lfvTermReaderState(&rs, 1);
+		DropCapture(&cap);
+
+		if(cap.disk)
+			lfvCloseDiskCache(cap.disk, 0);
+
+		return ret;
 	}
 
-	ret = cross_lua_load(l, ReaderLua, (void*)&rs, rs.name, "t");
+	rs.passVecFree = 1; /* lua_load reports syntax errors in chunks lfv doesn't parse */
+	cap.rs = &rs;
 
-	if(filePath)
-		fclose(f);
+	if(cap.entry || cap.disk)
+		ret = cross_lua_load(l, ReaderCapture, (void*)&cap, rs.name, "t");
+	else
+		ret = cross_lua_load(l, ReaderLua, (void*)&rs, rs.name, "t");
 
 	ret = SetupLoadReturn(l, &rs, ret);
+
+	if(ret == LUA_OK)
+		StoreCapture(&cap);
+	else
+		DropCapture(&cap);
+
+	if(cap.disk)
+		lfvCloseDiskCache(cap.disk, ret == LUA_OK);
+
 	lfvTermReaderState(&rs, 1);
 	return ret;
 }
@@ -115,18 +539,46 @@ int lfvLoadTextFile(lua_State* l, const char* filePath, int forceExpand, const c
 --------------------------------------*/
 int	lfvLoadString(lua_State* l, const char* chunk, int forceExpand, const char* logPath)
 {
-	lfv_reader_state rs;
+	return lfvContextLoadString(0, l, chunk, forceExpand, logPath);
+}
+
+/*--------------------------------------
+	lfvLoadStringN
+--------------------------------------*/
+int lfvLoadStringN(lua_State* l, const char* chunk, size_t len, const char* name,
+	int forceExpand, const char* logPath)
+{
+	return lfvContextLoadStringN(0, l, chunk, len, name, forceExpand, logPath);
+}
+
+/*--------------------------------------
+	lfvContextLoadString
+--------------------------------------*/
+int lfvContextLoadString(lfv_context* ctx, lua_State* l, const char* chunk, int forceExpand,
+	const char* logPath)
+{
+	return lfvContextLoadStringN(ctx, l, chunk, strlen(chunk), chunk, forceExpand, logPath);
+}
+
+/*--------------------------------------
+	lfvContextLoadStringN
+
+If ctx is 0, a context using l's allocator is made for the call.
+--------------------------------------*/
+int lfvContextLoadStringN(lfv_context* ctx, lua_State* l, const char* chunk, size_t len,
+	const char* name, int forceExpand, const char* logPath)
+{
+	lfv_context* tempCtx = 0;
 	int ret;
 
-	if(lfvInitReaderState(chunk, 0, chunk, forceExpand, 1, 0, logPath, &rs))
+	if(!ctx && !(ctx = tempCtx = NewLuaContext(l)))
 	{
-		lua_pushstring(l, rs.earliestError);
-		return ConvertErrorLfvToLuaLoad(rs.errorCode);
+		lua_pushliteral(l, "Failed to create expansion context");
+		return LUA_ERRMEM;
 	}
 
-	ret = cross_lua_load(l, ReaderLua, (void*)&rs, rs.name, "t");
-	ret = SetupLoadReturn(l, &rs, ret);
-	lfvTermReaderState(&rs, 1);
+	ret = LoadChunk(ctx, l, chunk, len, 0, 0, name, forceExpand, logPath, 0, 0);
+	lfvFreeContext(tempCtx);
 	return ret;
 }
 
@@ -143,6 +595,12 @@ int luaopen_lfv(lua_State* l)
 		{"ExpandFile", lfvCLuaExpandFile},
 		{"ExpandString", lfvCLuaExpandString},
 		{"Searcher", lfvCLuaSearcher},
+		{"NewExpander", lfvCLuaNewExpander},
+		{"SetLogSink", lfvCLuaSetLogSink},
+		{"SetCacheLimit", lfvCLuaSetCacheLimit},
+		{"GetCacheStats", lfvCLuaGetCacheStats},
+		{"SetCacheDir", lfvCLuaSetCacheDir},
+		{"SetBytecodeCache", lfvCLuaSetBytecodeCache},
 		{0, 0}
 	};
 
@@ -151,6 +609,7 @@ int luaopen_lfv(lua_State* l)
 		{0, 0}
 	};
 
+	UseCache(l);
 	lua_createtable(l, 0, (sizeof(functions) / sizeof(luaL_Reg) - 1) + (sizeof(closures) / sizeof(luaL_Reg) - 1));
 
 	for(reg = functions; reg->name; reg++)
@@ -174,15 +633,7 @@ int luaopen_lfv(lua_State* l)
 --------------------------------------*/
 int	lfvCLuaLoadTextFile(lua_State* l)
 {
-	if(lfvLoadTextFile(l, luaL_checkstring(l, 1), lua_toboolean(l, 2),
-	luaL_optstring(l, 3, 0), 0) != LUA_OK)
-	{
-		lua_pushnil(l);
-		lua_insert(l, -2);
-		return 2;
-	}
-
-	return 1;
+	return GenericCLuaLoad(l, 0, 1);
 }
 
 /*--------------------------------------
@@ -190,15 +641,7 @@ int	lfvCLuaLoadTextFile(lua_State* l)
 --------------------------------------*/
 int	lfvCLuaLoadString(lua_State* l)
 {
-	if(lfvLoadString(l, luaL_checkstring(l, 1), lua_toboolean(l, 2),
-		luaL_optstring(l, 3, 0)) != LUA_OK)
-	{
-		lua_pushnil(l);
-		lua_insert(l, -2);
-		return 2;
-	}
-
-	return 1;
+	return GenericCLuaLoad(l, 0, 0);
 }
 
 /*--------------------------------------
@@ -206,7 +649,7 @@ int	lfvCLuaLoadString(lua_State* l)
 --------------------------------------*/
 int	lfvCLuaExpandFile(lua_State* l)
 {
-	return GenericCLuaExpand(l, lfvExpandFile, 1);
+	return GenericCLuaExpand(l, 0, 1);
 }
 
 /*--------------------------------------
@@ -214,7 +657,67 @@ int	lfvCLuaExpandFile(lua_State* l)
 --------------------------------------*/
 int	lfvCLuaExpandString(lua_State* l)
 {
-	return GenericCLuaExpand(l, lfvExpandString, 0);
+	return GenericCLuaExpand(l, 0, 0);
+}
+
+/*--------------------------------------
+	lfvCLuaNewExpander
+--------------------------------------*/
+int lfvCLuaNewExpander(lua_State* l)
+{
+	int hasOpts = !lua_isnoneornil(l, 1);
+	lua_expander* e;
+
+	if(hasOpts)
+		luaL_checktype(l, 1, LUA_TTABLE);
+
+	e = (lua_expander*)lua_newuserdata(l, sizeof(lua_expander));
+	e->ctx = 0;
+
+	if(luaL_newmetatable(l, EXPANDER_META))
+	{
+		luaL_Reg* reg;
+
+		luaL_Reg methods[] = {
+			{"LoadTextFile", ExpanderLoadTextFile},
+			{"LoadString", ExpanderLoadString},
+			{"ExpandFile", ExpanderExpandFile},
+			{"ExpandString", ExpanderExpandString},
+			{0, 0}
+		};
+
+		lua_createtable(l, 0, sizeof(methods) / sizeof(luaL_Reg) - 1);
+
+		for(reg = methods; reg->name; reg++)
+		{
+			lua_pushcfunction(l, reg->func);
+			lua_setfield(l, -2, reg->name);
+		}
+
+		lua_setfield(l, -2, "__index");
+		lua_pushcfunction(l, ExpanderGC);
+		lua_setfield(l, -2, "__gc");
+	}
+
+	lua_setmetatable(l, -2);
+
+	if(!(e->ctx = NewLuaContext(l)))
+		return luaL_error(l, "Failed to create expander context");
+
+	if(hasOpts)
+	{
+		lfv_options opts;
+		opts.readSize = OptionField(l, 1, "readSize");
+		opts.minFlush = OptionField(l, 1, "minFlush");
+		opts.maxMemory = OptionField(l, 1, "maxMemory");
+		opts.maxOutput = OptionField(l, 1, "maxOutput");
+		opts.maxOutputRatio = OptionField(l, 1, "maxOutputRatio");
+		opts.maxDuplications = OptionField(l, 1, "maxDuplications");
+		opts.maxTime = OptionField(l, 1, "maxTime");
+		lfvContextSetOptions(e->ctx, &opts);
+	}
+
+	return 1;
 }
 
 /*--------------------------------------
@@ -270,13 +773,44 @@ int lfvCLuaEnsureSearcher(lua_State* l)
 int	lfvCLuaSearcher(lua_State* l)
 {
 	const char* moduleName = luaL_checkstring(l, 1);
-	const char* modulePath = FindModulePath(l, moduleName);
-	int err, bin;
+	FILE* f = FindModule(l, moduleName);
+	const char* modulePath;
+	lfv_context* ctx;
+	lfv_file_hash hash;
+	bytecode bc;
+	int err, bin = 0, mode = (int)ATOMIC_GET(&bytecodeMode), hashed;
 
-	if(!modulePath)
+	if(!f)
 		return 0;
 
-	err = lfvLoadTextFile(l, modulePath, 0, 0, &bin);
+	modulePath = lua_tostring(l, -1);
+
+	/* The hash is shared by the bytecode and disk caches so the module is only read once more */
+	hashed = mode && lfvHashFile(f, 0, &hash);
+	bc.path[0] = 0;
+
+	if(hashed && LoadBytecode(l, &hash, modulePath, mode == BYTECODE_STRIP, &bc) == LUA_OK)
+	{
+		fclose(f);
+		lua_insert(l, -2);
+		return 2;
+	}
+
+	if(!(ctx = NewLuaContext(l)))
+	{
+		fclose(f);
+		return luaL_error(l, "Failed to create expansion context");
+	}
+
+	SetLuaLogSink(l, ctx);
+	err = LoadChunk(ctx, l, 0, 0, f, hashed ? &hash : 0, modulePath, 0, 0, &bin,
+		USE_MEMORY_CACHE | USE_DISK_CACHE);
+
+	if(err == LUA_OK && mode)
+		StoreBytecode(l, mode == BYTECODE_STRIP, &bc);
+
+	fclose(f);
+	lfvFreeContext(ctx);
 
 	if(err == LUA_OK)
 	{
@@ -296,178 +830,1112 @@ int	lfvCLuaSearcher(lua_State* l)
 }
 
 /*--------------------------------------
-	ReaderLua
+	lfvCLuaSetLogSink
 --------------------------------------*/
-static const char* ReaderLua(lua_State* l, void* data, size_t* size)
+int lfvCLuaSetLogSink(lua_State* l)
 {
-	const char* res = lfvReader(data, size);
-	lfv_reader_state* s = (lfv_reader_state*)data;
-	(void)l; /* Suppress unreferenced parameter warning */
+	int type = lua_type(l, 1);
+	size_t flushSize = 0;
 
-	if(s->earliestError)
+	if(type != LUA_TNONE && type != LUA_TNIL && type != LUA_TSTRING && type != LUA_TFUNCTION)
+		return luaL_argerror(l, 1, "expected log path, function or nil");
+
+	if(!lua_isnoneornil(l, 2))
 	{
-		*size = 0;
-		return 0;
+		lua_Number n = luaL_checknumber(l, 2);
+		flushSize = n >= 1 ? (size_t)n : 1;
 	}
 
-	return res;
-}
-
-/*--------------------------------------
-	SetupLoadReturn
-
-Adjusts lua_load's pushed and returned values to account for expansion errors.
---------------------------------------*/
-static int SetupLoadReturn(lua_State* l, const lfv_reader_state* rs, int loadRet)
-{
-	char nameBuf[LFV_NAME_BUF_SIZE];
-	const char* splitter;
+	/* Finish the old sink first so its logs are written before any new ones */
+	FreeLuaLogSink(l);
 
-	if(!rs->earliestError)
-		return loadRet; /* Nothing to add */
-
-	if(loadRet == LUA_OK)
+	if(type == LUA_TSTRING)
 	{
-		/* lua_load loaded something despite failed expansion; destroy it */
-		lua_pop(l, 1);
-	}
+		const char* path = lua_tostring(l, 1);
+		lua_log_sink* sink = (lua_log_sink*)lua_newuserdata(l, sizeof(lua_log_sink));
+		sink->buffer = 0;
 
-	splitter = loadRet == LUA_OK ? "" : "\n";
+		if(luaL_newmetatable(l, LOG_SINK_META))
+		{
+			lua_pushcfunction(l, LogSinkGC);
+			lua_setfield(l, -2, "__gc");
+		}
 
-	lua_pushfstring(l, "Expansion error ('%s' ln %d): %s%s",
-		lfvResolveName(rs, nameBuf, sizeof(nameBuf)),
-		(int)rs->errorLine,
-		rs->earliestError,
-		splitter
-	);
+		lua_setmetatable(l, -2);
 
-	if(loadRet != LUA_OK)
+		if(!(sink->buffer = lfvNewLogBuffer(path, flushSize)))
+			return luaL_error(l, "Failed to open log '%s': %s", path, strerror(errno));
+
+		lua_setfield(l, LUA_REGISTRYINDEX, LOG_SINK_KEY);
+	}
+	else if(type == LUA_TFUNCTION)
 	{
-		lua_insert(l, -2); /* Put expansion error first */
-		lua_concat(l, 2); /* Concatenate expansion and lua_load error strings */
+		lua_pushvalue(l, 1);
+		lua_setfield(l, LUA_REGISTRYINDEX, LOG_SINK_KEY);
 	}
 
-	/* We'll assume lua_load failed due to expansion failing, so LFV error takes priority */
-	return ConvertErrorLfvToLuaLoad(rs->errorCode);
+	return 0;
 }
 
 /*--------------------------------------
-	ConvertErrorLfvToLuaLoad
+	lfvCLuaSetCacheLimit
 --------------------------------------*/
-static int ConvertErrorLfvToLuaLoad(int lfvCode)
+int lfvCLuaSetCacheLimit(lua_State* l)
 {
-	switch(lfvCode)
-	{
-	case LFV_OK:
-		return LUA_OK;
-	case LFV_ERR_BINARY:
-		return LUA_ERRSYNTAX;
-	case LFV_ERR_SYNTAX:
-		return LUA_ERRSYNTAX;
-	case LFV_ERR_RUNTIME:
-		return LUA_ERRSYNTAX;
-	case LFV_ERR_MEMORY:
-		return LUA_ERRMEM;
-	case LFV_ERR_FILE:
-		return LUA_ERRFILE;
-	default:
-		return LUA_ERRSYNTAX;
-	}
+	lua_Number n = luaL_optnumber(l, 1, 0);
+	size_t limit;
+
+	if(!(n >= 0)) /* Also catches NaN */
+		return luaL_argerror(l, 1, "expected a non-negative number of bytes");
+
+	limit = n >= (lua_Number)((size_t)-1) ? (size_t)-1 : (size_t)n;
+	WRITE_LOCK_CACHE(&cache);
+	cache.limit = limit;
+	TrimCache(limit);
+	WRITE_UNLOCK_CACHE(&cache);
+	return 0;
 }
 
 /*--------------------------------------
-	FindModulePath
-
-OUT	[sFilePath]
-
-Returns and pushes sFilePath, or returns 0 and pushes nothing.
+	lfvCLuaGetCacheStats
 --------------------------------------*/
-static const char* FindModulePath(lua_State* l, const char* moduleName)
+int lfvCLuaGetCacheStats(lua_State* l)
 {
-	const char* separatedModuleName;
-	int pathType;
-	const char *curPath, *nextPath, *finalPath = 0;
+	size_t numEntries, used;
+
+	READ_LOCK_CACHE(&cache);
+	numEntries = cache.numEntries;
+	used = cache.used;
+	READ_UNLOCK_CACHE(&cache);
+	lua_pushinteger(l, (lua_Integer)ATOMIC_GET(&cache.numHits));
+	lua_pushinteger(l, (lua_Integer)ATOMIC_GET(&cache.numMisses));
+	lua_pushinteger(l, (lua_Integer)numEntries);
+	lua_pushinteger(l, (lua_Integer)used);
+	return 4;
+}
+
+/*--------------------------------------
+	lfvCLuaSetCacheDir
+--------------------------------------*/
+int lfvCLuaSetCacheDir(lua_State* l)
+{
+	if(!lfvSetCacheDir(luaL_optstring(l, 1, 0)))
+		return luaL_error(l, "Failed to set cache directory");
+
+	return 0;
+}
+
+/*--------------------------------------
+	lfvCLuaSetBytecodeCache
+--------------------------------------*/
+int lfvCLuaSetBytecodeCache(lua_State* l)
+{
+	ATOMIC_SET(&bytecodeMode, !lua_toboolean(l, 1) ? BYTECODE_OFF :
+		lua_toboolean(l, 2) ? BYTECODE_STRIP : BYTECODE_ON);
+
+	return 0;
+}
+
+/*--------------------------------------
+	NewLuaContext
+
+Returns a new context that allocates with l's allocator or 0 on failure.
+--------------------------------------*/
+static lfv_context* NewLuaContext(lua_State* l)
+{
+	void* ud;
+	lua_Alloc alloc = lua_getallocf(l, &ud);
+	return lfvNewContextAlloc(alloc, ud);
+}
+
+/*--------------------------------------
+	ReaderLua
+--------------------------------------*/
+static const char* ReaderLua(lua_State* l, void* data, size_t* size)
+{
+	const char* res = lfvReader(data, size);
+	lfv_reader_state* s = (lfv_reader_state*)data;
+	(void)l; /* Suppress unreferenced parameter warning */
+
+	if(s->earliestError)
+	{
+		*size = 0;
+		return 0;
+	}
+
+	return res;
+}
+
+/*--------------------------------------
+	ReaderCapture
+
+Like ReaderLua, but also appends each piece to the capture's entry and disk cache.
+--------------------------------------*/
+static const char* ReaderCapture(lua_State* l, void* data, size_t* size)
+{
+	capture* cap = (capture*)data;
+	const char* res = ReaderLua(l, cap->rs, size);
+
+	if(cap->disk)
+		lfvWriteDiskCache(res, *size, cap->disk);
+
+	AppendCapture(cap, res, *size);
+	return res;
+}
+
+/*--------------------------------------
+	SetupLoadReturn
+
+Adjusts lua_load's pushed and returned values to account for expansion errors. If expansion
+failed, whatever lua_load pushed is replaced with the expansion error. Stats in blocks are streamed
+before they end, so a lua_load error is usually just the stream stopping mid-block.
+--------------------------------------*/
+static int SetupLoadReturn(lua_State* l, const lfv_reader_state* rs, int loadRet)
+{
+	char nameBuf[LFV_NAME_BUF_SIZE];
+
+	if(!rs->earliestError)
+		return loadRet; /* Nothing to add */
+
+	/* Destroy the loaded function or the error of the truncated stream */
+	lua_pop(l, 1);
+
+	lua_pushfstring(l, "Expansion error ('%s' ln %d): %s",
+		lfvResolveName(rs, nameBuf, sizeof(nameBuf)),
+		(int)rs->errorLine,
+		rs->earliestError
+	);
+
+	return ConvertErrorLfvToLuaLoad(rs->errorCode);
+}
+
+/*--------------------------------------
+	ConvertErrorLfvToLuaLoad
+--------------------------------------*/
+static int ConvertErrorLfvToLuaLoad(int lfvCode)
+{
+	switch(lfvCode)
+	{
+	case LFV_OK:
+		return LUA_OK;
+	case LFV_ERR_BINARY:
+		return LUA_ERRSYNTAX;
+	case LFV_ERR_SYNTAX:
+		return LUA_ERRSYNTAX;
+	case LFV_ERR_RUNTIME:
+		return LUA_ERRSYNTAX;
+	case LFV_ERR_MEMORY:
+		return LUA_ERRMEM;
+	case LFV_ERR_FILE:
+		return LUA_ERRFILE;
+	default:
+		return LUA_ERRSYNTAX;
+	}
+}
+
+/*--------------------------------------
+	FindModule
+
+OUT	[sFilePath]
+
+Returns the opened file of moduleName found with package.path and pushes its sFilePath, or returns
+0 and pushes nothing.
+
+Results, including failures, are cached per state until package.path changes, so later requires
+of the same module open only the file they load. A cached path that fails to open is searched
+for again.
+--------------------------------------*/
+static FILE* FindModule(lua_State* l, const char* moduleName)
+{
+	FILE* f = 0;
+	int type;
 
 	luaL_checkstack(l, 4, 0);
-	separatedModuleName = luaL_gsub(l, moduleName, ".", LUA_DIRSEP);
-	pathType = GetGlobalTableField(l, "package", "path");
 
-	if(pathType != LUA_TSTRING)
-		return (lua_pop(l, 2), (const char*)0);
+	if(GetGlobalTableField(l, "package", "path") != LUA_TSTRING)
+		return (lua_pop(l, 1), (FILE*)0);
+
+	PushPathCache(l, -1);
+	type = cross_lua_getfield(l, -1, moduleName);
+
+	if(type == LUA_TBOOLEAN)
+		return (lua_pop(l, 3), (FILE*)0); /* Known miss */
+
+	if(type == LUA_TSTRING && (f = fopen(lua_tostring(l, -1), "r")))
+	{
+		/* Remove cache and package.path */
+		lua_remove(l, -2);
+		lua_remove(l, -2);
+		return f;
+	}
+
+	lua_pop(l, 1);
+
+	if((f = OpenModuleFile(l, lua_tostring(l, -2), moduleName)))
+	{
+		lua_pushvalue(l, -1);
+		lua_setfield(l, -3, moduleName);
+		lua_remove(l, -2);
+		lua_remove(l, -2);
+	}
+	else
+	{
+		lua_pushboolean(l, 0);
+		lua_setfield(l, -2, moduleName);
+		lua_pop(l, 2);
+	}
+
+	return f;
+}
+
+/*--------------------------------------
+	PushPathCache
+
+OUT	Cache
+
+Pushes the registry table mapping module names to the paths FindModule found for them, or to
+false if none were found. Cache[0] is the package.path string it was built with; if path, the
+index of the current package.path, differs, the table is replaced with an empty one.
+--------------------------------------*/
+static void PushPathCache(lua_State* l, int path)
+{
+	path = cross_lua_absindex(l, path);
+	luaL_checkstack(l, 3, 0);
+
+	if(cross_lua_getfield(l, LUA_REGISTRYINDEX, PATH_CACHE_KEY) == LUA_TTABLE)
+	{
+		cross_lua_rawgeti(l, -1, 0);
+
+		if(lua_rawequal(l, -1, path))
+		{
+			lua_pop(l, 1);
+			return;
+		}
+
+		lua_pop(l, 1);
+	}
+
+	lua_pop(l, 1);
+	lua_newtable(l);
+	lua_pushvalue(l, path);
+	lua_rawseti(l, -2, 0);
+	lua_pushvalue(l, -1);
+	lua_setfield(l, LUA_REGISTRYINDEX, PATH_CACHE_KEY);
+}
+
+/*--------------------------------------
+	OpenModuleFile
 
-	curPath = lua_tostring(l, -1);
+OUT	[sFilePath]
+
+Tries each template in path with its marks replaced by moduleName, with '.' replaced by the
+directory separator. Returns the first file that opens and pushes its sFilePath, or returns 0 and
+pushes nothing.
+
+Candidates are built in a char buffer, so a failed one allocates nothing. A candidate too long for
+FILENAME_MAX chars is skipped since it can't be opened anyway.
+--------------------------------------*/
+static FILE* OpenModuleFile(lua_State* l, const char* path, const char* moduleName)
+{
+	char name[FILENAME_MAX], buf[FILENAME_MAX];
+	size_t nameLen = 0, markLen = strlen(CROSS_LUA_PATH_MARK);
+	const char *c, *cur = path;
 
-	while(curPath)
+	for(c = moduleName; *c; c++)
 	{
-		size_t len;
-		const char *truncatedPath, *substitutedPath;
-		FILE* file;
+		if(!(*c == '.' ? AppendPath(name, &nameLen, LUA_DIRSEP, strlen(LUA_DIRSEP)) :
+		AppendPath(name, &nameLen, c, 1)))
+			return 0;
+	}
 
-		nextPath = strchr(curPath, *CROSS_LUA_PATH_SEP);
+	while(cur)
+	{
+		const char* next = strchr(cur, *CROSS_LUA_PATH_SEP);
+		const char* end = next ? next : cur + strlen(cur);
+		size_t num = 0;
+		int fits = 1;
+		FILE* f;
 
-		if(nextPath)
+		for(c = cur; c < end && fits; )
 		{
-			len = nextPath - curPath;
-			nextPath++;
+			if((size_t)(end - c) >= markLen && !strncmp(c, CROSS_LUA_PATH_MARK, markLen))
+			{
+				fits = AppendPath(buf, &num, name, nameLen);
+				c += markLen;
+			}
+			else
+				fits = AppendPath(buf, &num, c++, 1);
 		}
-		else
-			len = strlen(curPath);
 
-		truncatedPath = cross_lua_pushlstring(l, curPath, len);
-		substitutedPath = luaL_gsub(l, truncatedPath, CROSS_LUA_PATH_MARK, separatedModuleName);
-		lua_remove(l, -2); /* truncatedPath */
-		file = fopen(substitutedPath, "r");
+		cur = next ? next + 1 : 0;
 
-		if(file)
+		if(!fits)
+			continue;
+
+		buf[num] = 0;
+
+		if((f = fopen(buf, "r")))
 		{
-			fclose(file);
-			finalPath = substitutedPath;
+			lua_pushlstring(l, buf, num);
+			return f;
+		}
+	}
+
+	return 0;
+}
+
+/*--------------------------------------
+	AppendPath
+
+Appends len chars of str to the *num chars in buf, which has room for FILENAME_MAX. Returns 0 if
+they wouldn't leave room for a null char.
+--------------------------------------*/
+static int AppendPath(char* buf, size_t* num, const char* str, size_t len)
+{
+	if(FILENAME_MAX - *num <= len)
+		return 0;
+
+	memcpy(buf + *num, str, len);
+	*num += len;
+	return 1;
+}
+
+/*--------------------------------------
+	CacheLimit
+
+Returns the cache limit, 0 if the cache is disabled.
+--------------------------------------*/
+static size_t CacheLimit(void)
+{
+	size_t limit;
+	READ_LOCK_CACHE(&cache);
+	limit = cache.limit;
+	READ_UNLOCK_CACHE(&cache);
+	return limit;
+}
+
+/*--------------------------------------
+	InitCacheKey
+
+Makes the key of len chars of data, a chunk or, if isFile, a file path. A file's key also has its
+size and modification time, so an edited file doesn't match its old entry. Returns 0 if the file
+can't be stat'd.
+--------------------------------------*/
+static int InitCacheKey(cache_key* k, const char* data, size_t len, int isFile, int force)
+{
+	k->data = data;
+	k->len = len;
+	k->isFile = isFile;
+	k->force = force != 0;
+	k->fileSize = k->mtime = 0;
+
+	if(isFile)
+	{
+		struct stat st;
+
+		if(stat(data, &st))
+			return 0;
+
+		k->fileSize = (long long)st.st_size;
+		k->mtime = (long long)st.st_mtime * 1000000000LL + STAT_MTIME_NSEC(st);
+	}
+
+	k->hash = HashBytes(data, len, HASH_OFFSET);
+	k->hash = HashBytes(&k->fileSize, sizeof(k->fileSize), k->hash);
+	k->hash = HashBytes(&k->mtime, sizeof(k->mtime), k->hash);
+	return 1;
+}
+
+/*--------------------------------------
+	HashBytes
+
+Continues an FNV-1a hash with len bytes at p.
+--------------------------------------*/
+static unsigned long long HashBytes(const void* p, size_t len, unsigned long long hash)
+{
+	const unsigned char *c = (const unsigned char*)p, *end = c + len;
+
+	for(; c < end; c++)
+		hash = (hash ^ *c) * HASH_PRIME;
+
+	return hash;
+}
+
+/*--------------------------------------
+	FindCacheEntry
+
+Returns the entry matching key with a reference the caller must release with ReleaseCacheEntry, or
+returns 0. Counts the hit or miss if the cache is enabled. limit is set to the cache limit, 0 if
+it's disabled.
+--------------------------------------*/
+static cache_entry* FindCacheEntry(const cache_key* k, size_t* limit)
+{
+	cache_entry* e = 0;
+
+	READ_LOCK_CACHE(&cache);
+
+	if((*limit = cache.limit) && (e = FindCacheBucket(k)))
+	{
+		ATOMIC_ADD(&e->refs, 1);
+		ATOMIC_SET(&e->used, 1);
+	}
+
+	READ_UNLOCK_CACHE(&cache);
+
+	if(*limit)
+		ATOMIC_ADD(e ? &cache.numHits : &cache.numMisses, 1);
+
+	return e;
+}
+
+/*--------------------------------------
+	FindCacheBucket
+
+Returns the entry matching key or 0. The cache must be locked.
+--------------------------------------*/
+static cache_entry* FindCacheBucket(const cache_key* k)
+{
+	cache_entry* e = cache.buckets ? cache.buckets[k->hash & (cache.numBuckets - 1)] : 0;
+
+	for(; e; e = e->chain)
+	{
+		if(e->key.hash == k->hash && e->key.len == k->len && e->key.isFile == k->isFile &&
+		e->key.force == k->force && e->key.fileSize == k->fileSize && e->key.mtime == k->mtime &&
+		!memcmp(e->key.data, k->data, k->len))
 			break;
+	}
+
+	return e;
+}
+
+/*--------------------------------------
+	ReleaseCacheEntry
+
+Drops a reference to e, freeing it if that was the last. Entries removed from the cache are freed
+once the last load reading them is done.
+--------------------------------------*/
+static void ReleaseCacheEntry(cache_entry* e)
+{
+	if(!ATOMIC_ADD(&e->refs, -1))
+		free(e);
+}
+
+/*--------------------------------------
+	StartCapture
+
+Allocates an entry for key with room for some expanded text. Nothing is captured if even the key
+wouldn't fit in limit bytes or allocation fails.
+--------------------------------------*/
+static void StartCapture(capture* cap, const cache_key* key, size_t limit)
+{
+	size_t size = sizeof(cache_entry) + key->len + 2;
+	cache_entry* e;
+
+	cap->limit = limit;
+	cap->entry = 0;
+
+	if(size > limit)
+		return;
+
+	size = size + CAPTURE_MIN_SIZE > limit ? limit : size + CAPTURE_MIN_SIZE;
+
+	if(!(e = (cache_entry*)malloc(size)))
+		return;
+
+	e->key = *key;
+	e->textLen = 0;
+	e->size = size;
+	memcpy(e + 1, key->data, key->len);
+	((char*)(e + 1))[key->len] = 0;
+	cap->entry = e;
+}
+
+/*--------------------------------------
+	AppendCapture
+
+Appends len chars of text to the capture's entry. The capture is dropped once the entry would
+outgrow the cache limit or fails to grow.
+--------------------------------------*/
+static void AppendCapture(capture* cap, const char* text, size_t len)
+{
+	cache_entry* e = cap->entry;
+	size_t need;
+
+	if(!e || !len)
+		return;
+
+	need = sizeof(cache_entry) + e->key.len + 1 + e->textLen + len + 1;
+
+	if(need > cap->limit)
+	{
+		DropCapture(cap);
+		return;
+	}
+
+	if(need > e->size)
+	{
+		size_t newSize = e->size * 2 < need ? need : e->size * 2;
+		cache_entry* grown;
+
+		if(newSize > cap->limit)
+			newSize = cap->limit;
+
+		if(!(grown = (cache_entry*)realloc(e, newSize)))
+		{
+			DropCapture(cap);
+			return;
 		}
 
-		lua_pop(l, 1); /* substitutedPath */
-		curPath = nextPath;
+		e = cap->entry = grown;
+		e->size = newSize;
 	}
 
-	/* Remove package.path and separatedModuleName */
-	if(finalPath)
+	memcpy(ENTRY_TEXT(e) + e->textLen, text, len);
+	e->textLen += len;
+}
+
+/*--------------------------------------
+	StoreCapture
+
+Shrinks the captured entry to fit its text and inserts it into the cache.
+--------------------------------------*/
+static void StoreCapture(capture* cap)
+{
+	cache_entry* e = cap->entry;
+	size_t size;
+
+	if(!e)
+		return;
+
+	cap->entry = 0;
+	size = sizeof(cache_entry) + e->key.len + 1 + e->textLen + 1;
+
+	if(size < e->size)
 	{
-		lua_remove(l, -2);
-		lua_remove(l, -2);
+		cache_entry* shrunk = (cache_entry*)realloc(e, size);
+
+		if(shrunk)
+		{
+			e = shrunk;
+			e->size = size;
+		}
+	}
+
+	e->key.data = (const char*)(e + 1);
+	ENTRY_TEXT(e)[e->textLen] = 0;
+	e->refs = 1;
+	e->used = 1;
+	InsertCacheEntry(e);
+}
+
+/*--------------------------------------
+	DropCapture
+--------------------------------------*/
+static void DropCapture(capture* cap)
+{
+	free(cap->entry);
+	cap->entry = 0;
+}
+
+/*--------------------------------------
+	InsertCacheEntry
+
+Inserts e behind the clock hand, so it's the last entry considered for eviction, then evicts until
+the cache is within its limit. e is freed instead if the cache is disabled, an equal entry was
+inserted by another load meanwhile, or the buckets fail to grow. They're doubled when there are as
+many entries.
+--------------------------------------*/
+static void InsertCacheEntry(cache_entry* e)
+{
+	cache_entry** bucket;
+
+	WRITE_LOCK_CACHE(&cache);
+
+	if(e->size > cache.limit || FindCacheBucket(&e->key))
+	{
+		WRITE_UNLOCK_CACHE(&cache);
+		free(e);
+		return;
+	}
+
+	if(cache.numEntries >= cache.numBuckets)
+	{
+		size_t i, num = cache.numBuckets ? cache.numBuckets * 2 : CACHE_MIN_BUCKETS;
+		cache_entry** buckets = (cache_entry**)calloc(num, sizeof(cache_entry*));
+
+		if(!buckets)
+		{
+			WRITE_UNLOCK_CACHE(&cache);
+			free(e);
+			return;
+		}
+
+		for(i = 0; i < cache.numBuckets; i++)
+		{
+			cache_entry *it, *next;
+
+			for(it = cache.buckets[i]; it; it = next)
+			{
+				next = it->chain;
+				bucket = &buckets[it->key.hash & (num - 1)];
+				it->chain = *bucket;
+				*bucket = it;
+			}
+		}
+
+		free(cache.buckets);
+		cache.buckets = buckets;
+		cache.numBuckets = num;
+	}
+
+	bucket = &cache.buckets[e->key.hash & (cache.numBuckets - 1)];
+	e->chain = *bucket;
+	*bucket = e;
+
+	if(cache.hand)
+	{
+		e->next = cache.hand;
+		e->prev = cache.hand->prev;
+		e->prev->next = e;
+		cache.hand->prev = e;
 	}
 	else
-		lua_pop(l, 2);
-	
-	return finalPath;
+		cache.hand = e->next = e->prev = e;
+
+	cache.numEntries++;
+	cache.used += e->size;
+	TrimCache(cache.limit);
+	WRITE_UNLOCK_CACHE(&cache);
+}
+
+/*--------------------------------------
+	RemoveCacheEntry
+
+Removes e from the cache and drops the cache's reference. The cache must be locked for writing.
+--------------------------------------*/
+static void RemoveCacheEntry(cache_entry* e)
+{
+	cache_entry** link = &cache.buckets[e->key.hash & (cache.numBuckets - 1)];
+
+	while(*link != e)
+		link = &(*link)->chain;
+
+	*link = e->chain;
+
+	if(e->next == e)
+		cache.hand = 0;
+	else
+	{
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+
+		if(cache.hand == e)
+			cache.hand = e->next;
+	}
+
+	cache.numEntries--;
+	cache.used -= e->size;
+	ReleaseCacheEntry(e);
+}
+
+/*--------------------------------------
+	TrimCache
+
+Evicts entries until no more than limit bytes are used. The clock hand skips each entry that was
+looked up since it last passed, clearing its used flag, and evicts the first one that wasn't. If
+limit is 0, everything is evicted. The cache must be locked for writing.
+--------------------------------------*/
+static void TrimCache(size_t limit)
+{
+	while(cache.used > limit && cache.hand)
+	{
+		cache_entry* e = cache.hand;
+
+		if(limit && ATOMIC_GET(&e->used))
+		{
+			ATOMIC_SET(&e->used, 0);
+			cache.hand = e->next;
+		}
+		else
+			RemoveCacheEntry(e);
+	}
+}
+
+/*--------------------------------------
+	LoadBytecode
+
+OUT	[CompiledChunk]
+
+Loads the bytecode kept for the module at modulePath if it was compiled from the same contents.
+hash is the module file's lfvHashFile hash without force, made on every load; the cache file's
+header, which holds it along with LFV_VERSION and LUA_VERSION_NUM, must match the one made from
+it exactly. Returns LUA_OK if the chunk was loaded. Otherwise, nothing is pushed and bc is set up
+for StoreBytecode.
+
+The cache file is named after the path rather than the contents, so only one file is kept per
+module. Bytecode is loaded without the checks done on source, so this is only done for files in
+the lfvSetCacheDir directory written by StoreBytecode.
+--------------------------------------*/
+static int LoadBytecode(lua_State* l, const lfv_file_hash* hash, const char* modulePath,
+	int strip, bytecode* bc)
+{
+	char name[64], header[BYTECODE_HEADER_MAX];
+	file_reader fr;
+	int ret = LUA_ERRFILE;
+
+	sprintf(name, "%016llx-%d%s.luac", HashBytes(modulePath, strlen(modulePath), HASH_OFFSET),
+		LUA_VERSION_NUM, strip ? "s" : "");
+
+	if(!lfvDiskCachePath(name, bc->path, sizeof(bc->path)) ||
+	(bc->headerLen = snprintf(bc->header, sizeof(bc->header), BYTECODE_HEADER_FORMAT,
+	LFV_VERSION, LUA_VERSION_NUM, hash->hi, hash->lo, hash->len)) >= (int)sizeof(bc->header) ||
+	bc->headerLen < 0)
+	{
+		bc->path[0] = 0;
+		return ret;
+	}
+
+	if(!(fr.f = fopen(bc->path, "rb")))
+		return ret;
+
+	if(fread(header, 1, bc->headerLen, fr.f) == (size_t)bc->headerLen &&
+	!memcmp(header, bc->header, bc->headerLen) &&
+	(ret = cross_lua_load(l, ReaderFile, (void*)&fr, modulePath, "b")) != LUA_OK)
+		lua_pop(l, 1); /* Bytecode of another build, e.g. with different number types */
+
+	fclose(fr.f);
+	return ret;
+}
+
+/*--------------------------------------
+	StoreBytecode
+
+Dumps the function on top of l into bc's cache file after the header made by LoadBytecode. The
+file is written under a temporary name and renamed like the lfvSetCacheDir cache's files.
+--------------------------------------*/
+static void StoreBytecode(lua_State* l, int strip, const bytecode* bc)
+{
+	char tmpPath[FILENAME_MAX];
+	FILE* tmp;
+	int ok;
+
+	if(!bc->path[0])
+		return;
+
+	if(!(tmp = lfvCreateTempFile(bc->path, tmpPath, sizeof(tmpPath))))
+		return;
+
+	ok = fwrite(bc->header, 1, bc->headerLen, tmp) == (size_t)bc->headerLen &&
+		!cross_lua_dump(l, WriteFile, tmp, strip);
+
+	lfvPublishTempFile(tmp, tmpPath, bc->path, ok);
+}
+
+/*--------------------------------------
+	ReaderFile
+--------------------------------------*/
+static const char* ReaderFile(lua_State* l, void* data, size_t* size)
+{
+	file_reader* fr = (file_reader*)data;
+	(void)l; /* Suppress unreferenced parameter warning */
+	*size = fread(fr->buf, 1, sizeof(fr->buf), fr->f);
+	return *size ? fr->buf : 0;
+}
+
+/*--------------------------------------
+	WriteFile
+
+lua_Writer that writes to the FILE ud.
+--------------------------------------*/
+static int WriteFile(lua_State* l, const void* p, size_t size, void* ud)
+{
+	(void)l; /* Suppress unreferenced parameter warning */
+	return fwrite(p, 1, size, (FILE*)ud) != size;
+}
+
+/*--------------------------------------
+	UseCache
+
+Counts l as a user of the cache until it's closed. When the last user is closed, CacheUserGC
+frees the cache's entries and buckets and turns off the cache limit and the bytecode cache, which
+only the Lua module uses, so nothing of the module is left allocated or enabled when it's unloaded.
+The lfvSetCacheDir directory belongs to lfv.c and may have been set by the host, so it's kept.
+--------------------------------------*/
+static void UseCache(lua_State* l)
+{
+	if(cross_lua_getfield(l, LUA_REGISTRYINDEX, CACHE_USER_KEY) != LUA_TNIL)
+	{
+		lua_pop(l, 1);
+		return;
+	}
+
+	lua_pop(l, 1);
+	lua_newuserdata(l, 1);
+
+	if(luaL_newmetatable(l, CACHE_USER_META))
+	{
+		lua_pushcfunction(l, CacheUserGC);
+		lua_setfield(l, -2, "__gc");
+	}
+
+	/* Count before setting the metatable so CacheUserGC can't run uncounted */
+	WRITE_LOCK_CACHE(&cache);
+	cache.numUsers++;
+	WRITE_UNLOCK_CACHE(&cache);
+	lua_setmetatable(l, -2);
+	lua_setfield(l, LUA_REGISTRYINDEX, CACHE_USER_KEY);
+}
+
+/*--------------------------------------
+	CacheUserGC
+--------------------------------------*/
+static int CacheUserGC(lua_State* l)
+{
+	(void)l; /* Suppress unreferenced parameter warning */
+	WRITE_LOCK_CACHE(&cache);
+
+	if(!--cache.numUsers)
+	{
+		TrimCache(0);
+		free(cache.buckets);
+		cache.buckets = 0;
+		cache.numBuckets = 0;
+		cache.limit = 0;
+		ATOMIC_SET(&bytecodeMode, BYTECODE_OFF);
+	}
+
+	WRITE_UNLOCK_CACHE(&cache);
+	return 0;
+}
+
+/*--------------------------------------
+	GenericCLuaLoad
+
+IN	[Expander], sSource, [bForceExpand], [sLogPath]
+OUT	CompiledChunk | (nil, sError)
+
+If e is given, its context is used and the arguments start after it. Otherwise, a context using
+l's allocator is made for the call, and the cache set with lfvCLuaSetCacheLimit is used unless
+sLogPath is given. Expanders skip the cache since their limits apply to each expansion.
+--------------------------------------*/
+static int GenericCLuaLoad(lua_State* l, lua_expander* e, int isFilePath)
+{
+	int arg = e ? 2 : 1;
+	size_t len;
+	const char* source = luaL_checklstring(l, arg, &len);
+	int force = lua_toboolean(l, arg + 1);
+	const char* logPath = luaL_optstring(l, arg + 2, 0);
+	lfv_context* ctx = e ? e->ctx : NewLuaContext(l);
+	int caches = !e && !logPath ? USE_MEMORY_CACHE | USE_DISK_CACHE : 0;
+	int ret;
+
+	if(!ctx)
+	{
+		lua_pushnil(l);
+		lua_pushliteral(l, "Failed to create expansion context");
+		return 2;
+	}
+
+	SetLuaLogSink(l, ctx);
+
+	if(isFilePath)
+		ret = LoadTextFile(ctx, l, source, force, logPath, 0, caches);
+	else
+		ret = LoadChunk(ctx, l, source, len, 0, 0, source, force, logPath, 0, caches);
+
+	if(e)
+		lfvContextSetLogSink(ctx, 0, 0); /* Don't keep a sink that calls l */
+	else
+		lfvFreeContext(ctx);
+
+	if(ret != LUA_OK)
+	{
+		lua_pushnil(l);
+		lua_insert(l, -2);
+		return 2;
+	}
+
+	return 1;
 }
 
 /*--------------------------------------
 	GenericCLuaExpand
 
-IN	sSource, [bForceExpand], [sLogPath]
+IN	[Expander], sSource, [bForceExpand], [sLogPath]
 OUT	sExpanded | (nil, sError)
+
+If e is given, its context is used and the arguments start after it. Otherwise, a context using
+l's allocator is made for the call. The expansion is streamed straight into the result string by
+PushReaderString, which is called in protected mode so the reader state is always terminated.
 --------------------------------------*/
-static int GenericCLuaExpand(lua_State* l, ExpandFunc* func, int isFilePath)
+static int GenericCLuaExpand(lua_State* l, lua_expander* e, int isFilePath)
 {
 	char nameBuf[LFV_NAME_BUF_SIZE];
-	const char* errMsg;
-	unsigned int errLine;
-	const char* source = luaL_checkstring(l, 1);
-	char* expanded = func(source, lua_toboolean(l, 2), luaL_optstring(l, 3, 0), &errMsg, &errLine);
+	const char* errMsg = 0;
+	unsigned int errLine = 0;
+	int arg = e ? 2 : 1;
+	size_t len;
+	const char* source = luaL_checklstring(l, arg, &len);
+	int force = lua_toboolean(l, arg + 1);
+	const char* logPath = luaL_optstring(l, arg + 2, 0);
+	int top = lua_gettop(l);
+	lfv_context* ctx;
+	const char* name;
+	lfv_reader_state rs;
+	FILE* f = 0;
+
+	lua_pushcfunction(l, PushReaderString); /* Before allocating anything it could leak */
+	ctx = e ? e->ctx : NewLuaContext(l);
 
-	if(expanded)
+	if(ctx)
+		SetLuaLogSink(l, ctx);
+
+	if(!ctx)
+		errMsg = "Failed to create expansion context";
+	else if(isFilePath && !(f = fopen(source, "r")))
+		errMsg = strerror(errno);
+	else if(lfvInitContextReaderState(ctx, isFilePath ? 0 : source, len, f, source, force, 1,
+	isFilePath, logPath, &rs))
 	{
-		lua_pushstring(l, expanded);
-		lfvFreeBuffer(expanded);
-		return 1;
+		errMsg = rs.earliestError;
+		errLine = rs.errorLine;
+		lfvTermReaderState(&rs, 1);
 	}
 	else
 	{
-		const char* name = isFilePath ? source : lfvTruncatedName(source, nameBuf, sizeof(nameBuf));
-		lua_pushnil(l);
-		lua_pushfstring(l, "Expansion error ('%s' ln %d): %s", name, (int)errLine, errMsg);
-		return 2;
+		lua_pushlightuserdata(l, &rs);
+
+		if(lua_pcall(l, 1, 1, 0) != LUA_OK)
+			errMsg = "Failed to allocate expanded string";
+		else if(rs.earliestError)
+		{
+			errMsg = rs.earliestError;
+			errLine = rs.errorLine;
+		}
+
+		lfvTermReaderState(&rs, 1);
 	}
+
+	if(f)
+		fclose(f);
+
+	if(e)
+		lfvContextSetLogSink(ctx, 0, 0);
+	else
+		lfvFreeContext(ctx);
+
+	if(!errMsg)
+		return 1;
+
+	lua_settop(l, top);
+	name = isFilePath ? source : lfvTruncatedName(source, nameBuf, sizeof(nameBuf));
+	lua_pushnil(l);
+	lua_pushfstring(l, "Expansion error ('%s' ln %d): %s", name, (int)errLine, errMsg);
+	return 2;
+}
+
+/*--------------------------------------
+	PushReaderString
+
+IN	ReaderState
+OUT	sExpanded
+
+Concatenates everything the reader state gives until it's done.
+--------------------------------------*/
+static int PushReaderString(lua_State* l)
+{
+	lfv_reader_state* rs = (lfv_reader_state*)lua_touserdata(l, 1);
+	luaL_Buffer b;
+	const char* piece;
+	size_t size;
+
+	luaL_buffinit(l, &b);
+
+	while((piece = lfvReader(rs, &size)) && size)
+		luaL_addlstring(&b, piece, size);
+
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/*--------------------------------------
+	CheckExpander
+--------------------------------------*/
+static lua_expander* CheckExpander(lua_State* l)
+{
+	lua_expander* e = (lua_expander*)luaL_checkudata(l, 1, EXPANDER_META);
+
+	if(!e->ctx)
+		luaL_error(l, "Expander has been freed");
+
+	return e;
+}
+
+/*--------------------------------------
+	ExpanderLoadTextFile
+--------------------------------------*/
+static int ExpanderLoadTextFile(lua_State* l)
+{
+	return GenericCLuaLoad(l, CheckExpander(l), 1);
+}
+
+/*--------------------------------------
+	ExpanderLoadString
+--------------------------------------*/
+static int ExpanderLoadString(lua_State* l)
+{
+	return GenericCLuaLoad(l, CheckExpander(l), 0);
+}
+
+/*--------------------------------------
+	ExpanderExpandFile
+--------------------------------------*/
+static int ExpanderExpandFile(lua_State* l)
+{
+	return GenericCLuaExpand(l, CheckExpander(l), 1);
+}
+
+/*--------------------------------------
+	ExpanderExpandString
+--------------------------------------*/
+static int ExpanderExpandString(lua_State* l)
+{
+	return GenericCLuaExpand(l, CheckExpander(l), 0);
+}
+
+/*--------------------------------------
+	ExpanderGC
+--------------------------------------*/
+static int ExpanderGC(lua_State* l)
+{
+	lua_expander* e = (lua_expander*)luaL_checkudata(l, 1, EXPANDER_META);
+	lfvFreeContext(e->ctx);
+	e->ctx = 0;
+	return 0;
+}
+
+/*--------------------------------------
+	OptionField
+
+Returns t[name] as a size or 0 if it's nil.
+--------------------------------------*/
+static size_t OptionField(lua_State* l, int t, const char* name)
+{
+	lua_Number n;
+
+	if(cross_lua_getfield(l, t, name) == LUA_TNIL)
+	{
+		lua_pop(l, 1);
+		return 0;
+	}
+
+	n = lua_tonumber(l, -1);
+
+	if(!lua_isnumber(l, -1) || n < 0)
+		return (size_t)luaL_error(l, "Option '%s' must be a non-negative number", name);
+
+	lua_pop(l, 1);
+	return n >= (lua_Number)((size_t)-1) ? (size_t)-1 : (size_t)n;
 }
 
 /*--------------------------------------
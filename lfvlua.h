@@ -6,6 +6,8 @@
 
 #include "lua.h"
 
+#include "lfv.h"
+
 /*	OUT	CompiledChunk | sError
 
 Loads a text file with vector expansion. Mimics luaL_LoadFile except precompiled chunks return
@@ -20,6 +22,26 @@ int lfvLoadTextFile(lua_State* l, const char* filePath, int forceExpand, const c
 Loads a string with vector expansion. Pushed and returned values mimic lfvLoadTextFile. */
 int lfvLoadString(lua_State* l, const char* chunk, int forceExpand, const char* logPath);
 
+/*	OUT	CompiledChunk | sError
+
+Like lfvLoadString, but takes len chars of chunk, which may contain null chars, and gives lua_load
+name as the chunk name like luaL_loadbuffer. */
+int lfvLoadStringN(lua_State* l, const char* chunk, size_t len, const char* name,
+	int forceExpand, const char* logPath);
+
+/* Like lfvLoadTextFile, but uses ctx's buffers if ctx is not 0 and not already in use. See
+lfvInitContextReaderState. If ctx is 0, expansion memory is allocated with l's allocator. */
+int lfvContextLoadTextFile(lfv_context* ctx, lua_State* l, const char* filePath,
+	int forceExpand, const char* logPath, int* binOut);
+
+/* Like lfvLoadString, but uses ctx's buffers like lfvContextLoadTextFile. */
+int lfvContextLoadString(lfv_context* ctx, lua_State* l, const char* chunk,
+	int forceExpand, const char* logPath);
+
+/* Like lfvLoadStringN, but uses ctx's buffers like lfvContextLoadTextFile. */
+int lfvContextLoadStringN(lfv_context* ctx, lua_State* l, const char* chunk, size_t len,
+	const char* name, int forceExpand, const char* logPath);
+
 /*
 	C LUA FUNCTIONS
 */
@@ -56,9 +78,64 @@ int lfvCLuaEnsureSearcher(lua_State* l);
 	OUT	(Loader, sModulePath) | [sFailReason]
 
 This function can be inserted into package.searchers before the standard .lua file searcher to
-enable vector expansion on require'd scripts. */
+enable vector expansion on require'd scripts. Found paths and failures are cached per state
+until package.path changes. */
 int lfvCLuaSearcher(lua_State* l);
 
+/*	OUT	Expander
+
+Returns an object with the methods LoadTextFile, LoadString, ExpandFile and ExpandString. They
+take the same arguments as the lfv functions of the same names, but keep their buffers in the
+object between calls instead of allocating them each time. */
+int lfvCLuaNewExpander(lua_State* l);
+
+/*	IN	[sLogPath | fSink], [nFlushSize]
+
+Sends the logs of the lfv functions, expanders and lfvCLuaSearcher to a sink. Given a path, logs
+are appended to the file by an lfv_log_buffer's background thread in batches of nFlushSize bytes.
+Given a function, it's called with each expansion's log as a string after the expansion. Given
+nil, logging stops. */
+int lfvCLuaSetLogSink(lua_State* l);
+
+/*	IN	[nBytes]
+
+Keeps up to nBytes of expanded text from the lfv load functions and lfvCLuaSearcher. Eviction is a
+CLOCK (second chance) sweep: a lookup only flags its entry as used, and when the cache is full, a
+hand walks the entries in insertion order, clearing flags and evicting the first entry that wasn't
+used since the hand last passed it. A chunk is looked up by its contents, a file by its path, size
+and modification time; hits are compiled without expanding. Calls with a log path or an expander skip
+the cache. Given 0 or nil, the cache is emptied and disabled. Limits that don't fit in a size_t,
+e.g. math.huge, mean no limit; negative limits raise an error.
+
+The cache is process-wide and shared by every state that called luaopen_lfv, from any thread.
+Lookups only take a read lock, and entries are reference-counted, so compiling a hit doesn't block
+other states. It's emptied and disabled when the last of those states is closed. */
+int lfvCLuaSetCacheLimit(lua_State* l);
+
+/*	OUT	nHits, nMisses, nEntries, nBytes
+
+Returns the lookups of the cache set with lfvCLuaSetCacheLimit so far and its current contents. */
+int lfvCLuaGetCacheStats(lua_State* l);
+
+/*	IN	[sDir]
+
+Calls lfvSetCacheDir, so the lfv load functions and lfvCLuaSearcher keep expanded files in sDir
+between runs. Given nil, the directory stops being used. The directory is process-wide and shared
+with C code calling lfvSetCacheDir, so it stays set after the states using it are closed. Cached
+text is loaded like the file it replaces, so sDir must not be writable by anyone untrusted. */
+int lfvCLuaSetCacheDir(lua_State* l);
+
+/*	IN	[bEnable], [bStrip]
+
+Makes lfvCLuaSearcher keep a lua_dump of each module it compiles in the lfvCLuaSetCacheDir
+directory, stripped of debug info if bStrip is true, after a text header with the hash and
+length of the module's contents and the Lua and LFV versions. Later requires hash the module and,
+if the header matches, load the bytecode, skipping both expansion and Lua's parser. Lua doesn't
+verify bytecode, so the directory must not be writable by anyone untrusted. Like the
+lfvCLuaSetCacheLimit cache, the setting is process-wide and turned off when the last state that
+called luaopen_lfv is closed. */
+int lfvCLuaSetBytecodeCache(lua_State* l);
+
 #endif
 
 /*
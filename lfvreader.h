@@ -6,6 +6,7 @@
 
 #include <setjmp.h>
 #include <stdio.h>
+#include "lfv.h"
 
 /* Error codes */
 #define LFV_OK			0
@@ -14,39 +15,120 @@
 #define LFV_ERR_RUNTIME	3 /* Internal error; bug */
 #define LFV_ERR_MEMORY	4 /* Failed to allocate memory */
 #define LFV_ERR_FILE	5 /* Could not open file */
+#define LFV_ERR_OUTPUT	6 /* Expansion exceeded lfv_options maxOutput */
+#define LFV_ERR_RATIO	7 /* Expansion exceeded lfv_options maxOutputRatio */
+#define LFV_ERR_DUPS	8 /* Expansion exceeded lfv_options maxDuplications */
+#define LFV_ERR_TIME	9 /* Expansion exceeded lfv_options maxTime */
 
 #define LFV_NAME_BUF_SIZE 32
+#define LFV_NULL_TERMINATED ((size_t)-1) /* Chunk length meaning the chunk ends at a null char */
+
+typedef struct lfv_token_s {
+	int			kind, keyword; /* Internal to lfv.c */
+	size_t		offset, size; /* Char index in buf and length of the Name-class chars there */
+	unsigned	line;
+	int			vecPrefix; /* Starts with "v2", "v3" or "q4" */
+} lfv_token;
 
 typedef struct lfv_reader_state_s {
 	jmp_buf		memErrJmp;
 	unsigned	level; /* recursion level */
 	int			streamThruBuf, skipBOMAndPound;
+	int			passVecFree; /* Opted-in chunks without a vector prefix aren't parsed; only
+						   set by loaders, which leave syntax errors to Lua's parser */
 	const char*	chk;
+	const char*	chkEnd; /* End of the string, mapped file or piece chk reads from */
+	void*		map; /* Mapping of f that chk reads from, unmapped by lfvTermReaderState; only
+						   with LFV_USE_MMAP, as truncating f while it's mapped raises SIGBUS */
+	size_t		mapSize;
 	FILE*		f;
+	lfv_source	src; /* Gives the next piece for chk to read from; set to 0 once it ends */
+	void*		srcUd;
+	struct lfv_feed_s* feed; /* Feed whose fed chars chk reads from */
 	const char*	name;
-	char*		buf; /* realloc'd null-terminated parse stream */
+	char*		buf; /* Allocated null-terminated parse stream */
 	size_t		bufSize;
 	size_t		numBuf; /* Excludes null terminator */
 	size_t		tok, tokSize; /* Char index and length in buf */
 	unsigned	line;
 	size_t		beforeSkip; /* tok value before skipping whitespace and comments together */
-	size_t*		marks; /* realloc'd stack of char indices pointing at tokens relevant to vector
+	lfv_token	lex; /* Last token lexed by ExtendTokenClass(s, CC_IDENTIFIER) */
+	size_t*		marks; /* Allocated stack of char indices pointing at tokens relevant to vector
 					   duplication */
 	size_t		numMarksAlloc, numMarks;
+	struct lfv_exp_frame_s* frames; /* Allocated stack of nested exp parse states */
+	size_t		numFramesAlloc, numFrames;
+	struct lfv_open_block_s* blocks; /* Allocated stack of blocks the reader has yet to close */
+	size_t		numBlocksAlloc, numBlocks;
+	struct lfv_context_s* ctx; /* Context buf, marks, frames and blocks were borrowed from */
+	lfv_alloc	alloc; /* Allocates buf, marks, frames and blocks */
+	void*		allocUd;
+	size_t		readSize; /* Chars read at a time */
+	size_t		passSize; /* Chars read at a time when streaming without expansion */
+	size_t		minFlush; /* Streamed stats are sent together until they're this many chars */
+	size_t		maxMemory; /* Limit on memUsed, 0 if none */
+	size_t		memUsed; /* Bytes taken by buf, marks, frames, blocks and fed chars */
+	size_t		maxOutput, maxOutputRatio, maxDuplications; /* Limits from lfv_options, 0 if none */
+	size_t		maxTime; /* Milliseconds of lfvReader calls allowed, 0 if none */
+	size_t		numRead; /* Chars read from the input so far */
+	size_t		numInserted; /* Chars inserted by expansion so far */
+	size_t		numDups; /* Expressions duplicated so far */
+	double		timeStart, timeUsed; /* Milliseconds; clock time the lfvReader call started at
+									minus timeUsed, and time spent in lfvReader calls so far */
 	int			topResult;
 	const char*	earliestError;
 	unsigned	errorLine;
 	int			errorCode;
 	const char*	logPath;
 	FILE*		log;
+	lfv_writer	logWrite; /* Log sink from ctx, used instead of logPath */
+	void*		logUd;
+	char*		logRec; /* Allocated log sent to logWrite when the reader state is terminated */
+	size_t		numLogRec, logRecSize;
 } lfv_reader_state;
 
+/* Fingerprint of a file's contents made by lfvHashFile */
+typedef struct lfv_file_hash_s {
+	unsigned long long hi, lo; /* 128-bit FNV-1a of LFV_VERSION, the force flag and the contents */
+	unsigned long long len; /* Chars in the file */
+} lfv_file_hash;
+
+/* Lookup of a file's expansion in the lfvSetCacheDir cache, see lfvOpenDiskCache */
+typedef struct lfv_disk_cache_s {
+	char*		text; /* Cached expansion allocated with malloc, null-terminated; 0 on a miss */
+	size_t		textLen;
+	lfv_file_hash hash; /* Of the file looked up */
+	FILE*		tmp; /* Temp file a missing expansion is written to, 0 if it couldn't be made */
+	size_t		numTmp; /* Chars of expansion written to tmp */
+	int			tmpErr; /* Writing to tmp failed */
+	char		path[FILENAME_MAX], tmpPath[FILENAME_MAX];
+} lfv_disk_cache;
+
+#if defined(LFV_SCAN_STATS)
+/* Chars the tokenizer's class scans have looked at, for benchmarks; not thread safe */
+extern unsigned long long lfvNumScanned;
+#endif
+
 char*		lfvReader(void* dataIO, size_t* sizeOut);
 int			lfvInitReaderState(const char* chunk, FILE* file, const char* name, int force,
 			int stream, int skipBOMPound, const char* logPath, lfv_reader_state* sOut);
+int			lfvInitContextReaderState(struct lfv_context_s* ctxIO, const char* chunk,
+			size_t chunkLen, FILE* file, const char* name, int force, int stream, int skipBOMPound,
+			const char* logPath, lfv_reader_state* sOut);
+int			lfvInitSourceReaderState(struct lfv_context_s* ctxIO, lfv_source read,
+			void* readUd, const char* name, int force, int stream, int skipBOMPound,
+			const char* logPath, lfv_reader_state* sOut);
 void		lfvTermReaderState(lfv_reader_state* sIO, int freeBuf);
 char*		lfvTruncatedName(const char* name, char* buf, size_t size);
 const char*	lfvResolveName(const lfv_reader_state* s, char* buf, size_t size);
+int			lfvOpenDiskCache(FILE* file, int force, lfv_disk_cache* dcOut);
+int			lfvOpenHashedDiskCache(const lfv_file_hash* hash, lfv_disk_cache* dcOut);
+int			lfvWriteDiskCache(const void* p, size_t size, void* dcIO);
+void		lfvCloseDiskCache(lfv_disk_cache* dcIO, int store);
+int			lfvHashFile(FILE* file, int force, lfv_file_hash* hashOut);
+int			lfvDiskCachePath(const char* name, char* bufOut, size_t size);
+FILE*		lfvCreateTempFile(const char* path, char* tmpPathOut, size_t size);
+void		lfvPublishTempFile(FILE* tmp, const char* tmpPath, const char* path, int store);
 
 #endif
 
@@ -10,6 +10,7 @@
 static const char* programName = 0;
 static const char* inputFilePath = 0;
 static int forceExpansion = 0;
+static const char* cacheDirPath = 0;
 
 /*--------------------------------------
 	LastCharSkipped
@@ -55,12 +56,19 @@ static int ReadOption(const char* const* vals, int num, int* consume)
 	if(!strcmp(vals[0], "-h"))
 	{
 		printf(
-"%s [-h] [-i inputFile] [-f]\n"
+"%s [-h] [-i inputFile] [-f] [-c cacheDir]\n"
 "\n"
 "If inputFile is not given, reads from stdin.\n"
 "\n"
 "If -f is set, vector expansion is forced even if the script does not begin \n"
-"with 'LFV_EXPAND_VECTORS()'.\n",
+"with 'LFV_EXPAND_VECTORS()'.\n"
+"\n"
+"If cacheDir is given, the expansion of inputFile is kept there and reused by \n"
+"later runs while the file is unchanged. The directory must exist.\n"
+"\n"
+"The expansion is written to stdout as it's made. If it fails, the error is \n"
+"written to stderr and the exit status is 1; stdout may then hold a partial \n"
+"expansion, which should be discarded.\n",
 		programName);
 
 		*consume = 1;
@@ -77,6 +85,17 @@ static int ReadOption(const char* const* vals, int num, int* consume)
 		inputFilePath = vals[1];
 		*consume = 2;
 	}
+	else if(!strcmp(vals[0], "-c"))
+	{
+		if(num < 2)
+		{
+			printf("Expected cacheDir after '-c'\n");
+			return 1;
+		}
+
+		cacheDirPath = vals[1];
+		*consume = 2;
+	}
 	else if(!strcmp(vals[0], "-f"))
 	{
 		forceExpansion = 1;
@@ -91,13 +110,21 @@ static int ReadOption(const char* const* vals, int num, int* consume)
 	return 0;
 }
 
+/*--------------------------------------
+	WriteStdout
+--------------------------------------*/
+static int WriteStdout(const void* p, size_t size, void* ud)
+{
+	(void)ud; /* Suppress unreferenced parameter warning */
+	return fwrite(p, 1, size, stdout) != size;
+}
+
 /*--------------------------------------
 	main
 --------------------------------------*/
 int main(int argc, char** argv)
 {
 	int i, errOpt;
-	char* result;
 	const char* errExp;
 	unsigned errLine;
 
@@ -113,17 +140,21 @@ int main(int argc, char** argv)
 		i += consume;
 	}
 
-	result = lfvExpandFile(inputFilePath, forceExpansion, 0, &errExp, &errLine);
+	if(cacheDirPath && !lfvSetCacheDir(cacheDirPath))
+	{
+		printf("Failed to set cache directory\n");
+		return 1;
+	}
 
-	if(errExp)
+	/* Output is written as it's expanded, so some of it may precede an error. The error goes to
+	stderr so it can't be mistaken for part of a redirected expansion. */
+	if(!lfvExpandFileTo(inputFilePath, forceExpansion, 0, WriteStdout, 0, &errExp, &errLine))
 	{
-		printf("Expansion error (ln %u): %s\n", errLine, errExp);
-		lfvFreeBuffer(result);
+		fflush(stdout);
+		fprintf(stderr, "Expansion error (ln %u): %s\n", errLine, errExp);
 		return 1;
 	}
 
-	printf("%s", result);
-	lfvFreeBuffer(result);
 	return 0;
 }
 
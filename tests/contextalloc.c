@@ -0,0 +1,171 @@
+/* contextalloc.c */
+/* Copyright notice is at the end of this file */
+
+/* Checks that a context whose buffers have grown expands without allocating */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lfvreader.h"
+
+typedef struct alloc_count_s {
+	size_t	numAllocs; /* Calls that allocated or grew a block */
+	size_t	numLive; /* Blocks not yet freed */
+} alloc_count;
+
+static const char* const chunks[] = {
+	"LFV_EXPAND_VECTORS()\nlocal v3A = 1, 2, 3\nlocal v3B = v3A * 2 + v3A\nreturn {v3A = v3A}",
+	"LFV_EXPAND_VECTORS()\nfunction F(v2A, b)\n\tif b then v2A = v2A + b end\n\treturn v2A\nend",
+	"LFV_EXPAND_VECTORS()\nt = {v2Pos = 1, 2, v3Dir = f(v3Q), q4Rot = 0, 0, 0, 1, n = 'x'}",
+	"LFV_EXPAND_VECTORS()\nfor i = 1, 10 do do local v2X = g(h(v2Y) * i) end end",
+	"local plain = {1, 2, 3} -- not expanded",
+};
+
+#define NUM_CHUNKS (sizeof(chunks) / sizeof(chunks[0]))
+
+static int numFailed = 0;
+
+static void*	CountingAlloc(void* ud, void* ptr, size_t osize, size_t nsize);
+static void		Check(int cond, const char* what, size_t i);
+static size_t	ExpandAll(lfv_context* ctx, alloc_count* count);
+static size_t	StreamAll(lfv_context* ctx, alloc_count* count);
+
+/*--------------------------------------
+	CountingAlloc
+--------------------------------------*/
+static void* CountingAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	alloc_count* count = (alloc_count*)ud;
+	void* p;
+	(void)osize;
+
+	if(!nsize)
+	{
+		if(ptr)
+			count->numLive--;
+
+		free(ptr);
+		return 0;
+	}
+
+	if(!(p = realloc(ptr, nsize)))
+		return 0;
+
+	count->numAllocs++;
+
+	if(!ptr)
+		count->numLive++;
+
+	return p;
+}
+
+/*--------------------------------------
+	Check
+--------------------------------------*/
+static void Check(int cond, const char* what, size_t i)
+{
+	if(!cond)
+	{
+		printf("FAIL: %s (chunk %lu)\n", what, (unsigned long)i);
+		numFailed++;
+	}
+}
+
+/*--------------------------------------
+	ExpandAll
+
+Expands every chunk with lfvContextExpandString, forced and not. Returns the allocations made.
+--------------------------------------*/
+static size_t ExpandAll(lfv_context* ctx, alloc_count* count)
+{
+	size_t before = count->numAllocs, i;
+
+	for(i = 0; i < NUM_CHUNKS * 2; i++)
+	{
+		const char* err;
+		unsigned line;
+		const char* out = lfvContextExpandString(ctx, chunks[i % NUM_CHUNKS], (int)(i / NUM_CHUNKS),
+			0, &err, &line);
+
+		Check(out != 0, "lfvContextExpandString failed", i % NUM_CHUNKS);
+	}
+
+	return count->numAllocs - before;
+}
+
+/*--------------------------------------
+	StreamAll
+
+Streams every chunk through a context reader state the way the Lua loaders do. Returns the
+allocations made.
+--------------------------------------*/
+static size_t StreamAll(lfv_context* ctx, alloc_count* count)
+{
+	size_t before = count->numAllocs, i;
+
+	for(i = 0; i < NUM_CHUNKS; i++)
+	{
+		lfv_reader_state rs;
+		size_t size;
+
+		if(lfvInitContextReaderState(ctx, chunks[i], strlen(chunks[i]), 0, "chunk", 0, 1, 0, 0,
+		&rs) == LFV_OK)
+		{
+			while(lfvReader(&rs, &size) && size);
+		}
+
+		Check(!rs.earliestError, "streamed expansion failed", i);
+		lfvTermReaderState(&rs, 1);
+	}
+
+	return count->numAllocs - before;
+}
+
+/*--------------------------------------
+	main
+--------------------------------------*/
+int main(void)
+{
+	alloc_count count = {0, 0};
+	lfv_context* ctx = lfvNewContextAlloc(CountingAlloc, &count);
+
+	if(!ctx)
+	{
+		printf("FAIL: lfvNewContextAlloc returned 0\n");
+		return 1;
+	}
+
+	Check(ExpandAll(ctx, &count) > 0, "cold expansion allocated nothing", 0);
+	Check(ExpandAll(ctx, &count) == 0, "warm expansion allocated", 0);
+	StreamAll(ctx, &count);
+	Check(StreamAll(ctx, &count) == 0, "warm streamed expansion allocated", 0);
+	Check(ExpandAll(ctx, &count) == 0, "expansion after streaming allocated", 0);
+	lfvFreeContext(ctx);
+	Check(count.numLive == 0, "blocks left after lfvFreeContext", 0);
+
+	if(numFailed)
+		return 1;
+
+	printf("OK\n");
+	return 0;
+}
+
+/*
+Copyright (C) 2025 Martynas Ceicys
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/